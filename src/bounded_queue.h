@@ -0,0 +1,71 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <queue>
+
+/**
+ * Fixed capacity blocking queue used to join pipeline stages.
+ * Push blocks while the queue is full and Pop blocks while it is empty.
+ * After Close, Push fails and Pop drains the remaining items then fails.
+ */
+template <typename T>
+class BoundedQueue {
+ public:
+  BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+  bool Push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_full.wait(lock, [&] { return closed || items.size() < capacity; });
+    if (closed) {
+      return false;
+    }
+    items.push(std::move(item));
+    not_empty.notify_one();
+    return true;
+  }
+
+  bool Pop(T *item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_empty.wait(lock, [&] { return closed || !items.empty(); });
+    if (items.empty()) {
+      return false;
+    }
+    *item = std::move(items.front());
+    items.pop();
+    not_full.notify_one();
+    return true;
+  }
+
+  bool TryPop(T *item) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (items.empty()) {
+      return false;
+    }
+    *item = std::move(items.front());
+    items.pop();
+    not_full.notify_one();
+    return true;
+  }
+
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    not_full.notify_all();
+    not_empty.notify_all();
+  }
+
+  size_t Size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return items.size();
+  }
+
+ private:
+  size_t capacity;
+  bool closed = false;
+  std::queue<T> items;
+  std::mutex mutex;
+  std::condition_variable not_full;
+  std::condition_variable not_empty;
+};
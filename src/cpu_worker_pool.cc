@@ -0,0 +1,61 @@
+#include "cpu_worker_pool.h"
+
+CPUWorkerPool::~CPUWorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    exit = true;
+  }
+  start_cv.notify_all();
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+}
+
+/**
+ * Runs task(part, part_count) for every part on the threads and returns once
+ * all have finished.
+ */
+void CPUWorkerPool::Run(std::function<void(int part, int part_count)> task) {
+  int part_count;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (threads.empty()) {
+      for (int i = 1; i < thread_count; i++) {
+        threads.emplace_back(&CPUWorkerPool::WorkerLoop, this, i);
+      }
+    }
+    part_count = threads.size() + 1;
+    this->task = task;
+    pending = part_count - 1;
+    generation++;
+  }
+  start_cv.notify_all();
+  task(0, part_count);
+  std::unique_lock<std::mutex> lock(mutex);
+  done_cv.wait(lock, [&] { return pending == 0; });
+  this->task = nullptr;
+}
+
+void CPUWorkerPool::WorkerLoop(int part) {
+  uint64_t seen_generation = 0;
+  while (true) {
+    std::function<void(int, int)> current_task;
+    int part_count;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      start_cv.wait(lock,
+                    [&] { return exit || generation != seen_generation; });
+      if (exit) {
+        return;
+      }
+      seen_generation = generation;
+      current_task = task;
+      part_count = threads.size() + 1;
+    }
+    current_task(part, part_count);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--pending == 0) {
+      done_cv.notify_one();
+    }
+  }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Threads that split a task into parts, for the CPU paths of SATEncoder and
+ * SATDecoder. The workers are started by the first Run. The calling thread
+ * runs part 0 of each task and worker i runs part i + 1.
+ */
+class CPUWorkerPool {
+ private:
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable start_cv;
+  std::condition_variable done_cv;
+  std::function<void(int, int)> task;
+  uint64_t generation = 0;
+  int pending = 0;
+  bool exit = false;
+
+  void WorkerLoop(int part);
+
+ public:
+  // Threads, including the calling thread, read by the first Run.
+  int thread_count = std::max(1, (int)std::thread::hardware_concurrency());
+
+  ~CPUWorkerPool();
+  void Run(std::function<void(int part, int part_count)> task);
+};
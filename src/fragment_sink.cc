@@ -0,0 +1,85 @@
+#include "fragment_sink.h"
+
+FragmentSink::FragmentSink() {}
+
+/**
+ * Starts a new fragment for con, with header_size zeroed bytes in front.
+ * Returns false if the connection cannot provide a message.
+ */
+bool FragmentSink::Begin(server::connection_ptr con, size_t header_size) {
+  current_message = NULL;
+  size_t reserve_size = header_size + (size_t)(1.25 * size_hint);
+  for (server::message_ptr &message : message_pool) {
+    // Only the pool holds messages that websocketpp is done with.
+    if (message.use_count() == 1) {
+      current_message = message;
+      break;
+    }
+  }
+  if (current_message == NULL) {
+    current_message =
+        con->get_message(websocketpp::frame::opcode::binary, reserve_size);
+    if (current_message == NULL) {
+      std::cerr << "[FragmentSink::Begin] Failed to get message" << std::endl;
+      return false;
+    }
+    message_pool.push_back(current_message);
+  }
+  current_message->set_opcode(websocketpp::frame::opcode::binary);
+  current_message->set_prepared(false);
+  current_message->set_header("");
+  current_message->get_raw_payload().clear();
+  current_message->get_raw_payload().reserve(reserve_size);
+  current_message->get_raw_payload().append(header_size, '\0');
+  return true;
+}
+
+/**
+ * Returns the start of the current fragment, where the header reserved by
+ * Begin goes.
+ */
+uint8_t *FragmentSink::Header() {
+  if (current_message == NULL) {
+    return NULL;
+  }
+  return reinterpret_cast<uint8_t *>(&current_message->get_raw_payload()[0]);
+}
+
+size_t FragmentSink::Size() {
+  if (current_message == NULL) {
+    return 0;
+  }
+  return current_message->get_payload().size();
+}
+
+/**
+ * Frames the fragment as a single unmasked binary message, as a server
+ * would, and returns it ready for connection::send.
+ */
+FragmentSink::server::message_ptr FragmentSink::Finish() {
+  using namespace websocketpp;
+  server::message_ptr message = current_message;
+  current_message = NULL;
+  if (message == NULL) {
+    return NULL;
+  }
+  uint64_t payload_size = message->get_payload().size();
+  frame::basic_header header(frame::opcode::binary, payload_size, true, false);
+  frame::extended_header extended_header(payload_size);
+  message->set_header(frame::prepare_header(header, extended_header));
+  message->set_prepared(true);
+  size_hint = 0.9 * size_hint + 0.1 * payload_size;
+  return message;
+}
+
+int FragmentSink::WritePacket(void *opaque, uint8_t *buffer, int buf_size) {
+  FragmentSink *sink = reinterpret_cast<FragmentSink *>(opaque);
+  if (sink->current_message == NULL) {
+    std::cerr << "[FragmentSink::WritePacket] No fragment started"
+              << std::endl;
+    return -1;
+  }
+  sink->current_message->get_raw_payload().append(
+      reinterpret_cast<char *>(buffer), buf_size);
+  return buf_size;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <websocketpp/config/asio_no_tls.hpp>
+#include <websocketpp/server.hpp>
+
+/**
+ * Collects muxer output straight into the payload of a websocket message.
+ * The message is framed here so websocketpp sends it without copying the
+ * payload again. Payloads grow as needed, so large keyframe fragments are
+ * never truncated. Messages are reused once websocketpp has written them,
+ * keeping their capacity, and new ones reserve the typical fragment size.
+ * Begin can reserve space for a header in front of the muxer output, which
+ * is filled in through Header before Finish.
+ */
+class FragmentSink {
+ public:
+  typedef websocketpp::server<websocketpp::config::asio> server;
+
+  FragmentSink();
+  bool Begin(server::connection_ptr con, size_t header_size = 0);
+  uint8_t *Header();
+  size_t Size();
+  server::message_ptr Finish();
+  static int WritePacket(void *opaque, uint8_t *buffer, int buf_size);
+
+ private:
+  std::vector<server::message_ptr> message_pool;
+  server::message_ptr current_message;
+  // Smoothed fragment size, used to size new payloads.
+  double size_hint = 64 * 1024;
+};
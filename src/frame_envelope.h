@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * Binary header sent in front of each fMP4 fragment when the client asks
+ * for it with "envelope" in its videoRequest. It replaces the JSON image
+ * message, so each frame is a single websocket message and carries the gaze
+ * it was sampled at.
+ * Fields are little endian at fixed offsets. Readers skip header_size bytes
+ * to reach the payload, so later versions may append fields.
+ * Timestamps are microseconds of the server's steady_clock. Only their
+ * differences are meaningful to the client.
+ */
+struct FrameEnvelope {
+  static const uint32_t MAGIC = 0x31564546;  // "FEV1"
+  static const uint16_t VERSION = 1;
+  static const size_t SIZE = 48;
+  enum Kind : uint16_t { INIT_SEGMENT = 0, FRAGMENT = 1 };
+
+  uint16_t version = VERSION;
+  uint16_t header_size = SIZE;
+  uint16_t kind = FRAGMENT;
+  uint32_t frame_number = 0;
+  float center_x = 0.0;
+  float center_y = 0.0;
+  // packetNumber of the frameRequest the frame was sampled at.
+  int64_t packet_number = -1;
+  // Time the gaze sample was received.
+  int64_t capture_timestamp_us = 0;
+  // Time the fragment was handed to the websocket.
+  int64_t send_timestamp_us = 0;
+
+  /** Writes SIZE bytes to buffer. */
+  void Write(uint8_t *buffer) const {
+    uint32_t magic = MAGIC;
+    uint16_t reserved = 0;
+    Put(buffer, 0, magic);
+    Put(buffer, 4, version);
+    Put(buffer, 6, header_size);
+    Put(buffer, 8, kind);
+    Put(buffer, 10, reserved);
+    Put(buffer, 12, frame_number);
+    Put(buffer, 16, center_x);
+    Put(buffer, 20, center_y);
+    Put(buffer, 24, packet_number);
+    Put(buffer, 32, capture_timestamp_us);
+    Put(buffer, 40, send_timestamp_us);
+  }
+
+  /**
+   * Reads an envelope from the start of a message. Returns false if the
+   * message does not start with a supported envelope.
+   */
+  bool Read(const uint8_t *buffer, size_t size) {
+    uint32_t magic = 0;
+    if (size < SIZE) {
+      return false;
+    }
+    Get(buffer, 0, &magic);
+    Get(buffer, 4, &version);
+    Get(buffer, 6, &header_size);
+    if (magic != MAGIC || version < 1 || header_size < SIZE ||
+        header_size > size) {
+      return false;
+    }
+    Get(buffer, 8, &kind);
+    Get(buffer, 12, &frame_number);
+    Get(buffer, 16, &center_x);
+    Get(buffer, 20, &center_y);
+    Get(buffer, 24, &packet_number);
+    Get(buffer, 32, &capture_timestamp_us);
+    Get(buffer, 40, &send_timestamp_us);
+    return true;
+  }
+
+ private:
+  template <size_t N>
+  struct Bits;
+
+  // Fields are written byte by byte, so the layout does not depend on the
+  // host's byte order.
+  template <typename T>
+  static void Put(uint8_t *buffer, size_t offset, T value) {
+    typename Bits<sizeof(T)>::type bits;
+    std::memcpy(&bits, &value, sizeof(T));
+    for (size_t i = 0; i < sizeof(T); i++) {
+      buffer[offset + i] = (uint8_t)(bits >> (8 * i));
+    }
+  }
+  template <typename T>
+  static void Get(const uint8_t *buffer, size_t offset, T *value) {
+    typename Bits<sizeof(T)>::type bits = 0;
+    for (size_t i = 0; i < sizeof(T); i++) {
+      bits |= (typename Bits<sizeof(T)>::type)buffer[offset + i] << (8 * i);
+    }
+    std::memcpy(value, &bits, sizeof(T));
+  }
+};
+
+template <>
+struct FrameEnvelope::Bits<2> {
+  typedef uint16_t type;
+};
+template <>
+struct FrameEnvelope::Bits<4> {
+  typedef uint32_t type;
+};
+template <>
+struct FrameEnvelope::Bits<8> {
+  typedef uint64_t type;
+};
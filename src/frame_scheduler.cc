@@ -0,0 +1,154 @@
+#include "frame_scheduler.h"
+
+FrameScheduler::FrameScheduler() {
+  thread = std::thread(&FrameScheduler::ScheduleLoop, this);
+}
+
+FrameScheduler::~FrameScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    exit_thread = true;
+  }
+  wake_cv.notify_all();
+  thread.join();
+}
+
+void FrameScheduler::AddSession(int session_id, double frame_rate,
+                                std::function<void()> on_release) {
+  using namespace std::chrono;
+  if (!(frame_rate > 0)) {
+    std::cerr << "[FrameScheduler::AddSession] Invalid frame rate "
+              << frame_rate << ", using 30" << std::endl;
+    frame_rate = 30.0;
+  }
+  std::shared_ptr<ScheduledSession> session =
+      std::make_shared<ScheduledSession>();
+  session->session_id = session_id;
+  session->on_release = on_release;
+  session->frame_interval =
+      duration_cast<clock::duration>(duration<double>(1.0 / frame_rate));
+  session->next_deadline = clock::now() + session->frame_interval;
+  std::lock_guard<std::mutex> lock(mutex);
+  sessions[session_id] = session;
+  ScheduleNextRelease(session.get());
+  wake_cv.notify_all();
+}
+
+void FrameScheduler::RemoveSession(int session_id) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = sessions.find(session_id);
+  if (it == sessions.end()) {
+    return;
+  }
+  ScheduledSession *session = it->second.get();
+  std::cout << "[FrameScheduler] Session " << session_id << ": "
+            << session->stats.frame_count << " frames, "
+            << session->stats.deadline_misses << " deadline misses, "
+            << session->stats.skipped_frames << " skipped" << std::endl;
+  sessions.erase(it);
+}
+
+/**
+ * Takes the session's pending release. Returns false if there is none.
+ * A release that is not taken before the next one is counted as skipped.
+ */
+bool FrameScheduler::TakeRelease(int session_id,
+                                 clock::time_point *release_time,
+                                 clock::time_point *deadline) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = sessions.find(session_id);
+  if (it == sessions.end() || !it->second->released) {
+    return false;
+  }
+  ScheduledSession *session = it->second.get();
+  session->released = false;
+  *release_time = session->release_time;
+  *deadline = session->release_deadline;
+  return true;
+}
+
+/**
+ * Called once a released frame is ready to encode.
+ */
+void FrameScheduler::ReportFrameReady(int session_id,
+                                      clock::time_point release_time,
+                                      clock::time_point deadline) {
+  using namespace std::chrono;
+  clock::time_point now = clock::now();
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = sessions.find(session_id);
+  if (it == sessions.end()) {
+    return;
+  }
+  ScheduledSession *session = it->second.get();
+  session->stats.frame_count++;
+  if (now > deadline) {
+    session->stats.deadline_misses++;
+  }
+  double ready_time_ms =
+      duration<double, std::milli>(now - release_time).count();
+  session->ready_time_ms = 0.9 * session->ready_time_ms + 0.1 * ready_time_ms;
+}
+
+FrameScheduler::SessionStats FrameScheduler::GetSessionStats(int session_id) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = sessions.find(session_id);
+  if (it == sessions.end()) {
+    return SessionStats();
+  }
+  return it->second->stats;
+}
+
+/**
+ * Queues the release for the session's next deadline. Sessions are released
+ * twice their smoothed ready time before the deadline, but never more than
+ * one frame early. Must be called with the mutex held.
+ */
+void FrameScheduler::ScheduleNextRelease(ScheduledSession *session) {
+  using namespace std::chrono;
+  clock::duration lead = duration_cast<clock::duration>(
+      duration<double, std::milli>(2.0 * session->ready_time_ms));
+  lead = std::min(lead, session->frame_interval);
+  release_queue.push(
+      release_entry(session->next_deadline - lead, session->session_id));
+}
+
+void FrameScheduler::ScheduleLoop() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!exit_thread) {
+    if (release_queue.empty()) {
+      wake_cv.wait(lock);
+      continue;
+    }
+    release_entry next = release_queue.top();
+    if (clock::now() < next.first) {
+      // Wake early if a session with an earlier release is added.
+      wake_cv.wait_until(lock, next.first);
+      continue;
+    }
+    release_queue.pop();
+    auto it = sessions.find(next.second);
+    if (it == sessions.end()) {
+      continue;
+    }
+    ScheduledSession *session = it->second.get();
+    if (session->released) {
+      // The previous frame was never picked up.
+      session->stats.skipped_frames++;
+      session->stats.deadline_misses++;
+    }
+    session->released = true;
+    session->release_time = clock::now();
+    session->release_deadline = session->next_deadline;
+    session->on_release();
+
+    // Skip deadlines that have already passed instead of bursting frames.
+    session->next_deadline += session->frame_interval;
+    while (session->next_deadline < session->release_time) {
+      session->next_deadline += session->frame_interval;
+      session->stats.skipped_frames++;
+      session->stats.deadline_misses++;
+    }
+    ScheduleNextRelease(session);
+  }
+}
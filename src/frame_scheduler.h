@@ -0,0 +1,75 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * Releases frames for all sessions from one thread.
+ * Each session has a deadline per frame at its source frame rate. The session
+ * is released shortly before its deadline, so it samples the gaze as late as
+ * possible. How early it is released is learned from how long the session
+ * took to get previous frames ready. Frames that are ready after their
+ * deadline, or that are skipped because the session is still busy, are
+ * counted as deadline misses.
+ * A release calls the session's on_release callback, which should only queue
+ * work. The session then takes the release with TakeRelease.
+ */
+class FrameScheduler {
+ public:
+  typedef std::chrono::steady_clock clock;
+
+  struct SessionStats {
+    int64_t frame_count = 0;
+    int64_t deadline_misses = 0;
+    int64_t skipped_frames = 0;
+  };
+
+  FrameScheduler();
+  ~FrameScheduler();
+  void AddSession(int session_id, double frame_rate,
+                  std::function<void()> on_release);
+  void RemoveSession(int session_id);
+  bool TakeRelease(int session_id, clock::time_point *release_time,
+                   clock::time_point *deadline);
+  void ReportFrameReady(int session_id, clock::time_point release_time,
+                        clock::time_point deadline);
+  SessionStats GetSessionStats(int session_id);
+
+ private:
+  struct ScheduledSession {
+    int session_id;
+    clock::duration frame_interval;
+    clock::time_point next_deadline;
+    // Smoothed time from release until the frame is ready.
+    double ready_time_ms = 5.0;
+    bool released = false;
+    clock::time_point release_time;
+    clock::time_point release_deadline;
+    SessionStats stats;
+    std::function<void()> on_release;
+  };
+  typedef std::pair<clock::time_point, int> release_entry;
+
+  std::map<int, std::shared_ptr<ScheduledSession>> sessions;
+  std::priority_queue<release_entry, std::vector<release_entry>,
+                      std::greater<release_entry>>
+      release_queue;
+  std::mutex mutex;
+  std::condition_variable wake_cv;
+  bool exit_thread = false;
+  std::thread thread;
+
+  void ScheduleLoop();
+  void ScheduleNextRelease(ScheduledSession *session);
+};
@@ -0,0 +1,224 @@
+#include "gaze_predictor.h"
+
+namespace {
+// Angular size of the frame in degrees.
+const double FRAME_DEGREES_X = 360.0;
+const double FRAME_DEGREES_Y = 180.0;
+const double PI = 3.14159265358979323846;
+
+// Degrees per unit of x at height y, narrowing towards the poles.
+double DegreesPerUnitX(double y) {
+  return FRAME_DEGREES_X *
+         std::max(std::cos((0.5 - std::min(std::max(y, 0.0), 1.0)) * PI),
+                  0.05);
+}
+}  // namespace
+
+GazePredictor *GazePredictor::Create(Type type) {
+  switch (type) {
+    case CONSTANT_VELOCITY:
+      return new ConstantVelocityPredictor();
+    case KALMAN:
+      return new KalmanPredictor();
+    case BALLISTIC:
+      return new BallisticPredictor();
+    default:
+      return new LastSamplePredictor();
+  }
+}
+
+bool GazePredictor::ParseType(const std::string &name, Type *type) {
+  for (Type candidate : {NONE, CONSTANT_VELOCITY, KALMAN, BALLISTIC}) {
+    if (name == GetTypeName(candidate)) {
+      *type = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string GazePredictor::GetTypeName(Type type) {
+  switch (type) {
+    case CONSTANT_VELOCITY:
+      return "constant_velocity";
+    case KALMAN:
+      return "kalman";
+    case BALLISTIC:
+      return "ballistic";
+    default:
+      return "none";
+  }
+}
+
+double GazePredictor::WrapDelta(double x, double reference) {
+  double delta = x - reference;
+  return delta - std::floor(delta + 0.5);
+}
+
+void GazePredictor::Normalize(double x, double y, float *out_x,
+                              float *out_y) {
+  *out_x = x - std::floor(x);
+  *out_y = std::min(std::max(y, 0.0), 1.0);
+}
+
+void LastSamplePredictor::AddSample(double /*time*/, float x, float y) {
+  last_x = x;
+  last_y = y;
+}
+
+void LastSamplePredictor::Predict(double /*time*/, float *x, float *y) {
+  *x = last_x;
+  *y = last_y;
+}
+
+void ConstantVelocityPredictor::AddSample(double time, float x, float y) {
+  if (has_sample && time > last_time) {
+    double dt = time - last_time;
+    velocity_x = SMOOTHING * WrapDelta(x, last_x) / dt +
+                 (1.0 - SMOOTHING) * velocity_x;
+    velocity_y = SMOOTHING * (y - last_y) / dt + (1.0 - SMOOTHING) * velocity_y;
+  }
+  has_sample = true;
+  last_time = time;
+  last_x = x;
+  last_y = y;
+}
+
+void ConstantVelocityPredictor::Predict(double time, float *x, float *y) {
+  double horizon = std::min(std::max(time - last_time, 0.0), MAX_HORIZON);
+  Normalize(last_x + velocity_x * horizon, last_y + velocity_y * horizon, x,
+            y);
+}
+
+void KalmanPredictor::Axis::Update(double dt, double measurement) {
+  const double q = PROCESS_NOISE * PROCESS_NOISE;
+  const double r = MEASUREMENT_NOISE * MEASUREMENT_NOISE;
+  // Predict with white noise acceleration.
+  position += velocity * dt;
+  double dt2 = dt * dt;
+  p00 += 2.0 * dt * p01 + dt2 * p11 + dt2 * dt2 / 4.0 * q;
+  p01 += dt * p11 + dt2 * dt / 2.0 * q;
+  p11 += dt2 * q;
+  // Correct with the measured position.
+  double innovation = measurement - position;
+  double s = p00 + r;
+  double k0 = p00 / s;
+  double k1 = p01 / s;
+  position += k0 * innovation;
+  velocity += k1 * innovation;
+  p11 -= k1 * p01;
+  p01 -= k0 * p01;
+  p00 -= k0 * p00;
+}
+
+void KalmanPredictor::Reset(double time, double x, double y) {
+  has_sample = true;
+  last_time = time;
+  axis_x = Axis();
+  axis_y = Axis();
+  axis_x.position = x;
+  axis_y.position = y;
+  axis_x.p00 = axis_y.p00 = MEASUREMENT_NOISE * MEASUREMENT_NOISE;
+}
+
+void KalmanPredictor::AddSample(double time, float x, float y) {
+  if (!has_sample) {
+    Reset(time, x, y);
+    return;
+  }
+  double dt = std::max(time - last_time, 0.0);
+  // Track x unwrapped, taking the sample nearest to the predicted position.
+  double predicted_x = axis_x.position + axis_x.velocity * dt;
+  axis_x.Update(dt, predicted_x + WrapDelta(x, predicted_x));
+  axis_y.Update(dt, y);
+  last_time = std::max(time, last_time);
+}
+
+void KalmanPredictor::Predict(double time, float *x, float *y) {
+  double horizon = std::min(std::max(time - last_time, 0.0), MAX_HORIZON);
+  Normalize(axis_x.position + axis_x.velocity * horizon,
+            axis_y.position + axis_y.velocity * horizon, x, y);
+}
+
+void KalmanPredictor::GetVelocity(double *velocity_x, double *velocity_y) {
+  *velocity_x = axis_x.velocity;
+  *velocity_y = axis_y.velocity;
+}
+
+void KalmanPredictor::GetPosition(double *x, double *y) {
+  *x = axis_x.position;
+  *y = axis_y.position;
+}
+
+void BallisticPredictor::AddSample(double time, float x, float y) {
+  // last_x is unwrapped, so samples are tracked relative to it.
+  double unwrapped_x = has_sample ? last_x + WrapDelta(x, last_x) : x;
+  if (!has_sample || time <= last_time) {
+    tracker.AddSample(time, x, y);
+    has_sample = true;
+    last_time = time;
+    last_x = unwrapped_x;
+    last_y = y;
+    return;
+  }
+  double dt = time - last_time;
+  double degrees_x = (unwrapped_x - last_x) * DegreesPerUnitX(last_y);
+  double degrees_y = (y - last_y) * FRAME_DEGREES_Y;
+  double speed = std::hypot(degrees_x, degrees_y) / dt;
+
+  if (!in_saccade && speed > SACCADE_SPEED) {
+    in_saccade = true;
+    saccade_start_time = last_time;
+    saccade_start_x = last_x;
+    saccade_start_y = last_y;
+    peak_speed = 0.0;
+  }
+  bool landed = false;
+  if (in_saccade) {
+    if (speed < FIXATION_SPEED) {
+      // Track the new fixation from scratch.
+      in_saccade = false;
+      landed = true;
+      tracker.Reset(time, unwrapped_x, y);
+    } else {
+      peak_speed = std::max(peak_speed, speed);
+      double traveled_x =
+          (unwrapped_x - saccade_start_x) * DegreesPerUnitX(saccade_start_y);
+      double traveled_y = (y - saccade_start_y) * FRAME_DEGREES_Y;
+      double traveled = std::hypot(traveled_x, traveled_y);
+      if (traveled > 0.0) {
+        direction_x = traveled_x / traveled;
+        direction_y = traveled_y / traveled;
+      }
+    }
+  }
+  if (!landed) {
+    tracker.AddSample(time, x, y);
+  }
+  last_time = time;
+  last_x = unwrapped_x;
+  last_y = y;
+}
+
+void BallisticPredictor::Predict(double time, float *x, float *y) {
+  if (!in_saccade) {
+    tracker.Predict(time, x, y);
+    return;
+  }
+  time = std::min(time, last_time + MAX_HORIZON);
+  double peak_fraction = std::min(peak_speed / MAX_PEAK_SPEED, 0.95);
+  double amplitude = -AMPLITUDE_SCALE * std::log(1.0 - peak_fraction);
+  double duration = (DURATION_BASE + DURATION_SLOPE * amplitude) / 1000.0;
+  double progress =
+      std::min(std::max((time - saccade_start_time) / duration, 0.0), 1.0);
+  // Minimum jerk profile from the saccade's start to its landing.
+  double profile = progress * progress * progress *
+                   (10.0 - 15.0 * progress + 6.0 * progress * progress);
+  double traveled = std::hypot(
+      (last_x - saccade_start_x) * DegreesPerUnitX(saccade_start_y),
+      (last_y - saccade_start_y) * FRAME_DEGREES_Y);
+  double distance = std::max(amplitude * profile, traveled);
+  Normalize(saccade_start_x +
+                distance * direction_x / DegreesPerUnitX(saccade_start_y),
+            saccade_start_y + distance * direction_y / FRAME_DEGREES_Y, x, y);
+}
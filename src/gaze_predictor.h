@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+/**
+ * Predicts where the viewer will be looking at a future time from the gaze
+ * samples seen so far.
+ * Positions are normalized equirectangular coordinates as sent in
+ * frameRequest messages, where x wraps around at 1. Times are seconds on any
+ * monotonic clock. Predictions are never made further than MAX_HORIZON past
+ * the last sample.
+ * Predictors are not thread safe.
+ */
+class GazePredictor {
+ public:
+  enum Type { NONE, CONSTANT_VELOCITY, KALMAN, BALLISTIC };
+  static constexpr double MAX_HORIZON = 0.25;
+
+  virtual ~GazePredictor() {}
+  virtual void AddSample(double time, float x, float y) = 0;
+  virtual void Predict(double time, float *x, float *y) = 0;
+
+  static GazePredictor *Create(Type type);
+  static bool ParseType(const std::string &name, Type *type);
+  static std::string GetTypeName(Type type);
+
+ protected:
+  // Difference x - reference wrapped to [-0.5, 0.5).
+  static double WrapDelta(double x, double reference);
+  // Maps an unwrapped position back into the frame.
+  static void Normalize(double x, double y, float *out_x, float *out_y);
+};
+
+/** Holds the last sample, which is what the server did without prediction. */
+class LastSamplePredictor : public GazePredictor {
+ public:
+  void AddSample(double time, float x, float y);
+  void Predict(double time, float *x, float *y);
+
+ private:
+  float last_x = 0.5;
+  float last_y = 0.5;
+};
+
+/**
+ * Extrapolates the smoothed velocity of the last samples.
+ */
+class ConstantVelocityPredictor : public GazePredictor {
+ public:
+  // Weight of the newest velocity estimate.
+  static constexpr double SMOOTHING = 0.5;
+
+  void AddSample(double time, float x, float y);
+  void Predict(double time, float *x, float *y);
+
+ private:
+  bool has_sample = false;
+  double last_time = 0.0;
+  double last_x = 0.5;
+  double last_y = 0.5;
+  double velocity_x = 0.0;
+  double velocity_y = 0.0;
+};
+
+/**
+ * Constant velocity Kalman filter per axis. Unlike ConstantVelocityPredictor
+ * it weighs each sample by how much it disagrees with the track, so jittery
+ * fixations are not extrapolated as motion.
+ */
+class KalmanPredictor : public GazePredictor {
+ public:
+  // Acceleration noise in units/s^2 and measurement noise in units, both
+  // as standard deviations.
+  static constexpr double PROCESS_NOISE = 10.0;
+  static constexpr double MEASUREMENT_NOISE = 0.004;
+
+  void AddSample(double time, float x, float y);
+  void Predict(double time, float *x, float *y);
+  void Reset(double time, double x, double y);
+  void GetVelocity(double *velocity_x, double *velocity_y);
+  void GetPosition(double *x, double *y);
+
+ private:
+  struct Axis {
+    double position = 0.0;
+    double velocity = 0.0;
+    // Covariance of (position, velocity).
+    double p00 = 1.0;
+    double p01 = 0.0;
+    double p11 = 1.0;
+
+    void Update(double dt, double measurement);
+  };
+  bool has_sample = false;
+  double last_time = 0.0;
+  Axis axis_x;
+  Axis axis_y;
+};
+
+/**
+ * Saccade aware predictor. Fixations and smooth pursuit are tracked with a
+ * KalmanPredictor. Once the gaze speed exceeds SACCADE_SPEED, the saccade's
+ * amplitude is estimated from its peak speed with the main sequence, and the
+ * gaze is predicted to land that far along the saccade's direction at the
+ * end of its expected duration.
+ */
+class BallisticPredictor : public GazePredictor {
+ public:
+  // Degrees per second.
+  static constexpr double SACCADE_SPEED = 120.0;
+  static constexpr double FIXATION_SPEED = 60.0;
+  // Main sequence: a saccade of A degrees peaks at
+  // MAX_PEAK_SPEED * (1 - exp(-A / AMPLITUDE_SCALE)) degrees per second and
+  // lasts DURATION_BASE + DURATION_SLOPE * A milliseconds.
+  static constexpr double MAX_PEAK_SPEED = 500.0;
+  static constexpr double AMPLITUDE_SCALE = 15.0;
+  static constexpr double DURATION_BASE = 21.0;
+  static constexpr double DURATION_SLOPE = 2.2;
+
+  void AddSample(double time, float x, float y);
+  void Predict(double time, float *x, float *y);
+
+ private:
+  KalmanPredictor tracker;
+  bool has_sample = false;
+  double last_time = 0.0;
+  double last_x = 0.5;
+  double last_y = 0.5;
+  bool in_saccade = false;
+  double saccade_start_time = 0.0;
+  double saccade_start_x = 0.0;
+  double saccade_start_y = 0.0;
+  double direction_x = 0.0;
+  double direction_y = 0.0;
+  double peak_speed = 0.0;
+};
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Holds the latest gaze sample of a session.
+ * A single writer (the websocket thread) publishes samples with a sequence
+ * lock and readers copy them out without blocking the writer. Readers retry
+ * if a write happened while they were copying.
+ */
+class GazeSlot {
+ public:
+  struct Sample {
+    float center_x = 0.0;
+    float center_y = 0.0;
+    // Time the sample was received, in microseconds of steady_clock.
+    int64_t timestamp_us = 0;
+    int64_t packet_number = -1;
+  };
+
+  void Write(float center_x, float center_y, int64_t timestamp_us,
+             int64_t packet_number) {
+    uint32_t seq = sequence.load(std::memory_order_relaxed);
+    sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    this->center_x.store(center_x, std::memory_order_relaxed);
+    this->center_y.store(center_y, std::memory_order_relaxed);
+    this->timestamp_us.store(timestamp_us, std::memory_order_relaxed);
+    this->packet_number.store(packet_number, std::memory_order_relaxed);
+    sequence.store(seq + 2, std::memory_order_release);
+  }
+
+  Sample Read() const {
+    Sample sample;
+    uint32_t seq_before, seq_after;
+    do {
+      seq_before = sequence.load(std::memory_order_acquire);
+      sample.center_x = center_x.load(std::memory_order_relaxed);
+      sample.center_y = center_y.load(std::memory_order_relaxed);
+      sample.timestamp_us = timestamp_us.load(std::memory_order_relaxed);
+      sample.packet_number = packet_number.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      seq_after = sequence.load(std::memory_order_relaxed);
+    } while ((seq_before & 1) || seq_before != seq_after);
+    return sample;
+  }
+
+ private:
+  std::atomic<uint32_t> sequence{0};
+  std::atomic<float> center_x{0.0f};
+  std::atomic<float> center_y{0.0f};
+  std::atomic<int64_t> timestamp_us{0};
+  std::atomic<int64_t> packet_number{-1};
+};
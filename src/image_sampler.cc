@@ -7,20 +7,8 @@ ImageSampler::ImageSampler(OpenCLManager *cl_manager) {
   this->cl_manager = cl_manager;
   cl_int ret = 0;
 
-  std::ifstream sample_rect_kernel_file(
-      "src/image_sampler_sample_rect_kernel.cl");
-  std::string sample_rect_kernel_contents(
-      (std::istreambuf_iterator<char>(sample_rect_kernel_file)),
-      std::istreambuf_iterator<char>());
-
-  sample_rect_program = cl::Program(cl_manager->context,
-                                    sample_rect_kernel_contents, false, &ret);
-  if (ret != CL_SUCCESS) {
-    std::cerr << "Creating sample rect program failed:" << ret << std::endl;
-    exit(EXIT_FAILURE);
-  }
-  ret = sample_rect_program.build(std::vector<cl::Device>{cl_manager->device},
-                                  NULL, NULL);
+  sample_rect_program = cl_manager->GetProgramFromFile(
+      "src/image_sampler_sample_rect_kernel.cl", "", &ret);
   if (ret != CL_SUCCESS) {
     std::string build_log;
     sample_rect_program.getBuildInfo<std::string>(
@@ -44,22 +32,8 @@ ImageSampler::ImageSampler(OpenCLManager *cl_manager) {
     exit(EXIT_FAILURE);
   }
 
-  std::ifstream sample_logpolar_kernel_file(
-      "src/image_sampler_sample_logpolar_kernel.cl");
-  std::string sample_logpolar_kernel_contents(
-      (std::istreambuf_iterator<char>(sample_logpolar_kernel_file)),
-      std::istreambuf_iterator<char>());
-  const size_t sample_logpolar_kernel_length =
-      sample_logpolar_kernel_contents.length();
-  const char *sample_logpolar_kernel_chars =
-      sample_logpolar_kernel_contents.c_str();
-  sample_logpolar_program = cl::Program(
-      cl_manager->context, sample_logpolar_kernel_contents, false, &ret);
-  if (ret != CL_SUCCESS) {
-    std::cerr << "Creating sample logpolar program failed:" << ret << std::endl;
-  }
-  ret = sample_logpolar_program.build(
-      std::vector<cl::Device>{cl_manager->device});
+  sample_logpolar_program = cl_manager->GetProgramFromFile(
+      "src/image_sampler_sample_logpolar_kernel.cl", "", &ret);
   if (ret != CL_SUCCESS) {
     std::string build_log;
     sample_logpolar_program.getBuildInfo<std::string>(
@@ -90,19 +64,8 @@ ImageSampler::ImageSampler(OpenCLManager *cl_manager) {
               << std::endl;
   }
 
-  std::ifstream interpolate_kernel_file(
-      "src/image_sampler_interpolate_kernel.cl");
-  std::string interpolate_kernel_contents(
-      (std::istreambuf_iterator<char>(interpolate_kernel_file)),
-      std::istreambuf_iterator<char>());
-  interpolate_program = cl::Program(cl_manager->context,
-                                    interpolate_kernel_contents, false, &ret);
-  if (ret != CL_SUCCESS) {
-    std::cerr << __FUNCTION__ << " Create interpolate program failed:" << ret
-              << std::endl;
-    std::exit(EXIT_FAILURE);
-  }
-  ret = interpolate_program.build();
+  interpolate_program = cl_manager->GetProgramFromFile(
+      "src/image_sampler_interpolate_kernel.cl", "", &ret);
   if (ret != CL_SUCCESS) {
     std::string build_log;
     interpolate_program.getBuildInfo<std::string>(
@@ -122,20 +85,8 @@ ImageSampler::ImageSampler(OpenCLManager *cl_manager) {
               << std::endl;
   }
 
-  std::ifstream sample_mipmap_logpolar_kernel_file(
-      "src/image_sampler_sample_mipmap_logpolar_kernel.cl");
-  std::string sample_mipmap_logpolar_kernel_contents(
-      (std::istreambuf_iterator<char>(sample_mipmap_logpolar_kernel_file)),
-      std::istreambuf_iterator<char>());
-  sample_mipmap_logpolar_program = cl::Program(
-      cl_manager->context, sample_mipmap_logpolar_kernel_contents, false, &ret);
-  if (ret != CL_SUCCESS) {
-    std::cerr << __FUNCTION__
-              << " Create sample_mipmap_logpolar_program failed: "
-              << cl_manager->GetCLErrorString(ret) << std::endl;
-    std::exit(EXIT_FAILURE);
-  }
-  ret = sample_mipmap_logpolar_program.build();
+  sample_mipmap_logpolar_program = cl_manager->GetProgramFromFile(
+      "src/image_sampler_sample_mipmap_logpolar_kernel.cl", "", &ret);
   if (ret != CL_SUCCESS) {
     std::string build_log;
     sample_mipmap_logpolar_program.getBuildInfo<std::string>(
@@ -169,81 +120,76 @@ ImageSampler::~ImageSampler() {}
 
 void ImageSampler::InitializeGrid(int target_width, int target_height,
                                   int source_width, int source_height) {
-  size_t new_grid_size =
+  size_t grid_size =
       (target_width + 1) * (target_height + 1) * sizeof(int16_t) * 2;
-  if (grid_size == new_grid_size) {
-    return;
-  }
-  std::cout << "Initializing Grid" << std::endl;
-  grid_buffer =
-      cl::Buffer(cl_manager->context, CL_MEM_READ_WRITE, new_grid_size);
-  grid_size = new_grid_size;
-
-  cl_int ret = 0;
-
-  // Set all the parameters and call the kernel
-  ret =
-      clSetKernelArg(create_grid_kernel(), 0, sizeof(uint16_t *), &grid_buffer);
-  ret = clSetKernelArg(create_grid_kernel(), 1, sizeof(int), &target_width);
-  ret = clSetKernelArg(create_grid_kernel(), 2, sizeof(int), &target_height);
-  ret = clSetKernelArg(create_grid_kernel(), 3, sizeof(int), &source_width);
-  ret = clSetKernelArg(create_grid_kernel(), 4, sizeof(int), &source_height);
-
-  cl::NDRange global_item_size(8 * ((target_width + 7) / 8),
-                               8 * ((target_height + 7) / 8));
-  cl::NDRange local_item_size(8, 8);
-  ret = cl_manager->command_queue.enqueueNDRangeKernel(
-      create_grid_kernel, 0, global_item_size, local_item_size, NULL, NULL);
-  if (ret != CL_SUCCESS) {
-    std::cerr << "[ImageSampler::InitializeGrid] Launch Kernel Failed; " << ret
-              << std::endl;
-    return;
-  }
+  grid = cl_manager->GetGrid(
+      OpenCLManager::IMAGE_RECT_GRID, target_width, target_height,
+      source_width, source_height, grid_size,
+      [&](const cl::Buffer &grid_buffer) {
+        cl_int ret = 0;
+
+        // Set all the parameters and call the kernel
+        ret = clSetKernelArg(create_grid_kernel(), 0, sizeof(cl_mem),
+                             &grid_buffer());
+        ret = clSetKernelArg(create_grid_kernel(), 1, sizeof(int),
+                             &target_width);
+        ret = clSetKernelArg(create_grid_kernel(), 2, sizeof(int),
+                             &target_height);
+        ret = clSetKernelArg(create_grid_kernel(), 3, sizeof(int),
+                             &source_width);
+        ret = clSetKernelArg(create_grid_kernel(), 4, sizeof(int),
+                             &source_height);
+
+        cl::NDRange global_item_size(8 * ((target_width + 7) / 8),
+                                     8 * ((target_height + 7) / 8));
+        cl::NDRange local_item_size(8, 8);
+        ret = cl_manager->command_queue.enqueueNDRangeKernel(
+            create_grid_kernel, 0, global_item_size, local_item_size, NULL,
+            NULL);
+        if (ret != CL_SUCCESS) {
+          std::cerr << "[ImageSampler::InitializeGrid] Launch Kernel Failed; "
+                    << ret << std::endl;
+        }
+        return ret;
+      });
 }
 
 void ImageSampler::InitializeLogpolarGrid(int target_width, int target_height,
                                           int source_width, int source_height) {
-  size_t new_grid_size =
+  size_t grid_size =
       (target_width + 1) * (target_height + 1) * sizeof(int16_t) * 2;
-  if (logpolar_grid_size == new_grid_size) {
-    return;
-  }
-  std::cout << "Initializing Grid" << std::endl;
-  logpolar_grid_buffer =
-      cl::Buffer(cl_manager->context, CL_MEM_READ_WRITE, new_grid_size);
-  logpolar_grid_size = new_grid_size;
-
-  cl_int ret = 0;
-
-  // Set all the parameters and call the kernel
-  ret = clSetKernelArg(create_logpolar_grid_kernel(), 0, sizeof(uint16_t *),
-                       &logpolar_grid_buffer);
-  ret = clSetKernelArg(create_logpolar_grid_kernel(), 1, sizeof(int),
-                       &target_width);
-  ret = clSetKernelArg(create_logpolar_grid_kernel(), 2, sizeof(int),
-                       &target_height);
-  ret = clSetKernelArg(create_logpolar_grid_kernel(), 3, sizeof(int),
-                       &source_width);
-  ret = clSetKernelArg(create_logpolar_grid_kernel(), 4, sizeof(int),
-                       &source_height);
-
-  cl::NDRange global_item_size((8 * ((target_width + 7) / 8)),
-                               (8 * ((target_height + 7) / 8)));
-  cl::NDRange local_item_size(8, 8);
-  ret = cl_manager->command_queue.enqueueNDRangeKernel(
-      create_logpolar_grid_kernel, 0, global_item_size, local_item_size, NULL,
-      NULL);
-  if (ret != CL_SUCCESS) {
-    std::cerr << "[ImageSampler::InitializeLogpolarGrid] Launch Kernel Failed; "
-              << ret << ", " << OpenCLManager::GetCLErrorString(ret)
-              << std::endl;
-    return;
-  }
-  return;
-
-Error:
-  std::cerr << "[ImageSampler::InitializeLogpolarGrid] Some error occurred"
-            << std::endl;
+  logpolar_grid = cl_manager->GetGrid(
+      OpenCLManager::IMAGE_LOGPOLAR_GRID, target_width, target_height,
+      source_width, source_height, grid_size,
+      [&](const cl::Buffer &grid_buffer) {
+        cl_int ret = 0;
+
+        // Set all the parameters and call the kernel
+        ret = clSetKernelArg(create_logpolar_grid_kernel(), 0, sizeof(cl_mem),
+                             &grid_buffer());
+        ret = clSetKernelArg(create_logpolar_grid_kernel(), 1, sizeof(int),
+                             &target_width);
+        ret = clSetKernelArg(create_logpolar_grid_kernel(), 2, sizeof(int),
+                             &target_height);
+        ret = clSetKernelArg(create_logpolar_grid_kernel(), 3, sizeof(int),
+                             &source_width);
+        ret = clSetKernelArg(create_logpolar_grid_kernel(), 4, sizeof(int),
+                             &source_height);
+
+        cl::NDRange global_item_size((8 * ((target_width + 7) / 8)),
+                                     (8 * ((target_height + 7) / 8)));
+        cl::NDRange local_item_size(8, 8);
+        ret = cl_manager->command_queue.enqueueNDRangeKernel(
+            create_logpolar_grid_kernel, 0, global_item_size,
+            local_item_size, NULL, NULL);
+        if (ret != CL_SUCCESS) {
+          std::cerr << "[ImageSampler::InitializeLogpolarGrid] Launch Kernel "
+                       "Failed; "
+                    << ret << ", " << OpenCLManager::GetCLErrorString(ret)
+                    << std::endl;
+        }
+        return ret;
+      });
 }
 
 void ImageSampler::SampleFrameRectGPU(cl_mem cl_target_buffer, int target_width,
@@ -258,10 +204,13 @@ void ImageSampler::SampleFrameRectGPU(cl_mem cl_target_buffer, int target_width,
     return;
   }
 
-  if (grid_size == -1) {
+  if (grid == NULL) {
     // std::cerr << "[ImageSampler::SampleFrameRectGPU] Grid Not Initialized" <<
     // std::endl;
     InitializeGrid(target_width, target_height, source_width, source_height);
+    if (grid == NULL) {
+      return;
+    }
   }
 
   cl_int ret = 0;
@@ -277,7 +226,7 @@ void ImageSampler::SampleFrameRectGPU(cl_mem cl_target_buffer, int target_width,
   ret = clSetKernelArg(sample_rect_kernel(), 5, sizeof(int), &source_width);
   ret = clSetKernelArg(sample_rect_kernel(), 6, sizeof(int), &source_height);
   ret = clSetKernelArg(sample_rect_kernel(), 7, sizeof(int), &source_linesize);
-  ret = clSetKernelArg(sample_rect_kernel(), 8, sizeof(cl_mem), &grid_buffer);
+  ret = clSetKernelArg(sample_rect_kernel(), 8, sizeof(cl_mem), &(*grid)());
   ret = clSetKernelArg(sample_rect_kernel(), 9, sizeof(float), &center_x);
   ret = clSetKernelArg(sample_rect_kernel(), 10, sizeof(float), &center_y);
 
@@ -585,9 +534,12 @@ void ImageSampler::SampleFrameLogPolarGPU(
     return;
   }
 
-  if (logpolar_grid_size <= 0) {
+  if (logpolar_grid == NULL) {
     InitializeLogpolarGrid(target_width, target_height, source_width,
                            source_height);
+    if (logpolar_grid == NULL) {
+      return;
+    }
   }
 
   cl_int ret = 0;
@@ -601,7 +553,8 @@ void ImageSampler::SampleFrameLogPolarGPU(
   ret = sample_logpolar_kernel.setArg(5, sizeof(int), &source_width);
   ret = sample_logpolar_kernel.setArg(6, sizeof(int), &source_height);
   ret = sample_logpolar_kernel.setArg(7, sizeof(int), &source_linesize);
-  ret = sample_logpolar_kernel.setArg(8, sizeof(cl_mem), &logpolar_grid_buffer);
+  ret = sample_logpolar_kernel.setArg(8, sizeof(cl_mem),
+                                      &(*logpolar_grid)());
   ret = sample_logpolar_kernel.setArg(9, sizeof(float), &center_x);
   ret = sample_logpolar_kernel.setArg(10, sizeof(float), &center_y);
 
@@ -942,9 +895,12 @@ void ImageSampler::SampleFrameLogPolarGPUFromImagePyramid(
     return;
   }
 
-  if (logpolar_grid_size <= 0) {
+  if (logpolar_grid == NULL) {
     InitializeLogpolarGrid(target_width, target_height, source_width,
                            source_height);
+    if (logpolar_grid == NULL) {
+      return;
+    }
   }
 
   cl_int ret = 0;
@@ -968,7 +924,7 @@ void ImageSampler::SampleFrameLogPolarGPUFromImagePyramid(
   ret = sample_logpolar_from_image_pyramid_kernel.setArg(7, sizeof(int),
                                                          &pyramid_levels);
   ret = sample_logpolar_from_image_pyramid_kernel.setArg(8, sizeof(cl_mem),
-                                                         &logpolar_grid_buffer);
+                                                         &(*logpolar_grid)());
   ret = sample_logpolar_from_image_pyramid_kernel.setArg(9, sizeof(float),
                                                          &center_x);
   ret = sample_logpolar_from_image_pyramid_kernel.setArg(10, sizeof(float),
@@ -13,6 +13,7 @@ extern "C" {
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <string>
 
 #include "opencl_manager.h"
@@ -41,10 +42,9 @@ class ImageSampler {
   cl::Program sample_mipmap_logpolar_program;
   cl::Kernel generate_image_pyramid_kernel;
   cl::Kernel sample_logpolar_from_image_pyramid_kernel;
-  cl::Buffer grid_buffer;
-  size_t grid_size = 0;
-  cl::Buffer logpolar_grid_buffer;
-  size_t logpolar_grid_size = 0;
+  // Shared with the other samplers of the context through its grid cache.
+  std::shared_ptr<const cl::Buffer> grid;
+  std::shared_ptr<const cl::Buffer> logpolar_grid;
 
   bool use_opencl = false;
   float clamp(float a, float b, float c) { return std::min(std::max(a, b), c); }
@@ -0,0 +1,85 @@
+#include "latency_histogram.h"
+
+LatencyHistogram::LatencyHistogram() {
+  for (int i = 0; i < BUCKET_COUNT; i++) {
+    buckets[i] = 0;
+  }
+}
+
+void LatencyHistogram::Record(int64_t value_us) {
+  value_us = std::max<int64_t>(value_us, 0);
+  buckets[BucketIndex(value_us)].fetch_add(1, std::memory_order_relaxed);
+  count.fetch_add(1, std::memory_order_relaxed);
+  sum.fetch_add(value_us, std::memory_order_relaxed);
+  int64_t current_max = max.load(std::memory_order_relaxed);
+  while (value_us > current_max &&
+         !max.compare_exchange_weak(current_max, value_us,
+                                    std::memory_order_relaxed)) {
+  }
+}
+
+int64_t LatencyHistogram::Count() const {
+  return count.load(std::memory_order_relaxed);
+}
+
+int64_t LatencyHistogram::Sum() const {
+  return sum.load(std::memory_order_relaxed);
+}
+
+int64_t LatencyHistogram::Max() const {
+  return max.load(std::memory_order_relaxed);
+}
+
+/**
+ * Returns the upper bound of the bucket holding the given percentile, in
+ * [0, 100], or 0 if nothing was recorded.
+ */
+int64_t LatencyHistogram::Percentile(double percentile) const {
+  // Counts are read bucket by bucket, so use their own total.
+  std::vector<int64_t> counts(BUCKET_COUNT);
+  int64_t total = 0;
+  for (int i = 0; i < BUCKET_COUNT; i++) {
+    counts[i] = buckets[i].load(std::memory_order_relaxed);
+    total += counts[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+  percentile = std::min(std::max(percentile, 0.0), 100.0);
+  int64_t rank = std::max<int64_t>(1, (int64_t)(percentile / 100.0 * total));
+  int64_t seen = 0;
+  for (int i = 0; i < BUCKET_COUNT; i++) {
+    seen += counts[i];
+    if (seen >= rank) {
+      return std::min(BucketUpperBound(i), Max());
+    }
+  }
+  return Max();
+}
+
+/**
+ * Values below SUB_BUCKETS have a bucket each. Above that, the top
+ * SUB_BUCKET_BITS bits below the leading one pick the bucket within its
+ * power of two.
+ */
+int LatencyHistogram::BucketIndex(int64_t value_us) {
+  if (value_us < SUB_BUCKETS) {
+    return std::max<int>(value_us, 0);
+  }
+  int magnitude = 63 - __builtin_clzll((uint64_t)value_us);
+  if (magnitude >= MAX_VALUE_BITS) {
+    return BUCKET_COUNT - 1;
+  }
+  int shift = magnitude - SUB_BUCKET_BITS;
+  int sub_bucket = (int)(value_us >> shift) - SUB_BUCKETS;
+  return SUB_BUCKETS + shift * SUB_BUCKETS + sub_bucket;
+}
+
+int64_t LatencyHistogram::BucketUpperBound(int index) {
+  if (index < SUB_BUCKETS) {
+    return index;
+  }
+  int shift = (index - SUB_BUCKETS) / SUB_BUCKETS;
+  int sub_bucket = (index - SUB_BUCKETS) % SUB_BUCKETS;
+  return ((int64_t)(SUB_BUCKETS + sub_bucket + 1) << shift) - 1;
+}
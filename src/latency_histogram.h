@@ -0,0 +1,38 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Histogram of latencies in microseconds with HDR-style log-linear buckets.
+ * Each power of two is split into SUB_BUCKETS buckets, so every recorded
+ * value is known to within about 6%. Values up to 2^32 us are tracked, and
+ * larger values are clamped.
+ * Record only does a few relaxed atomic adds, so any number of threads can
+ * record while another one reads percentiles.
+ */
+class LatencyHistogram {
+ public:
+  static const int SUB_BUCKET_BITS = 4;
+  static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  static const int MAX_VALUE_BITS = 32;
+  static const int BUCKET_COUNT =
+      SUB_BUCKETS + (MAX_VALUE_BITS - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+  LatencyHistogram();
+  void Record(int64_t value_us);
+  int64_t Count() const;
+  int64_t Sum() const;
+  int64_t Max() const;
+  int64_t Percentile(double percentile) const;
+  static int BucketIndex(int64_t value_us);
+  static int64_t BucketUpperBound(int index);
+
+ private:
+  std::atomic<int64_t> buckets[BUCKET_COUNT];
+  std::atomic<int64_t> count{0};
+  std::atomic<int64_t> sum{0};
+  std::atomic<int64_t> max{0};
+};
@@ -1,5 +1,18 @@
 #include "opencl_manager.h"
 
+#include <unistd.h>
+
+// Generated by the Makefile from src/*.cl.
+#include "cl_kernel_sources.h"
+
+std::string OpenCLManager::binary_cache_directory = "cl_cache";
+std::mutex OpenCLManager::program_cache_mutex;
+std::map<OpenCLManager::program_key, cl::Program>
+    OpenCLManager::program_cache;
+std::mutex OpenCLManager::grid_cache_mutex;
+std::map<OpenCLManager::grid_key, std::weak_ptr<const cl::Buffer>>
+    OpenCLManager::grid_cache;
+
 OpenCLManager::OpenCLManager() {}
 
 OpenCLManager::~OpenCLManager() {}
@@ -52,7 +65,7 @@ int OpenCLManager::InitializeContext() {
               << std::endl;
     exit(EXIT_FAILURE);
   }
-  command_queue = cl::CommandQueue(context, device, 0UL, &ret);
+  command_queue = cl::CommandQueue(context, device, queue_properties, &ret);
   if (ret != CL_SUCCESS) {
     std::cerr << "Failed to create CL Command Queue: " << GetCLErrorString(ret)
               << std::endl;
@@ -66,6 +79,284 @@ int OpenCLManager::InitializeContext() {
   return 0;
 }
 
+/**
+ * Shares the platform, device and context of shared_manager but creates a new
+ * command queue so work from different threads does not serialize.
+ */
+int OpenCLManager::InitializeContext(OpenCLManager *shared_manager) {
+  cl_int ret = 0;
+  platform = shared_manager->platform;
+  device = shared_manager->device;
+  context = shared_manager->context;
+  command_queue = cl::CommandQueue(context, device, queue_properties, &ret);
+  if (ret != CL_SUCCESS) {
+    std::cerr << "Failed to create CL Command Queue: " << GetCLErrorString(ret)
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return 0;
+}
+
+/**
+ * Returns the device time in microseconds from the start of start to the end
+ * of end, or -1 if the queue was not created with CL_QUEUE_PROFILING_ENABLE.
+ */
+int64_t OpenCLManager::GetProfiledTimeUs(const cl::Event &start,
+                                         const cl::Event &end) {
+  cl_int ret = CL_SUCCESS;
+  cl_ulong start_ns = start.getProfilingInfo<CL_PROFILING_COMMAND_START>(&ret);
+  if (ret != CL_SUCCESS) {
+    return -1;
+  }
+  cl_ulong end_ns = end.getProfilingInfo<CL_PROFILING_COMMAND_END>(&ret);
+  if (ret != CL_SUCCESS || end_ns < start_ns) {
+    return -1;
+  }
+  return (end_ns - start_ns) / 1000;
+}
+
+/**
+ * Returns the process-wide manager. It is created on first use and owns the
+ * context shared by all sessions.
+ */
+OpenCLManager *OpenCLManager::GetSharedManager() {
+  static OpenCLManager *shared_manager = [] {
+    OpenCLManager *manager = new OpenCLManager();
+    manager->InitializeContext();
+    return manager;
+  }();
+  return shared_manager;
+}
+
+/**
+ * Returns a program built from source for this context.
+ * Built programs are cached by context, source hash and build options so each
+ * program is only compiled once per process. Across processes, compiled
+ * binaries are kept in binary_cache_directory. Kernels should still be created
+ * per user since cl::Kernel arguments are not thread safe.
+ * On a build failure, ret holds the error and the returned program can be
+ * queried for its build log. Failed builds are not cached.
+ */
+cl::Program OpenCLManager::GetProgramFromSource(const std::string &source,
+                                                const std::string &options,
+                                                cl_int *ret) {
+  program_key key(context(), HashString(source), options);
+  std::lock_guard<std::mutex> lock(program_cache_mutex);
+  auto it = program_cache.find(key);
+  if (it != program_cache.end()) {
+    *ret = CL_SUCCESS;
+    return it->second;
+  }
+  std::string cache_path = GetBinaryCachePath(source, options);
+  if (!cache_path.empty()) {
+    cl::Program program = LoadProgramBinary(cache_path, options);
+    if (program() != NULL) {
+      *ret = CL_SUCCESS;
+      program_cache[key] = program;
+      return program;
+    }
+  }
+  cl::Program program(context, source, false, ret);
+  if (*ret != CL_SUCCESS) {
+    return program;
+  }
+  *ret = program.build(std::vector<cl::Device>{device}, options.c_str());
+  if (*ret != CL_SUCCESS) {
+    return program;
+  }
+  if (!cache_path.empty()) {
+    SaveProgramBinary(cache_path, program);
+  }
+  program_cache[key] = program;
+  return program;
+}
+
+/**
+ * Returns a program built from one of the .cl files in src/.
+ * Sources embedded at build time are used first so the binaries do not
+ * depend on the working directory. Other paths are read from disk.
+ */
+cl::Program OpenCLManager::GetProgramFromFile(const std::string &path,
+                                              const std::string &options,
+                                              cl_int *ret) {
+  std::string filename = std::filesystem::path(path).filename().string();
+  auto embedded_source = cl_kernel_sources.find(filename);
+  if (embedded_source != cl_kernel_sources.end()) {
+    return GetProgramFromSource(embedded_source->second, options, ret);
+  }
+  std::ifstream source_file(path);
+  std::string source((std::istreambuf_iterator<char>(source_file)),
+                     std::istreambuf_iterator<char>());
+  if (source.empty()) {
+    std::cerr << "[OpenCLManager::GetProgramFromFile] Cannot read " << path
+              << std::endl;
+    *ret = CL_INVALID_VALUE;
+    return cl::Program();
+  }
+  return GetProgramFromSource(source, options, ret);
+}
+
+/**
+ * Returns the sampling grid of the given type and sizes for this context.
+ * Grids only depend on their key, so every sampler of the context shares one
+ * immutable copy. On a miss, a buffer of grid_size bytes is allocated and
+ * filled by build on this manager's command queue, which is finished before
+ * the grid is shared. A grid is freed once its last holder lets go of it.
+ * Returns NULL if build fails.
+ */
+std::shared_ptr<const cl::Buffer> OpenCLManager::GetGrid(
+    GridType type, int target_width, int target_height, int source_width,
+    int source_height, size_t grid_size,
+    std::function<cl_int(const cl::Buffer &grid)> build) {
+  grid_key key(context(), type, target_width, target_height, source_width,
+               source_height);
+  std::lock_guard<std::mutex> lock(grid_cache_mutex);
+  std::shared_ptr<const cl::Buffer> grid = grid_cache[key].lock();
+  if (grid != NULL) {
+    return grid;
+  }
+  std::cout << "Initializing Grid" << std::endl;
+  cl_int ret = CL_SUCCESS;
+  cl::Buffer buffer(context, CL_MEM_READ_WRITE, grid_size, NULL, &ret);
+  if (ret == CL_SUCCESS) {
+    ret = build(buffer);
+  }
+  if (ret == CL_SUCCESS) {
+    ret = command_queue.finish();
+  }
+  if (ret != CL_SUCCESS) {
+    std::cerr << "[OpenCLManager::GetGrid] Building grid failed: "
+              << GetCLErrorString(ret) << std::endl;
+    grid_cache.erase(key);
+    return NULL;
+  }
+  // Drop grids that are no longer held by anyone.
+  for (auto it = grid_cache.begin(); it != grid_cache.end();) {
+    it = it->second.expired() ? grid_cache.erase(it) : std::next(it);
+  }
+  grid = std::make_shared<const cl::Buffer>(buffer);
+  grid_cache[key] = grid;
+  return grid;
+}
+
+/**
+ * Binaries are only valid for the device and driver that built them so both
+ * are part of the cache key along with the source and options.
+ */
+std::string OpenCLManager::GetBinaryCachePath(const std::string &source,
+                                              const std::string &options) {
+  if (binary_cache_directory.empty()) {
+    return "";
+  }
+  std::string key = device.getInfo<CL_DEVICE_NAME>() + "\n" +
+                    device.getInfo<CL_DRIVER_VERSION>() + "\n" +
+                    platform.getInfo<CL_PLATFORM_VERSION>() + "\n" + options +
+                    "\n" + source;
+  char filename[32];
+  snprintf(filename, sizeof(filename), "%016llx.bin",
+           (unsigned long long)HashString(key));
+  return (GetBinaryCacheDirectory() / filename).string();
+}
+
+/**
+ * binary_cache_directory, resolved against the directory of the executable
+ * when relative so the cache does not depend on the working directory.
+ */
+std::filesystem::path OpenCLManager::GetBinaryCacheDirectory() {
+  std::filesystem::path directory(binary_cache_directory);
+  if (directory.is_absolute()) {
+    return directory;
+  }
+  std::error_code ec;
+  std::filesystem::path executable =
+      std::filesystem::read_symlink("/proc/self/exe", ec);
+  if (ec) {
+    return directory;
+  }
+  return executable.parent_path() / directory;
+}
+
+cl::Program OpenCLManager::LoadProgramBinary(const std::string &cache_path,
+                                             const std::string &options) {
+  std::ifstream binary_file(cache_path, std::ios::binary);
+  if (!binary_file.good()) {
+    return cl::Program();
+  }
+  std::vector<unsigned char> binary(
+      (std::istreambuf_iterator<char>(binary_file)),
+      std::istreambuf_iterator<char>());
+  if (binary.empty()) {
+    return cl::Program();
+  }
+  cl_int ret = 0;
+  cl_int binary_status = 0;
+  size_t binary_size = binary.size();
+  const unsigned char *binary_data = binary.data();
+  cl_program raw_program =
+      clCreateProgramWithBinary(context(), 1, &device(), &binary_size,
+                                &binary_data, &binary_status, &ret);
+  if (ret != CL_SUCCESS || binary_status != CL_SUCCESS) {
+    if (raw_program != NULL) {
+      clReleaseProgram(raw_program);
+    }
+    return cl::Program();
+  }
+  cl::Program program(raw_program);
+  ret = program.build(std::vector<cl::Device>{device}, options.c_str());
+  if (ret != CL_SUCCESS) {
+    std::cerr << "[OpenCLManager::LoadProgramBinary] Ignoring stale binary "
+              << cache_path << std::endl;
+    return cl::Program();
+  }
+  return program;
+}
+
+void OpenCLManager::SaveProgramBinary(const std::string &cache_path,
+                                      cl::Program &program) {
+  size_t binary_size = 0;
+  cl_int ret = clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES,
+                                sizeof(size_t), &binary_size, NULL);
+  if (ret != CL_SUCCESS || binary_size == 0) {
+    return;
+  }
+  std::vector<unsigned char> binary(binary_size);
+  unsigned char *binary_data = binary.data();
+  ret = clGetProgramInfo(program(), CL_PROGRAM_BINARIES,
+                         sizeof(unsigned char *), &binary_data, NULL);
+  if (ret != CL_SUCCESS) {
+    return;
+  }
+  std::error_code ec;
+  std::filesystem::create_directories(
+      std::filesystem::path(cache_path).parent_path(), ec);
+  // Write to a temporary file first so concurrent jobs never read a partial
+  // binary.
+  std::string temp_path = cache_path + "." + std::to_string(getpid());
+  {
+    std::ofstream binary_file(temp_path, std::ios::binary);
+    if (!binary_file.good()) {
+      return;
+    }
+    binary_file.write(reinterpret_cast<char *>(binary.data()), binary.size());
+  }
+  std::filesystem::rename(temp_path, cache_path, ec);
+  if (ec) {
+    std::filesystem::remove(temp_path, ec);
+  }
+}
+
+/**
+ * 64-bit FNV-1a hash.
+ */
+uint64_t OpenCLManager::HashString(const std::string &str) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : str) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
 std::string OpenCLManager::GetCLErrorString(cl_int error) {
   // https://stackoverflow.com/questions/24326432/convenient-way-to-show-opencl-error-codes
   switch (error) {
@@ -3,11 +3,37 @@
 #define CL_TARGET_OPENCL_VERSION 120
 #include <CL/cl.hpp>
 #include <CL/cl_gl.h>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
 
 class OpenCLManager {
  private:
+  typedef std::tuple<cl_context, uint64_t, std::string> program_key;
+  static std::mutex program_cache_mutex;
+  static std::map<program_key, cl::Program> program_cache;
+  // Context, grid type, target size and source size.
+  typedef std::tuple<cl_context, int, int, int, int, int> grid_key;
+  static std::mutex grid_cache_mutex;
+  static std::map<grid_key, std::weak_ptr<const cl::Buffer>> grid_cache;
+  std::filesystem::path GetBinaryCacheDirectory();
+  std::string GetBinaryCachePath(const std::string &source,
+                                 const std::string &options);
+  cl::Program LoadProgramBinary(const std::string &cache_path,
+                                const std::string &options);
+  void SaveProgramBinary(const std::string &cache_path, cl::Program &program);
+
  public:
+  // Sampling grids held in the grid cache, one per kernel that builds them.
+  enum GridType { SAT_RECT_GRID, IMAGE_RECT_GRID, IMAGE_LOGPOLAR_GRID };
+
   cl::Platform platform;
   cl::Device device;
   cl::Context context;
@@ -15,8 +41,26 @@ class OpenCLManager {
   std::vector<cl_context_properties> context_properties{0};
   cl_context_properties gl_context = -1;
   cl_context_properties gl_display = -1;
+  // Properties of the command queue created by InitializeContext.
+  cl_command_queue_properties queue_properties = 0;
+  // Directory for compiled program binaries, relative to the executable's
+  // directory unless absolute. Empty disables the disk cache.
+  static std::string binary_cache_directory;
   OpenCLManager();
   ~OpenCLManager();
   int InitializeContext();
+  int InitializeContext(OpenCLManager *shared_manager);
+  cl::Program GetProgramFromSource(const std::string &source,
+                                   const std::string &options, cl_int *ret);
+  cl::Program GetProgramFromFile(const std::string &path,
+                                 const std::string &options, cl_int *ret);
+  std::shared_ptr<const cl::Buffer> GetGrid(
+      GridType type, int target_width, int target_height, int source_width,
+      int source_height, size_t grid_size,
+      std::function<cl_int(const cl::Buffer &grid)> build);
+  static OpenCLManager *GetSharedManager();
+  static uint64_t HashString(const std::string &str);
+  static int64_t GetProfiledTimeUs(const cl::Event &start,
+                                   const cl::Event &end);
   static std::string GetCLErrorString(cl_int error);
 };
\ No newline at end of file
@@ -8,5 +8,45 @@
 #define REDUCED_BUFFER_WIDTH 1072
 #define REDUCED_BUFFER_HEIGHT 608
 
+// Gaze predictor used when the videoRequest does not name one. One of none,
+// constant_velocity, kalman or ballistic. Compare them on recorded traces
+// with run_satlogrectilinear.x evaluate_gaze_prediction before changing it.
+#define DEFAULT_GAZE_PREDICTOR "none"
+
+// Frames sampled per release when the videoRequest does not set
+// gazeCandidates. With more than one, frames are also sampled around the
+// predicted gaze and the one nearest the freshest gaze is encoded.
+#define DEFAULT_GAZE_CANDIDATES 1
+#define MAX_GAZE_CANDIDATES 6
+// Distance of the neighboring candidates from the predicted gaze, in
+// normalized frame coordinates.
+#define GAZE_CANDIDATE_SPREAD 0.02
+
+// Pipelines that decode their video publish the uploaded frames instead of
+// their SATs when set, and each session sums the frame only between its grid
+// points. This replaces the full SAT per frame with a pass over the frame per
+// session, which pays off for large sources watched by few sessions.
+#define LATTICE_SAT 0
+
+// Pipelines that decode their video build SATs of the YUV420P planes as
+// decoded when set, and sessions sample YUV420P frames that go to the encoder
+// as they are. This skips the conversions to and from RGB on the CPU and
+// halves the SAT. Ignored with LATTICE_SAT.
+#define YUV420_SAT 0
+
+// Directory of the videos sessions may request, as <name>.mp4.
+#define VIDEO_DIRECTORY "1080p_videos"
+// Videos whose decoders stay open after their last session leaves.
+#define CATALOG_DECODER_POOL_SIZE 4
+// Encoders opened ahead of sessions, one per recently used output size. Each
+// holds an NVENC session, of which consumer GPUs allow only a few.
+#define CATALOG_SPARE_ENCODERS 1
+// Builds the sampling grids of every ladder rung for each source size in the
+// catalog at startup, so sessions find them in the grid cache.
+#define CATALOG_PRECOMPUTE_GRIDS 1
+
+// Worker threads shared by all sessions. 0 uses one per hardware thread.
+#define SESSION_WORKER_THREADS 0
+
 // Port for the non-SAT server
 #define SERVER_PORT_2 9563
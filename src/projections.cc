@@ -4,29 +4,8 @@ Projections::Projections(OpenCLManager *cl_manager) {
   this->cl_manager = cl_manager;
   cl_int ret = 0;
 
-  std::string projection_program_contents;
-  {
-    std::ifstream projection_program_file("src/projections_program.cl");
-    if (projection_program_file) {
-      projection_program_file.seekg(0, std::ios::end);
-      projection_program_contents.resize(projection_program_file.tellg());
-      projection_program_file.seekg(0, std::ios::beg);
-      projection_program_file.read(&projection_program_contents[0],
-                                   projection_program_contents.size());
-    }
-  }
-  if (projection_program_contents.empty()) {
-    std::cerr << "Projection Program not found" << std::endl;
-    std::exit(EXIT_FAILURE);
-  }
-  my_program = cl::Program(cl_manager->context, projection_program_contents,
-                           false, &ret);
-  if (ret != CL_SUCCESS) {
-    std::cerr << __FUNCTION__ << " Create projections program failed:" << ret
-              << std::endl;
-    exit(EXIT_FAILURE);
-  }
-  ret = my_program.build();
+  my_program = cl_manager->GetProgramFromFile("src/projections_program.cl",
+                                               "", &ret);
   if (ret != CL_SUCCESS) {
     std::string build_log;
     my_program.getBuildInfo<std::string>(cl_manager->device,
@@ -0,0 +1,53 @@
+#include "resolution_ladder.h"
+
+ResolutionLadder::ResolutionLadder(std::vector<Rung> rungs, int start_rung)
+    : rungs(rungs) {
+  if (this->rungs.empty()) {
+    this->rungs.push_back({REDUCED_BUFFER_WIDTH, REDUCED_BUFFER_HEIGHT});
+  }
+  int last_rung = this->rungs.size() - 1;
+  current_rung = std::max(0, std::min(start_rung, last_rung));
+}
+
+std::vector<ResolutionLadder::Rung> ResolutionLadder::DefaultRungs() {
+  return {{1280, 720},
+          {REDUCED_BUFFER_WIDTH, REDUCED_BUFFER_HEIGHT},
+          {800, 450}};
+}
+
+/** Sessions start at REDUCED_BUFFER_WIDTH x REDUCED_BUFFER_HEIGHT. */
+int ResolutionLadder::DefaultStartRung() { return 1; }
+
+/**
+ * Adds the time one frame took against its budget. Returns true if the
+ * session should move to the new current rung.
+ */
+bool ResolutionLadder::ReportFrameTime(double frame_time_ms, double budget_ms) {
+  if (!(budget_ms > 0)) {
+    return false;
+  }
+  double frame_load = frame_time_ms / budget_ms;
+  load = frames_since_step == 0 ? frame_load : 0.9 * load + 0.1 * frame_load;
+  frames_since_step++;
+
+  int next_rung = current_rung;
+  if (load > STEP_DOWN_LOAD && frames_since_step >= STEP_DOWN_FRAMES &&
+      current_rung + 1 < (int)rungs.size()) {
+    next_rung = current_rung + 1;
+  } else if (frames_since_step >= STEP_UP_FRAMES && current_rung > 0) {
+    // Assume frame time scales with the pixel count.
+    const Rung &up = rungs[current_rung - 1];
+    const Rung &current = rungs[current_rung];
+    double scale = ((int64_t)up.width * up.height) /
+                   (double)((int64_t)current.width * current.height);
+    if (load * scale < STEP_UP_LOAD) {
+      next_rung = current_rung - 1;
+    }
+  }
+  if (next_rung == current_rung) {
+    return false;
+  }
+  current_rung = next_rung;
+  frames_since_step = 0;
+  return true;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "parameters.h"
+
+/**
+ * Picks the reduced buffer resolution of a session from its frame times.
+ * Frame times are smoothed and compared with the frame budget. The session
+ * steps down a rung when it uses most of its budget, and steps back up only
+ * once the larger rung would still leave headroom. After each step the
+ * smoothed load has to settle again before the next one, and stepping up
+ * waits longer than stepping down so a loaded node does not oscillate.
+ */
+class ResolutionLadder {
+ public:
+  struct Rung {
+    int width;
+    int height;
+  };
+
+  ResolutionLadder(std::vector<Rung> rungs, int start_rung);
+  static std::vector<Rung> DefaultRungs();
+  static int DefaultStartRung();
+  bool ReportFrameTime(double frame_time_ms, double budget_ms);
+  int GetRungIndex() { return current_rung; }
+  Rung GetRung() { return rungs[current_rung]; }
+  double GetLoad() { return load; }
+
+ private:
+  // Fractions of the frame budget.
+  static constexpr double STEP_DOWN_LOAD = 0.8;
+  static constexpr double STEP_UP_LOAD = 0.5;
+  static const int STEP_DOWN_FRAMES = 30;
+  static const int STEP_UP_FRAMES = 120;
+
+  // Largest rung first.
+  std::vector<Rung> rungs;
+  int current_rung = 0;
+  double load = 0.0;
+  int frames_since_step = 0;
+};
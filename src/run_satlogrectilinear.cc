@@ -4,12 +4,18 @@
 #include <Eigen/Core>
 #include <array>
 #include <chrono>
+#include <condition_variable>
 #include <filesystem>
 #include <iostream>
 #include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <nlohmann/json.hpp>
+#include <random>
 #include <ratio>
 #include <string>
+#include <thread>
 #include <vector>
 #include <websocketpp/config/asio_no_tls.hpp>
 #include <websocketpp/server.hpp>
@@ -21,13 +27,18 @@ extern "C" {
 #include <libswscale/swscale.h>
 }
 
+#include "bounded_queue.h"
+#include "gaze_predictor.h"
 #include "gaze_view_points.h"
 #include "opencl_manager.h"
 #include "parameters.h"
 #include "projections.h"
 #include "sat_decoder.h"
 #include "sat_encoder.h"
+#include "sat_factorizer.h"
+#include "sat_store.h"
 #include "save_frame.h"
+#include "svd_store.h"
 #include "video_decoder.h"
 #include "video_encoder.h"
 
@@ -42,6 +53,11 @@ int EncodeLogCartesianVideo(const std::vector<std::string> &args);
 int EncodeLogCartesianVideoBitrate(const std::vector<std::string> &args);
 int DecodeLogCartesianVideo(const std::vector<std::string> &args);
 int FoveateLogCartesianVideo(const std::vector<std::string> &args);
+int BuildSATStore(const std::vector<std::string> &args);
+int BuildSVDStore(const std::vector<std::string> &args);
+int EvaluateGazePrediction(const std::vector<std::string> &args);
+int BenchmarkSATScan(const std::vector<std::string> &args);
+int BenchmarkSATSample(const std::vector<std::string> &args);
 
 struct AVFrameDeleter {
   void operator()(AVFrame *p) { av_frame_free(&p); }
@@ -64,6 +80,16 @@ int main(int argc, char *argv[]) {
     return DecodeLogCartesianVideo(args);
   } else if (args[1] == "foveate_no_encoding") {
     return FoveateLogCartesianVideo(args);
+  } else if (args[1] == "build_sat_store") {
+    return BuildSATStore(args);
+  } else if (args[1] == "build_svd_store") {
+    return BuildSVDStore(args);
+  } else if (args[1] == "evaluate_gaze_prediction") {
+    return EvaluateGazePrediction(args);
+  } else if (args[1] == "benchmark_sat_scan") {
+    return BenchmarkSATScan(args);
+  } else if (args[1] == "benchmark_sat_sample") {
+    return BenchmarkSATSample(args);
   }
   return EXIT_SUCCESS;
 }
@@ -129,7 +155,7 @@ int TestFunction(const std::vector<std::string> args) {
   ret = cl::copy(cl_manager.command_queue, rgb_frame->data[0],
                  rgb_frame->data[0] + source_frame_size, cl_source_frame);
 
-  int sat_buffer_size = width * height * 3 * sizeof(uint32_t);
+  size_t sat_buffer_size = (size_t)width * height * 3 * sizeof(uint32_t);
   cl::Buffer cl_sat_buffer(cl_manager.context, CL_MEM_READ_WRITE,
                            sat_buffer_size);
 
@@ -215,7 +241,7 @@ int SingleFrameExtraction(const std::vector<std::string> &args) {
   ret = cl::copy(cl_manager.command_queue, rgb_frame->data[0],
                  rgb_frame->data[0] + source_frame_size, cl_source_frame);
 
-  int sat_buffer_size = width * height * 3 * sizeof(uint32_t);
+  size_t sat_buffer_size = (size_t)width * height * 3 * sizeof(uint32_t);
   cl::Buffer cl_sat_buffer(cl_manager.context, CL_MEM_READ_WRITE,
                            sat_buffer_size);
 
@@ -294,7 +320,7 @@ int ExtractSampledFrameRect(const std::vector<std::string> &args) {
   std::memset(rgb_frame->data[0], 0,
               rgb_frame->height * rgb_frame->linesize[0]);
 
-  int sat_buffer_size = width * height * 3 * sizeof(uint32_t);
+  size_t sat_buffer_size = (size_t)width * height * 3 * sizeof(uint32_t);
   cl::Buffer cl_sat_buffer(cl_manager.context, CL_MEM_READ_WRITE,
                            sat_buffer_size);
 
@@ -384,7 +410,7 @@ int InterpolateSampledFrameRect(const std::vector<std::string> &args) {
   ret = cl::copy(cl_manager.command_queue, rgb_frame->data[0],
                  rgb_frame->data[0] + source_frame_size, cl_source_frame);
 
-  int sat_buffer_size = width * height * 3 * sizeof(uint32_t);
+  size_t sat_buffer_size = (size_t)width * height * 3 * sizeof(uint32_t);
   cl::Buffer cl_sat_buffer(cl_manager.context, CL_MEM_READ_WRITE,
                            sat_buffer_size);
 
@@ -484,8 +510,8 @@ int EncodeVideo(const std::vector<std::string> &args) {
       4 * source_codec_ctx->width * source_codec_ctx->height;
   cl::Buffer cl_source_frame(cl_manager.context, CL_MEM_READ_WRITE,
                              cl_source_frame_size);
-  int cl_sat_buffer_size =
-      3 * source_codec_ctx->width * source_codec_ctx->height * sizeof(uint32_t);
+  size_t cl_sat_buffer_size = (size_t)3 * source_codec_ctx->width *
+                              source_codec_ctx->height * sizeof(uint32_t);
   cl::Buffer cl_sat_buffer(cl_manager.context, CL_MEM_READ_WRITE,
                            cl_sat_buffer_size);
   int cl_output_buffer_size = output_frame->linesize[0] * output_frame->height;
@@ -604,8 +630,8 @@ int EncodeLogCartesianVideo(const std::vector<std::string> &args) {
       4 * source_codec_ctx->width * source_codec_ctx->height;
   cl::Buffer cl_source_frame(cl_manager.context, CL_MEM_READ_WRITE,
                              cl_source_frame_size);
-  int cl_sat_buffer_size =
-      3 * source_codec_ctx->width * source_codec_ctx->height * sizeof(uint32_t);
+  size_t cl_sat_buffer_size = (size_t)3 * source_codec_ctx->width *
+                              source_codec_ctx->height * sizeof(uint32_t);
   cl::Buffer cl_sat_buffer(cl_manager.context, CL_MEM_READ_WRITE,
                            cl_sat_buffer_size);
   int cl_output_buffer_size = output_frame->linesize[0] * output_frame->height;
@@ -709,8 +735,8 @@ int EncodeLogCartesianVideoBitrate(const std::vector<std::string> &args) {
       4 * source_codec_ctx->width * source_codec_ctx->height;
   cl::Buffer cl_source_frame(cl_manager.context, CL_MEM_READ_WRITE,
                              cl_source_frame_size);
-  int cl_sat_buffer_size =
-      3 * source_codec_ctx->width * source_codec_ctx->height * sizeof(uint32_t);
+  size_t cl_sat_buffer_size = (size_t)3 * source_codec_ctx->width *
+                              source_codec_ctx->height * sizeof(uint32_t);
   cl::Buffer cl_sat_buffer(cl_manager.context, CL_MEM_READ_WRITE,
                            cl_sat_buffer_size);
   int cl_output_buffer_size = output_frame->linesize[0] * output_frame->height;
@@ -768,11 +794,20 @@ int DecodeLogCartesianVideo(const std::vector<std::string> &args) {
   fs::path gaze_file;
   auto length = std::chrono::hours(5);
 
-  if (args.size() >= 5) {
+  int output_width;
+  int output_height;
+  if (args.size() >= 7) {
     source_video = args[2];
     gaze_file = args[3];
     output_video = args[4];
+    // The size of the original video, which the foveated one does not keep.
+    output_width = std::stoi(args[5]);
+    output_height = std::stoi(args[6]);
   } else {
+    std::cerr << "Usage: " << args[0]
+              << " decode <foveated video> <gaze file> <output video> "
+                 "<width> <height>"
+              << std::endl;
     return EXIT_FAILURE;
   }
 
@@ -784,11 +819,11 @@ int DecodeLogCartesianVideo(const std::vector<std::string> &args) {
   SATDecoder sat_decoder(&cl_manager);
   AVCodecContext *source_codec_ctx = video_decoder.source_codec_ctx;
   AVCodecContext output_codec_ctx = *source_codec_ctx;
-  output_codec_ctx.width = 1920;
-  output_codec_ctx.height = 1080;
+  output_codec_ctx.width = output_width;
+  output_codec_ctx.height = output_height;
   VideoEncoder video_encoder(&output_codec_ctx, NULL, output_video);
-  sat_decoder.InitializeGrid(REDUCED_BUFFER_WIDTH, REDUCED_BUFFER_HEIGHT,
-                             source_codec_ctx->width, source_codec_ctx->height);
+  sat_decoder.InitializeGrid(source_codec_ctx->width, source_codec_ctx->height,
+                             output_width, output_height);
 
   GazeViewPoints gv_points(gaze_file);
 
@@ -799,8 +834,8 @@ int DecodeLogCartesianVideo(const std::vector<std::string> &args) {
   std::unique_ptr<AVFrame, AVFrameDeleter> rgb_frame(av_frame_alloc());
   std::unique_ptr<AVFrame, AVFrameDeleter> output_frame(av_frame_alloc());
   output_frame->format = AV_PIX_FMT_RGB0;
-  output_frame->width = 1920;
-  output_frame->height = 1080;
+  output_frame->width = output_width;
+  output_frame->height = output_height;
   av_frame_get_buffer(output_frame.get(), 0);
 
   float center_x = 0.5f;
@@ -902,8 +937,8 @@ int FoveateLogCartesianVideo(const std::vector<std::string> &args) {
       4 * source_codec_ctx->width * source_codec_ctx->height;
   cl::Buffer cl_source_frame(cl_manager.context, CL_MEM_READ_WRITE,
                              cl_source_frame_size);
-  int cl_sat_buffer_size =
-      3 * source_codec_ctx->width * source_codec_ctx->height * sizeof(uint32_t);
+  size_t cl_sat_buffer_size = (size_t)3 * source_codec_ctx->width *
+                              source_codec_ctx->height * sizeof(uint32_t);
   cl::Buffer cl_sat_buffer(cl_manager.context, CL_MEM_READ_WRITE,
                            cl_sat_buffer_size);
   int cl_output_buffer_size = output_frame->linesize[0] * output_frame->height;
@@ -957,4 +992,510 @@ int FoveateLogCartesianVideo(const std::vector<std::string> &args) {
   video_encoder.EncodeFrameToFile(NULL);
   video_encoder.WriteTrailerAndCloseFile();
   return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+/**
+ * Writes the summed area table of every frame of a video to a SAT store,
+ * which the server serves instead of decoding the video.
+ * Usage: build_sat_store <video> [output] [raw|zlib]
+ * The output defaults to the path the server looks for.
+ */
+int BuildSATStore(const std::vector<std::string> &args) {
+  if (args.size() < 3) {
+    std::cerr << "Usage: build_sat_store <video> [output] [raw|zlib]"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::string source_video = args[2];
+  std::string output_store = args.size() >= 4
+                                 ? args[3]
+                                 : SATStore::GetStorePath(source_video);
+  SATStoreHeader::Encoding encoding = SATStoreHeader::ROW_DELTA_ZLIB;
+  if (args.size() >= 5 && args[4] == "raw") {
+    encoding = SATStoreHeader::RAW;
+  }
+
+  OpenCLManager cl_manager;
+  cl_manager.InitializeContext();
+  VideoDecoder video_decoder;
+  video_decoder.OpenVideo(source_video);
+  if (!video_decoder.av_format_opened) {
+    std::cerr << "Failed to open " << source_video << std::endl;
+    return EXIT_FAILURE;
+  }
+  SATEncoder sat_encoder(&cl_manager);
+  AVCodecContext *source_codec_ctx = video_decoder.source_codec_ctx;
+  int width = source_codec_ctx->width;
+  int height = source_codec_ctx->height;
+
+  SATStoreWriter writer;
+  if (!writer.Open(output_store, width, height, encoding,
+                   source_codec_ctx->framerate.num,
+                   source_codec_ctx->framerate.den)) {
+    return EXIT_FAILURE;
+  }
+
+  std::unique_ptr<AVFrame, AVFrameDeleter> rgb_frame(av_frame_alloc());
+  int cl_source_frame_size = 4 * width * height;
+  cl::Buffer cl_source_frame(cl_manager.context, CL_MEM_READ_WRITE,
+                             cl_source_frame_size);
+  std::vector<uint32_t> sat(3 * width * height);
+  cl::Buffer cl_sat_buffer(cl_manager.context, CL_MEM_READ_WRITE,
+                           sat.size() * sizeof(uint32_t));
+
+  int frame = 0;
+  while (video_decoder.GetFrame(rgb_frame.get(), AV_PIX_FMT_RGB0) == 0) {
+    if (frame % 30 == 0) {
+      std::cout << "Processing frame " << frame << std::endl;
+    }
+    cl::copy(cl_manager.command_queue, rgb_frame->data[0],
+             rgb_frame->data[0] + cl_source_frame_size, cl_source_frame);
+    sat_encoder.EncodeFrameGPU(cl_sat_buffer(), cl_source_frame(), width,
+                               height, rgb_frame->linesize[0]);
+    cl::copy(cl_manager.command_queue, cl_sat_buffer, sat.begin(), sat.end());
+    if (!writer.AddFrame(sat.data(), rgb_frame->pts, rgb_frame->pkt_dts)) {
+      return EXIT_FAILURE;
+    }
+    frame++;
+  }
+  if (!writer.Close()) {
+    return EXIT_FAILURE;
+  }
+  std::cout << "Wrote " << frame << " frames to " << output_store
+            << std::endl;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Writes rank k SAT factors of every frame of a video to an SVD store, which
+ * the server serves instead of decoding the video if there is no SAT store.
+ * Usage: build_svd_store <video> [rank] [output] [residual|noresidual]
+ * Frames are factorized on all cores and written in order as they finish.
+ */
+int BuildSVDStore(const std::vector<std::string> &args) {
+  if (args.size() < 3) {
+    std::cerr << "Usage: build_svd_store <video> [rank] [output] "
+                 "[residual|noresidual]"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::string source_video = args[2];
+  int rank = args.size() >= 4 ? std::stoi(args[3]) : 16;
+  std::string output_store = args.size() >= 5
+                                 ? args[4]
+                                 : SVDStore::GetStorePath(source_video);
+  bool with_residual = !(args.size() >= 6 && args[5] == "noresidual");
+
+  VideoDecoder video_decoder;
+  video_decoder.OpenVideo(source_video);
+  if (!video_decoder.av_format_opened) {
+    std::cerr << "Failed to open " << source_video << std::endl;
+    return EXIT_FAILURE;
+  }
+  AVCodecContext *source_codec_ctx = video_decoder.source_codec_ctx;
+  int width = source_codec_ctx->width;
+  int height = source_codec_ctx->height;
+  rank = std::max(1, std::min(rank, std::min(width, height)));
+
+  SVDStoreWriter writer;
+  if (!writer.Open(output_store, width, height, rank,
+                   with_residual ? SVDStoreHeader::ZLIB
+                                 : SVDStoreHeader::NONE,
+                   source_codec_ctx->framerate.num,
+                   source_codec_ctx->framerate.den)) {
+    return EXIT_FAILURE;
+  }
+
+  struct FactorJob {
+    int frame;
+    int64_t pts;
+    int64_t pkt_dts;
+    std::vector<uint8_t> rgb;
+    SATFactors factors;
+  };
+  int thread_count = std::max(1u, std::thread::hardware_concurrency());
+  BoundedQueue<std::shared_ptr<FactorJob>> pending_jobs(thread_count);
+  std::mutex done_mutex;
+  std::condition_variable done_cv;
+  std::map<int, std::shared_ptr<FactorJob>> done_jobs;
+  int decoded_frames = 0;
+  bool decode_finished = false;
+  bool write_failed = false;
+
+  std::vector<std::thread> workers;
+  for (int i = 0; i < thread_count; i++) {
+    workers.emplace_back([&] {
+      SATFactorizer factorizer(width, height, rank, with_residual);
+      std::shared_ptr<FactorJob> job;
+      while (pending_jobs.Pop(&job)) {
+        factorizer.Factorize(job->rgb.data(), 3 * width, 3, &job->factors);
+        job->rgb = std::vector<uint8_t>();
+        std::lock_guard<std::mutex> lock(done_mutex);
+        done_jobs[job->frame] = job;
+        done_cv.notify_all();
+      }
+    });
+  }
+  // Writes frames in order as they are factorized.
+  std::thread write_thread([&] {
+    int frame = 0;
+    while (true) {
+      std::shared_ptr<FactorJob> job;
+      {
+        std::unique_lock<std::mutex> lock(done_mutex);
+        done_cv.wait(lock, [&] {
+          return done_jobs.count(frame) > 0 ||
+                 (decode_finished && frame >= decoded_frames);
+        });
+        if (done_jobs.count(frame) == 0) {
+          break;
+        }
+        job = done_jobs[frame];
+        done_jobs.erase(frame);
+      }
+      if (!write_failed &&
+          !writer.AddFrame(job->factors, job->pts, job->pkt_dts)) {
+        write_failed = true;
+      }
+      if (frame % 30 == 0) {
+        std::cout << "Wrote frame " << frame << std::endl;
+      }
+      frame++;
+    }
+  });
+
+  std::unique_ptr<AVFrame, AVFrameDeleter> rgb_frame(av_frame_alloc());
+  int frame = 0;
+  while (video_decoder.GetFrame(rgb_frame.get(), AV_PIX_FMT_RGB24) == 0) {
+    std::shared_ptr<FactorJob> job = std::make_shared<FactorJob>();
+    job->frame = frame;
+    job->pts = rgb_frame->pts;
+    job->pkt_dts = rgb_frame->pkt_dts;
+    job->rgb.resize((size_t)3 * width * height);
+    for (int y = 0; y < height; y++) {
+      std::memcpy(job->rgb.data() + (size_t)3 * width * y,
+                  rgb_frame->data[0] + (size_t)rgb_frame->linesize[0] * y,
+                  3 * width);
+    }
+    pending_jobs.Push(job);
+    frame++;
+  }
+  pending_jobs.Close();
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  {
+    std::lock_guard<std::mutex> lock(done_mutex);
+    decoded_frames = frame;
+    decode_finished = true;
+  }
+  done_cv.notify_all();
+  write_thread.join();
+
+  if (write_failed || !writer.Close()) {
+    return EXIT_FAILURE;
+  }
+  std::cout << "Wrote " << frame << " rank " << rank << " frames to "
+            << output_store << std::endl;
+  return EXIT_SUCCESS;
+}
+
+/** Angle in degrees between two normalized equirectangular positions. */
+static double GazeAngleDegrees(double x0, double y0, double x1, double y1) {
+  const double pi = 3.14159265358979323846;
+  double lon0 = x0 * 2.0 * pi, lat0 = (0.5 - y0) * pi;
+  double lon1 = x1 * 2.0 * pi, lat1 = (0.5 - y1) * pi;
+  double cosine = std::sin(lat0) * std::sin(lat1) +
+                  std::cos(lat0) * std::cos(lat1) * std::cos(lon1 - lon0);
+  return std::acos(std::min(std::max(cosine, -1.0), 1.0)) * 180.0 / pi;
+}
+
+/**
+ * Replays gaze traces through every gaze predictor and reports the angular
+ * error of predictions against the recorded gaze at several horizons.
+ * Usage: evaluate_gaze_prediction <trace file or directory>... [--fps N]
+ * Directories such as 360_em_dataset/reformatted_data are searched for
+ * .txt traces. Samples are taken to be one per video frame at N fps,
+ * 30 by default.
+ */
+int EvaluateGazePrediction(const std::vector<std::string> &args) {
+  if (args.size() < 3) {
+    std::cerr << "Usage: evaluate_gaze_prediction <trace file or directory>..."
+                 " [--fps N]"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  double frame_rate = 30.0;
+  std::vector<std::string> trace_files;
+  for (size_t i = 2; i < args.size(); i++) {
+    if (args[i] == "--fps" && i + 1 < args.size()) {
+      frame_rate = std::stod(args[++i]);
+    } else if (fs::is_directory(args[i])) {
+      for (const auto &entry : fs::recursive_directory_iterator(args[i])) {
+        if (entry.is_regular_file() && entry.path().extension() == ".txt") {
+          trace_files.push_back(entry.path().string());
+        }
+      }
+    } else {
+      trace_files.push_back(args[i]);
+    }
+  }
+  std::sort(trace_files.begin(), trace_files.end());
+
+  const std::vector<int> horizons_ms = {0, 17, 33, 50, 100, 150, 200};
+  const std::vector<GazePredictor::Type> types = {
+      GazePredictor::NONE, GazePredictor::CONSTANT_VELOCITY,
+      GazePredictor::KALMAN, GazePredictor::BALLISTIC};
+  // errors[type][horizon] holds every prediction's error in degrees.
+  std::vector<std::vector<std::vector<double>>> errors(
+      types.size(), std::vector<std::vector<double>>(horizons_ms.size()));
+
+  for (const std::string &trace_file : trace_files) {
+    GazeViewPoints gaze_points(trace_file);
+    std::vector<GazeViewPoints::GazeViewPoint> &points = gaze_points.points;
+    if (points.size() < 2) {
+      continue;
+    }
+    std::vector<double> times(points.size());
+    for (size_t i = 0; i < points.size(); i++) {
+      times[i] = points[i].frame / frame_rate;
+    }
+    for (size_t t = 0; t < types.size(); t++) {
+      std::unique_ptr<GazePredictor> predictor(
+          GazePredictor::Create(types[t]));
+      for (size_t i = 0; i < points.size(); i++) {
+        predictor->AddSample(times[i], points[i].gaze_point[0],
+                             points[i].gaze_point[1]);
+        for (size_t h = 0; h < horizons_ms.size(); h++) {
+          double target_time = times[i] + horizons_ms[h] / 1000.0;
+          auto next = std::lower_bound(times.begin() + i, times.end(),
+                                       target_time);
+          if (next == times.end()) {
+            continue;
+          }
+          // Recorded gaze at the target time, interpolated across the seam.
+          size_t j = next - times.begin();
+          double x = points[j].gaze_point[0];
+          double y = points[j].gaze_point[1];
+          if (j > i && times[j] > target_time) {
+            double weight =
+                (times[j] - target_time) / (times[j] - times[j - 1]);
+            double delta_x = points[j - 1].gaze_point[0] - x;
+            delta_x -= std::floor(delta_x + 0.5);
+            x += weight * delta_x;
+            x -= std::floor(x);
+            y += weight * (points[j - 1].gaze_point[1] - y);
+          }
+          float predicted_x, predicted_y;
+          predictor->Predict(target_time, &predicted_x, &predicted_y);
+          errors[t][h].push_back(
+              GazeAngleDegrees(predicted_x, predicted_y, x, y));
+        }
+      }
+    }
+  }
+
+  std::cout << "Evaluated " << trace_files.size() << " traces" << std::endl;
+  std::cout << "predictor,horizon_ms,samples,mean_deg,p50_deg,p95_deg"
+            << std::endl;
+  for (size_t t = 0; t < types.size(); t++) {
+    for (size_t h = 0; h < horizons_ms.size(); h++) {
+      std::vector<double> &e = errors[t][h];
+      if (e.empty()) {
+        continue;
+      }
+      std::sort(e.begin(), e.end());
+      double mean = 0.0;
+      for (double error : e) {
+        mean += error / e.size();
+      }
+      std::cout << GazePredictor::GetTypeName(types[t]) << ","
+                << horizons_ms[h] << "," << e.size() << "," << mean << ","
+                << e[e.size() / 2] << "," << e[(e.size() * 95) / 100]
+                << std::endl;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Times SATEncoder::EncodeFrameGPU with each scan method and
+ * SATEncoder::EncodeFrameCPU on random frames at 1080p, 4K and 8K, and checks
+ * that they agree.
+ * Usage: benchmark_sat_scan [iterations]
+ */
+int BenchmarkSATScan(const std::vector<std::string> &args) {
+  using namespace std::chrono;
+  int iterations = args.size() >= 3 ? std::stoi(args[2]) : 10;
+  const int sizes[3][2] = {{1920, 1080}, {3840, 2160}, {7680, 4320}};
+  const SATEncoder::ScanMethod methods[3] = {
+      SATEncoder::SERIAL_SCAN, SATEncoder::TILED_SCAN, SATEncoder::FUSED_SCAN};
+  // The last method is the CPU path.
+  const char *method_names[4] = {"serial", "tiled", "fused", "cpu"};
+
+  OpenCLManager cl_manager;
+  cl_manager.InitializeContext();
+  SATEncoder sat_encoder(&cl_manager);
+  std::mt19937 random(0);
+  std::cout << "width,height,method,median_ms,min_ms" << std::endl;
+  for (auto &size : sizes) {
+    int width = size[0];
+    int height = size[1];
+    std::vector<uint8_t> frame(4 * width * height);
+    for (uint8_t &value : frame) {
+      value = random() & 0xFF;
+    }
+    cl::Buffer cl_source_frame(cl_manager.context, CL_MEM_READ_ONLY,
+                               frame.size());
+    cl::copy(cl_manager.command_queue, frame.begin(), frame.end(),
+             cl_source_frame);
+    cl::Buffer cl_sat_buffer(cl_manager.context, CL_MEM_READ_WRITE,
+                             3 * sizeof(uint32_t) * width * height);
+    std::vector<uint32_t> results[4];
+    for (int m = 0; m < 4; m++) {
+      bool cpu = m == 3;
+      if (!cpu) {
+        sat_encoder.scan_method = methods[m];
+      }
+      results[m].resize(3 * width * height);
+      std::vector<double> times;
+      // The first run allocates and warms up.
+      for (int i = 0; i <= iterations; i++) {
+        high_resolution_clock::time_point start = high_resolution_clock::now();
+        if (cpu) {
+          sat_encoder.EncodeFrameCPU(results[m].data(), frame.data(), width,
+                                     height, 4 * width);
+        } else {
+          sat_encoder.EncodeFrameGPU(cl_sat_buffer(), cl_source_frame(),
+                                     width, height, 4 * width);
+          cl_manager.command_queue.finish();
+        }
+        if (i > 0) {
+          times.push_back(duration<double, std::milli>(
+                              high_resolution_clock::now() - start)
+                              .count());
+        }
+      }
+      std::sort(times.begin(), times.end());
+      std::cout << width << "," << height << "," << method_names[m] << ","
+                << times[times.size() / 2] << "," << times.front()
+                << std::endl;
+      if (!cpu) {
+        cl::copy(cl_manager.command_queue, cl_sat_buffer, results[m].begin(),
+                 results[m].end());
+      }
+    }
+    for (int m = 1; m < 4; m++) {
+      if (results[m] != results[0]) {
+        std::cerr << method_names[m] << " disagrees with " << method_names[0]
+                  << " at " << width << "x" << height << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Times SATDecoder::SampleFrameRectGPU and SATDecoder::SampleFrameRectCPU at
+ * the default reduced resolution from the SATs of random 1080p, 4K and 8K
+ * frames, and counts the pixels where they disagree. The CPU grid is computed
+ * with the C++ exp and pow, which may round a grid offset differently from
+ * the device's.
+ * Usage: benchmark_sat_sample [iterations]
+ */
+int BenchmarkSATSample(const std::vector<std::string> &args) {
+  using namespace std::chrono;
+  int iterations = args.size() >= 3 ? std::stoi(args[2]) : 10;
+  const int sizes[3][2] = {{1920, 1080}, {3840, 2160}, {7680, 4320}};
+  const char *method_names[2] = {"gpu", "cpu"};
+  int target_width = REDUCED_BUFFER_WIDTH;
+  int target_height = REDUCED_BUFFER_HEIGHT;
+  int target_linesize = 4 * target_width;
+
+  OpenCLManager cl_manager;
+  cl_manager.InitializeContext();
+  SATEncoder sat_encoder(&cl_manager);
+  SATDecoder sat_decoder(&cl_manager);
+  std::mt19937 random(0);
+  std::uniform_real_distribution<float> center_distribution(0.0f, 1.0f);
+  cl::Buffer cl_target_frame(cl_manager.context, CL_MEM_READ_WRITE,
+                             target_linesize * target_height);
+  AVCodecContext *codec_ctx = avcodec_alloc_context3(NULL);
+  std::cout << "width,height,method,median_ms,min_ms,mismatched_pixels"
+            << std::endl;
+  for (auto &size : sizes) {
+    int width = size[0];
+    int height = size[1];
+    std::vector<uint8_t> frame(4 * width * height);
+    for (uint8_t &value : frame) {
+      value = random() & 0xFF;
+    }
+    std::vector<uint32_t> sat(3 * width * height);
+    sat_encoder.EncodeFrameCPU(sat.data(), frame.data(), width, height,
+                               4 * width);
+    cl::Buffer cl_sat_buffer(cl_manager.context, CL_MEM_READ_ONLY,
+                             sat.size() * sizeof(uint32_t));
+    cl::copy(cl_manager.command_queue, sat.begin(), sat.end(), cl_sat_buffer);
+    codec_ctx->width = width;
+    codec_ctx->height = height;
+    sat_decoder.InitializeGrid(target_width, target_height, width, height);
+
+    std::vector<std::pair<float, float>> centers;
+    for (int i = 0; i <= iterations; i++) {
+      centers.emplace_back(center_distribution(random),
+                           center_distribution(random));
+    }
+    std::vector<uint8_t> results[2];
+    int mismatched_pixels = 0;
+    for (int m = 0; m < 2; m++) {
+      bool cpu = m == 1;
+      std::vector<double> times;
+      // The first run allocates and warms up.
+      for (int i = 0; i <= iterations; i++) {
+        results[m].assign(target_linesize * target_height, 0);
+        if (!cpu) {
+          cl::copy(cl_manager.command_queue, results[m].begin(),
+                   results[m].end(), cl_target_frame);
+        }
+        high_resolution_clock::time_point start = high_resolution_clock::now();
+        if (cpu) {
+          sat_decoder.SampleFrameRectCPU(
+              results[m].data(), target_width, target_height, target_linesize,
+              sat.data(), width, height, centers[i].first, centers[i].second);
+        } else {
+          sat_decoder.SampleFrameRectGPU(
+              cl_target_frame(), target_width, target_height, target_linesize,
+              cl_sat_buffer(), codec_ctx, centers[i].first,
+              centers[i].second);
+          cl_manager.command_queue.finish();
+        }
+        if (i > 0) {
+          times.push_back(duration<double, std::milli>(
+                              high_resolution_clock::now() - start)
+                              .count());
+        }
+        if (!cpu) {
+          cl::copy(cl_manager.command_queue, cl_target_frame,
+                   results[m].begin(), results[m].end());
+        }
+        if (cpu && i == iterations) {
+          for (int p = 0; p < target_width * target_height; p++) {
+            for (int c = 0; c < 3; c++) {
+              if (results[1][4 * p + c] != results[0][4 * p + c]) {
+                mismatched_pixels++;
+                break;
+              }
+            }
+          }
+        }
+      }
+      std::sort(times.begin(), times.end());
+      std::cout << width << "," << height << "," << method_names[m] << ","
+                << times[times.size() / 2] << "," << times.front() << ","
+                << (cpu ? mismatched_pixels : 0) << std::endl;
+    }
+  }
+  avcodec_free_context(&codec_ctx);
+  return EXIT_SUCCESS;
+}
@@ -1,6 +1,125 @@
 
 #include "sat_decoder.h"
 
+#include <immintrin.h>
+
+#include <cstring>
+
+namespace {
+bool HasAVX2() {
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  return has_avx2;
+}
+
+/**
+ * Offset of line t of the grid along an output dimension of output_size
+ * pixels over a source dimension of source_size pixels, as create_grid_kernel
+ * computes it.
+ */
+int GridOffset(int t, int output_size, int source_size) {
+  float lambda = (float)source_size / (std::exp(1.0f) - 1);
+  int delta[2];
+  for (int k = 0; k < 2; k++) {
+    int u = t - 1 + k - output_size / 2;
+    delta[k] =
+        std::max(std::abs(u),
+                 (int)(lambda * (std::exp(std::pow(
+                                     (float)(2.0f * std::abs(u) / output_size),
+                                     4.0f)) -
+                                 1))) *
+        ((u > 0) - (u < 0));
+  }
+  return (int16_t)std::floor((delta[0] + delta[1]) / 2.0f);
+}
+
+/**
+ * Rectangle (x_minus, x] an output column sums, clamped to the source as in
+ * sample_rect. x is -1 if the column misses the source.
+ */
+struct SampleColumn {
+  int x;
+  int x_minus;
+  // Tallest rectangle whose sum is exact, as SATDecoder::MAX_RECT_AREA.
+  int max_height;
+};
+
+/** Writes the mean of one pixel's rectangle, in rows (y_minus, y]. */
+inline void SamplePixel(uint8_t *target, const uint32_t *source,
+                        int row_words, const SampleColumn &column, int y,
+                        int y_minus) {
+  y_minus = std::max(y_minus, y - column.max_height);
+  const uint32_t *bottom = source + (size_t)y * row_words;
+  const uint32_t *top = source + (size_t)y_minus * row_words;
+  uint32_t area = (column.x - column.x_minus) * (y - y_minus);
+  for (int c = 0; c < 3; c++) {
+    target[c] = (bottom[3 * column.x + c] - top[3 * column.x + c] +
+                 top[3 * column.x_minus + c] - bottom[3 * column.x_minus + c]) /
+                area;
+  }
+}
+
+void SampleRow(uint8_t *target_row, int bytes_per_pixel,
+               const uint32_t *source, int source_width,
+               const SampleColumn *columns, int count, int y, int y_minus) {
+  for (int i = 0; i < count; i++) {
+    if (columns[i].x >= 0) {
+      SamplePixel(target_row + i * bytes_per_pixel, source, 3 * source_width,
+                  columns[i], y, y_minus);
+    }
+  }
+}
+
+/**
+ * SampleRow reading each corner's three channels with one 128-bit load. The
+ * sums are divided as doubles, which truncate to the same means as integer
+ * division of 32-bit sums.
+ */
+__attribute__((target("avx2"))) void SampleRowAVX2(
+    uint8_t *target_row, int bytes_per_pixel, const uint32_t *source,
+    int source_width, int source_height, const SampleColumn *columns,
+    int count, int y, int y_minus) {
+  const __m128i sign = _mm_set1_epi32(0x80000000);
+  const __m256d two_31 = _mm256_set1_pd(2147483648.0);
+  int row_words = 3 * source_width;
+  // The load of the last pixel of the SAT would read past its end.
+  int last_x = y == source_height - 1 ? source_width - 1 : -1;
+  for (int i = 0; i < count; i++) {
+    const SampleColumn &column = columns[i];
+    uint8_t *target = target_row + i * bytes_per_pixel;
+    if (column.x < 0) {
+      continue;
+    }
+    if (column.x == last_x) {
+      SamplePixel(target, source, row_words, column, y, y_minus);
+      continue;
+    }
+    int top_y = std::max(y_minus, y - column.max_height);
+    const uint32_t *bottom = source + (size_t)y * row_words;
+    const uint32_t *top = source + (size_t)top_y * row_words;
+    __m128i bottom_right =
+        _mm_loadu_si128((const __m128i *)(bottom + 3 * column.x));
+    __m128i top_right = _mm_loadu_si128((const __m128i *)(top + 3 * column.x));
+    __m128i top_left =
+        _mm_loadu_si128((const __m128i *)(top + 3 * column.x_minus));
+    __m128i bottom_left =
+        _mm_loadu_si128((const __m128i *)(bottom + 3 * column.x_minus));
+    __m128i sum = _mm_sub_epi32(
+        _mm_add_epi32(_mm_sub_epi32(bottom_right, top_right), top_left),
+        bottom_left);
+    // Unsigned to double.
+    __m256d value =
+        _mm256_add_pd(_mm256_cvtepi32_pd(_mm_xor_si128(sum, sign)), two_31);
+    double area = (double)(column.x - column.x_minus) * (y - top_y);
+    __m128i mean =
+        _mm256_cvttpd_epi32(_mm256_div_pd(value, _mm256_set1_pd(area)));
+    mean = _mm_packus_epi32(mean, mean);
+    mean = _mm_packus_epi16(mean, mean);
+    uint32_t rgb = _mm_cvtsi128_si32(mean);
+    std::memcpy(target, &rgb, 3);
+  }
+}
+}  // namespace
+
 SATDecoder::SATDecoder() { use_opencl = false; }
 
 SATDecoder::SATDecoder(OpenCLManager *cl_manager) {
@@ -8,17 +127,8 @@ SATDecoder::SATDecoder(OpenCLManager *cl_manager) {
   this->cl_manager = cl_manager;
   cl_int ret = 0;
 
-  std::ifstream decode_kernel_file("src/sat_decoder_decode_kernel.cl");
-  std::string decode_kernel_contents(
-      (std::istreambuf_iterator<char>(decode_kernel_file)),
-      std::istreambuf_iterator<char>());
-  decode_program =
-      cl::Program(cl_manager->context, decode_kernel_contents, false, &ret);
-  if (ret != CL_SUCCESS) {
-    std::cerr << __FUNCTION__ << " Create decode program failed:" << ret
-              << std::endl;
-  }
-  ret = decode_program.build();
+  decode_program = cl_manager->GetProgramFromFile(
+      "src/sat_decoder_decode_kernel.cl", "", &ret);
   if (ret != CL_SUCCESS) {
     std::cerr << __FUNCTION__ << " Build decode program failed:" << ret
               << std::endl;
@@ -31,19 +141,8 @@ SATDecoder::SATDecoder(OpenCLManager *cl_manager) {
               << std::endl;
   }
 
-  std::ifstream sample_rect_kernel_file(
-      "src/sat_decoder_sample_rect_kernel.cl");
-  std::string sample_rect_kernel_contents(
-      (std::istreambuf_iterator<char>(sample_rect_kernel_file)),
-      std::istreambuf_iterator<char>());
-  sample_rect_program = cl::Program(cl_manager->context,
-                                    sample_rect_kernel_contents, false, &ret);
-  if (ret != CL_SUCCESS) {
-    std::cerr << __FUNCTION__ << " Create sample rect program failed:" << ret
-              << std::endl;
-    exit(EXIT_FAILURE);
-  }
-  ret = sample_rect_program.build();
+  sample_rect_program = cl_manager->GetProgramFromFile(
+      "src/sat_decoder_sample_rect_kernel.cl", "", &ret);
   if (ret != CL_SUCCESS) {
     std::string build_log;
     sample_rect_program.getBuildInfo(cl_manager->device, CL_PROGRAM_BUILD_LOG,
@@ -60,6 +159,14 @@ SATDecoder::SATDecoder(OpenCLManager *cl_manager) {
               << std::endl;
     exit(EXIT_FAILURE);
   }
+  sample_rect_candidates_kernel =
+      cl::Kernel(sample_rect_program, "sample_rect_candidates_kernel", &ret);
+  if (ret != CL_SUCCESS) {
+    std::cerr << __FUNCTION__
+              << " Create sample rect candidates kernel failed:" << ret
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
   sample_rect_360_kernel =
       cl::Kernel(sample_rect_program, "sample_rect_360_kernel", &ret);
   if (ret != CL_SUCCESS) {
@@ -67,6 +174,13 @@ SATDecoder::SATDecoder(OpenCLManager *cl_manager) {
               << std::endl;
     exit(EXIT_FAILURE);
   }
+  sample_rect_yuv420_kernel =
+      cl::Kernel(sample_rect_program, "sample_rect_yuv420_kernel", &ret);
+  if (ret != CL_SUCCESS) {
+    std::cerr << __FUNCTION__ << " Create sample rect yuv420 kernel failed:"
+              << ret << std::endl;
+    exit(EXIT_FAILURE);
+  }
   create_grid_kernel =
       cl::Kernel(sample_rect_program, "create_grid_kernel", &ret);
   if (ret != CL_SUCCESS) {
@@ -90,20 +204,16 @@ SATDecoder::SATDecoder(OpenCLManager *cl_manager) {
                  "sample_rect_from_reduced_sat_kernel failed"
               << std::endl;
   }
-
-  std::ifstream interpolate_kernel_file(
-      "src/sat_decoder_interpolate_kernel.cl");
-  std::string interpolate_kernel_contents(
-      (std::istreambuf_iterator<char>(interpolate_kernel_file)),
-      std::istreambuf_iterator<char>());
-  interpolate_program = cl::Program(cl_manager->context,
-                                    interpolate_kernel_contents, false, &ret);
+  sample_rect_from_lattice_sat_kernel = cl::Kernel(
+      sample_rect_program, "sample_rect_from_lattice_sat_kernel", &ret);
   if (ret != CL_SUCCESS) {
-    std::cerr << __FUNCTION__ << " Create interpolate program failed:" << ret
+    std::cerr << "[SATDecoder::SatDecoder] Create "
+                 "sample_rect_from_lattice_sat_kernel failed"
               << std::endl;
-    std::exit(EXIT_FAILURE);
   }
-  ret = interpolate_program.build();
+
+  interpolate_program = cl_manager->GetProgramFromFile(
+      "src/sat_decoder_interpolate_kernel.cl", "", &ret);
   if (ret != CL_SUCCESS) {
     std::string build_log;
     interpolate_program.getBuildInfo<std::string>(
@@ -120,57 +230,70 @@ SATDecoder::SATDecoder(OpenCLManager *cl_manager) {
     std::cerr << __FUNCTION__ << " Create interpolate kernel failed:" << ret
               << std::endl;
   }
-
-  grid_buffer = NULL;
-  grid_size = -1;
 }
 
-SATDecoder::~SATDecoder() { FreeClResources(); }
+SATDecoder::~SATDecoder() {
+  FreeClResources();
+}
 
 void SATDecoder::FreeClResources() {
   if (use_opencl) {
-    if (grid_size > 0) {
-      grid_buffer = cl::Buffer();
-      grid_size = -1;
-    }
+    grid.reset();
   }
 }
 
+/**
+ * Takes the grid for the sizes from the context's grid cache, building it on
+ * this decoder's queue if no other sampler holds it.
+ */
 void SATDecoder::InitializeGrid(int target_width, int target_height,
                                 int source_width, int source_height) {
-  size_t new_grid_size =
+  size_t grid_size =
       (target_width + 1) * (target_height + 1) * sizeof(int16_t) * 2;
-  if (grid_size == new_grid_size) {
-    return;
-  }
-  std::cout << "Initializing Grid" << std::endl;
-  grid_buffer =
-      cl::Buffer(cl_manager->context, CL_MEM_READ_WRITE, new_grid_size);
-  grid_size = new_grid_size;
-
-  cl_int ret = 0;
+  grid = cl_manager->GetGrid(
+      OpenCLManager::SAT_RECT_GRID, target_width, target_height, source_width,
+      source_height, grid_size, [&](const cl::Buffer &grid_buffer) {
+        // Set all the parameters and call the kernel
+        cl_int ret = 0;
+        ret = create_grid_kernel.setArg(0, sizeof(cl_mem), &grid_buffer());
+        ret = create_grid_kernel.setArg(1, sizeof(int), &target_width);
+        ret = create_grid_kernel.setArg(2, sizeof(int), &target_height);
+        ret = create_grid_kernel.setArg(3, sizeof(int), &source_width);
+        ret = create_grid_kernel.setArg(4, sizeof(int), &source_height);
+
+        cl::NDRange global_item_size(8 * ((target_width + 1 + 7) / 8),
+                                     8 * ((target_height + 1 + 7) / 8));
+        cl::NDRange local_item_size(8, 8);
+        ret = cl_manager->command_queue.enqueueNDRangeKernel(
+            create_grid_kernel, 0, global_item_size, local_item_size, NULL,
+            NULL);
+        if (ret != CL_SUCCESS) {
+          std::cerr << "[SATDecoder::InitializeGrid] Launch Kernel Failed; "
+                    << ret << std::endl;
+        }
+        return ret;
+      });
+}
 
-  // Set all the parameters and call the kernel
-  ret = create_grid_kernel.setArg(0, sizeof(uint16_t *), &grid_buffer);
-  ret = create_grid_kernel.setArg(1, sizeof(int), &target_width);
-  ret = create_grid_kernel.setArg(2, sizeof(int), &target_height);
-  ret = create_grid_kernel.setArg(3, sizeof(int), &source_width);
-  ret = create_grid_kernel.setArg(4, sizeof(int), &source_height);
-
-  cl::NDRange global_item_size(8 * ((target_width + 1 + 7) / 8),
-                               8 * ((target_height + 1 + 7) / 8));
-  cl::NDRange local_item_size(8, 8);
-  cl_manager->command_queue.enqueueNDRangeKernel(
-      create_grid_kernel, 0, global_item_size, local_item_size, NULL, NULL);
-  if (ret != CL_SUCCESS) {
-    std::cerr << "[SATDecoder::InitializeGrid] Launch Kernel Failed; " << ret
-              << std::endl;
+/** Computes the grid of the CPU path unless it is already for these sizes. */
+void SATDecoder::InitializeGridCPU(int target_width, int target_height,
+                                   int source_width, int source_height) {
+  if ((int)cpu_grid_x.size() == target_width + 1 &&
+      (int)cpu_grid_y.size() == target_height + 1 &&
+      cpu_grid_source_width == source_width &&
+      cpu_grid_source_height == source_height) {
     return;
   }
-  return;
-
-Error:
-  std::cerr << "[SATDecoder::InitializeGrid] Some error occurred" << std::endl;
+  cpu_grid_x.resize(target_width + 1);
+  cpu_grid_y.resize(target_height + 1);
+  for (int t = 0; t <= target_width; t++) {
+    cpu_grid_x[t] = GridOffset(t, target_width, source_width);
+  }
+  for (int t = 0; t <= target_height; t++) {
+    cpu_grid_y[t] = GridOffset(t, target_height, source_height);
+  }
+  cpu_grid_source_width = source_width;
+  cpu_grid_source_height = source_height;
 }
 
 void SATDecoder::DecodeFrameGPU(cl_mem cl_target_buffer, int target_linesize,
@@ -302,18 +425,21 @@ void SATDecoder::SampleFrameRectGPU(cl_mem cl_target_buffer, int target_width,
                                     int target_height, int target_linesize,
                                     cl_mem cl_source_buffer,
                                     AVCodecContext *codec_ctx, float center_x,
-                                    float center_y) {
+                                    float center_y, cl::Event *event) {
   if (!use_opencl) {
     std::cerr << "[SATDecoder::SampleFrameRectGPU] Not initialized with OpenCL"
               << std::endl;
     return;
   }
 
-  if (grid_size <= 0) {
+  if (grid == NULL) {
     std::cerr << "[SATDecoder::SampleFrameRectGPU] Grid Not Initialized"
               << std::endl;
     InitializeGrid(target_width, target_height, codec_ctx->width,
                    codec_ctx->height);
+    if (grid == NULL) {
+      return;
+    }
   }
 
   cl_int ret = 0;
@@ -327,14 +453,14 @@ void SATDecoder::SampleFrameRectGPU(cl_mem cl_target_buffer, int target_width,
   ret = sample_rect_kernel.setArg(4, sizeof(uint32_t *), &cl_source_buffer);
   ret = sample_rect_kernel.setArg(5, sizeof(int), &codec_ctx->width);
   ret = sample_rect_kernel.setArg(6, sizeof(int), &codec_ctx->height);
-  ret = sample_rect_kernel.setArg(7, sizeof(int16_t *), &grid_buffer);
+  ret = sample_rect_kernel.setArg(7, sizeof(int16_t *), &(*grid)());
   ret = sample_rect_kernel.setArg(8, sizeof(cl_float2), &center);
 
   cl::NDRange global_item_size(8 * ((target_width + 7) / 8),
                                8 * ((target_height + 7) / 8));
   cl::NDRange local_item_size(8, 8);
   ret = cl_manager->command_queue.enqueueNDRangeKernel(
-      sample_rect_kernel, 0, global_item_size, local_item_size, NULL, NULL);
+      sample_rect_kernel, 0, global_item_size, local_item_size, NULL, event);
   if (ret != CL_SUCCESS) {
     std::cerr
         << "[SATDecoder::SampleFrameRectGPU] Sample rect kernel launch failed:"
@@ -347,6 +473,113 @@ Error:
             << std::endl;
 }
 
+/**
+ * Samples a YUV420P frame from plane SATs built by
+ * SATEncoder::EncodeFrameYUV420GPU. The target holds the Y, U and V planes
+ * one after the other, each with its width as linesize.
+ */
+void SATDecoder::SampleFrameRectYUV420GPU(cl_mem cl_target_buffer,
+                                          int target_width, int target_height,
+                                          cl_mem cl_source_buffer,
+                                          int source_width, int source_height,
+                                          float center_x, float center_y,
+                                          cl::Event *event) {
+  if (!use_opencl) {
+    std::cerr
+        << "[SATDecoder::SampleFrameRectYUV420GPU] Not initialized with OpenCL"
+        << std::endl;
+    return;
+  }
+
+  if (grid == NULL) {
+    std::cerr << "[SATDecoder::SampleFrameRectYUV420GPU] Grid Not Initialized"
+              << std::endl;
+    InitializeGrid(target_width, target_height, source_width, source_height);
+    if (grid == NULL) {
+      return;
+    }
+  }
+
+  cl_int ret = 0;
+  cl_float2 center = {center_x, center_y};
+  ret = sample_rect_yuv420_kernel.setArg(0, sizeof(uint8_t *),
+                                         &cl_target_buffer);
+  ret = sample_rect_yuv420_kernel.setArg(1, sizeof(int), &target_width);
+  ret = sample_rect_yuv420_kernel.setArg(2, sizeof(int), &target_height);
+  ret = sample_rect_yuv420_kernel.setArg(3, sizeof(uint32_t *),
+                                         &cl_source_buffer);
+  ret = sample_rect_yuv420_kernel.setArg(4, sizeof(int), &source_width);
+  ret = sample_rect_yuv420_kernel.setArg(5, sizeof(int), &source_height);
+  ret = sample_rect_yuv420_kernel.setArg(6, sizeof(int16_t *), &(*grid)());
+  ret = sample_rect_yuv420_kernel.setArg(7, sizeof(cl_float2), &center);
+
+  cl::NDRange global_item_size(8 * ((target_width + 7) / 8),
+                               8 * ((target_height + 7) / 8));
+  cl::NDRange local_item_size(8, 8);
+  ret = cl_manager->command_queue.enqueueNDRangeKernel(
+      sample_rect_yuv420_kernel, 0, global_item_size, local_item_size, NULL,
+      event);
+  if (ret != CL_SUCCESS) {
+    std::cerr << "[SATDecoder::SampleFrameRectYUV420GPU] Sample rect kernel "
+                 "launch failed:"
+              << ret << " " << OpenCLManager::GetCLErrorString(ret)
+              << std::endl;
+  }
+}
+
+/**
+ * Samples one frame for each of the candidate_count centers in cl_centers,
+ * a buffer of cl_float2, in one launch. The frames are stored one after the
+ * other in cl_target_buffer, target_height * target_linesize bytes apart.
+ */
+void SATDecoder::SampleFrameRectCandidatesGPU(
+    cl_mem cl_target_buffer, int target_width, int target_height,
+    int target_linesize, cl_mem cl_source_buffer, AVCodecContext *codec_ctx,
+    cl_mem cl_centers, int candidate_count, cl::Event *event) {
+  if (!use_opencl) {
+    std::cerr << "[SATDecoder::SampleFrameRectCandidatesGPU] Not initialized "
+                 "with OpenCL"
+              << std::endl;
+    return;
+  }
+
+  if (grid == NULL) {
+    std::cerr << "[SATDecoder::SampleFrameRectCandidatesGPU] Grid Not "
+                 "Initialized"
+              << std::endl;
+    InitializeGrid(target_width, target_height, codec_ctx->width,
+                   codec_ctx->height);
+    if (grid == NULL) {
+      return;
+    }
+  }
+
+  cl_int ret = 0;
+  cl::Kernel &kernel = sample_rect_candidates_kernel;
+  ret = kernel.setArg(0, sizeof(uint8_t *), &cl_target_buffer);
+  ret = kernel.setArg(1, sizeof(int), &target_width);
+  ret = kernel.setArg(2, sizeof(int), &target_height);
+  ret = kernel.setArg(3, sizeof(int), &target_linesize);
+  ret = kernel.setArg(4, sizeof(uint32_t *), &cl_source_buffer);
+  ret = kernel.setArg(5, sizeof(int), &codec_ctx->width);
+  ret = kernel.setArg(6, sizeof(int), &codec_ctx->height);
+  ret = kernel.setArg(7, sizeof(int16_t *), &(*grid)());
+  ret = kernel.setArg(8, sizeof(cl_float2 *), &cl_centers);
+
+  cl::NDRange global_item_size(8 * ((target_width + 7) / 8),
+                               8 * ((target_height + 7) / 8),
+                               candidate_count);
+  cl::NDRange local_item_size(8, 8, 1);
+  ret = cl_manager->command_queue.enqueueNDRangeKernel(
+      kernel, 0, global_item_size, local_item_size, NULL, event);
+  if (ret != CL_SUCCESS) {
+    std::cerr << "[SATDecoder::SampleFrameRectCandidatesGPU] Sample rect "
+                 "candidates kernel launch failed:"
+              << ret << " " << OpenCLManager::GetCLErrorString(ret)
+              << std::endl;
+  }
+}
+
 void SATDecoder::SampleFrameRectGPU360(cl_mem cl_target_buffer,
                                        int target_width, int target_height,
                                        int target_linesize,
@@ -360,11 +593,14 @@ void SATDecoder::SampleFrameRectGPU360(cl_mem cl_target_buffer,
     return;
   }
 
-  if (grid_size <= 0) {
+  if (grid == NULL) {
     std::cerr << "[SATDecoder::SampleFrameRectGPU360] Grid Not Initialized"
               << std::endl;
     InitializeGrid(target_width, target_height, codec_ctx->width,
                    codec_ctx->height);
+    if (grid == NULL) {
+      return;
+    }
   }
 
   cl_int ret = 0;
@@ -378,7 +614,7 @@ void SATDecoder::SampleFrameRectGPU360(cl_mem cl_target_buffer,
   ret = sample_rect_360_kernel.setArg(4, sizeof(uint32_t *), &cl_source_buffer);
   ret = sample_rect_360_kernel.setArg(5, sizeof(int), &codec_ctx->width);
   ret = sample_rect_360_kernel.setArg(6, sizeof(int), &codec_ctx->height);
-  ret = sample_rect_360_kernel.setArg(7, sizeof(int16_t *), &grid_buffer);
+  ret = sample_rect_360_kernel.setArg(7, sizeof(int16_t *), &(*grid)());
   ret = sample_rect_360_kernel.setArg(8, sizeof(cl_float2), &center);
 
   cl::NDRange global_item_size(target_width, target_height);
@@ -400,135 +636,76 @@ Error:
 void SATDecoder::SampleFrameRectCPU(AVFrame *target_frame, uint32_t *buffer,
                                     AVCodecContext *codec_ctx, float center_x,
                                     float center_y) {
-  using namespace std;
-  cl_int ret = 0;
-  int source_width = codec_ctx->width;
-  int source_height = codec_ctx->height;
-  int input_bytes_per_pixel = 3;
-  int input_linesize = 4 * source_width;
-
-  int rect_buffer_width = target_frame->width;
-  int rect_buffer_height = target_frame->height;
-
-  uint32_t *source_buffer = buffer;
-  uint8_t *output_buffer = target_frame->data[0];
-
-  int output_linesize = target_frame->linesize[0];
-  int output_bytes_per_pixel = output_linesize / rect_buffer_width;
-
-  for (int i = 0; i < rect_buffer_width; i++) {
-    for (int j = 0; j < rect_buffer_height; j++) {
-      // Assume the height is 0 to 1
-      // float aspectRatio = ((float)width / height);
-
-      int u = i - rect_buffer_width / 2;
-      int v = j - rect_buffer_height / 2;
+  SampleFrameRectCPU(target_frame->data[0], target_frame->width,
+                     target_frame->height, target_frame->linesize[0], buffer,
+                     codec_ctx->width, codec_ctx->height, center_x, center_y);
+}
 
-      float lambdaX = source_width / (exp(1.0f) - 1);
-      float lambdaY = source_height / (exp(1.0f) - 1);
-      int delta_x =
-          max((int)abs(u),
-              (int)(lambdaX *
-                    (exp(pow(2.0 * abs(u) / rect_buffer_width, 4.0)) - 1))) *
-          ((u > 0) - (u < 0));
-      int delta_x_minus =
-          max((int)abs(u - 1),
-              (int)(lambdaX *
-                    (exp(pow(2.0 * abs(u - 1) / rect_buffer_width, 4.0)) -
-                     1))) *
-          ((u - 1 > 0) - (u - 1 < 0));
-      int delta_y =
-          max((int)abs(v),
-              (int)(lambdaY *
-                    (exp(pow(2.0 * abs(v) / rect_buffer_height, 4.0)) - 1))) *
-          ((v > 0) - (v < 0));
-      int delta_y_minus =
-          max((int)abs(v - 1),
-              (int)(lambdaY *
-                    (exp(pow(2.0 * abs(v - 1) / rect_buffer_height, 4.0)) -
-                     1))) *
-          ((v - 1 > 0) - (v - 1 < 0));
-      int x_pos = center_x * source_width + delta_x;
-      int x_pos_minus = center_x * source_width + delta_x_minus;
-      int y_pos = center_y * source_height + delta_y;
-      int y_pos_minus = center_y * source_height + delta_y_minus;
-
-      if (x_pos >= 0 && x_pos < source_width && y_pos >= 0 &&
-          y_pos < source_height) {
-        x_pos_minus = min(max(x_pos_minus, 0), x_pos - 1);
-        y_pos_minus = min(max(y_pos_minus, 0), y_pos - 1);
-        int target_coord = j * output_linesize + i * output_bytes_per_pixel;
-        if (x_pos > 0 && y_pos > 0) {
-          int top_left_coord = y_pos_minus * input_linesize +
-                               x_pos_minus * input_bytes_per_pixel;
-          int top_right_coord =
-              y_pos_minus * input_linesize + x_pos * input_bytes_per_pixel;
-          int bottom_left_coord =
-              y_pos * input_linesize + x_pos_minus * input_bytes_per_pixel;
-          int bottom_right_coord =
-              y_pos * input_linesize + x_pos * input_bytes_per_pixel;
-          int rectangle_size = (x_pos - x_pos_minus) * (y_pos - y_pos_minus);
-          output_buffer[target_coord] =
-              (source_buffer[bottom_right_coord] -
-               source_buffer[top_right_coord] + source_buffer[top_left_coord] -
-               source_buffer[bottom_left_coord]) /
-              rectangle_size;
-          output_buffer[target_coord + 1] =
-              (source_buffer[bottom_right_coord + 1] -
-               source_buffer[top_right_coord + 1] +
-               source_buffer[top_left_coord + 1] -
-               source_buffer[bottom_left_coord + 1]) /
-              rectangle_size;
-          output_buffer[target_coord + 2] =
-              (source_buffer[bottom_right_coord + 2] -
-               source_buffer[top_right_coord + 2] +
-               source_buffer[top_left_coord + 2] -
-               source_buffer[bottom_left_coord + 2]) /
-              rectangle_size;
-        } else if (x_pos > 0) {
-          // y_pos is 0
-          int right_coordinate = x_pos * input_bytes_per_pixel;
-          int left_coordinate = x_pos_minus * input_bytes_per_pixel;
-          int rectangle_size = (x_pos - x_pos_minus);
-          output_buffer[target_coord] = (source_buffer[right_coordinate] -
-                                         source_buffer[left_coordinate]) /
-                                        rectangle_size;
-          output_buffer[target_coord + 1] =
-              (source_buffer[right_coordinate + 1] -
-               source_buffer[left_coordinate + 1]) /
-              rectangle_size;
-          output_buffer[target_coord + 2] =
-              (source_buffer[right_coordinate + 2] -
-               source_buffer[left_coordinate + 2]) /
-              rectangle_size;
-        } else if (y_pos > 0) {
-          // x_pos is 0
-          int top_coordinate = y_pos_minus * input_linesize;
-          int bottom_coordinate = y_pos * input_linesize;
-          int rectangle_size = y_pos - y_pos_minus;
-          output_buffer[target_coord] = (source_buffer[bottom_coordinate] -
-                                         source_buffer[top_coordinate]) /
-                                        rectangle_size;
-          output_buffer[target_coord + 1] =
-              (source_buffer[bottom_coordinate + 1] -
-               source_buffer[top_coordinate + 1]) /
-              rectangle_size;
-          output_buffer[target_coord + 2] =
-              (source_buffer[bottom_coordinate + 2] -
-               source_buffer[top_coordinate + 2]) /
-              rectangle_size;
-        } else {
-          output_buffer[target_coord] = source_buffer[0];
-          output_buffer[target_coord + 1] = source_buffer[1];
-          output_buffer[target_coord + 2] = source_buffer[2];
-        }
-      }
+/**
+ * Samples the frame for a gaze at center from the interleaved SAT of
+ * EncodeFrameCPU or EncodeFrameGPU, as sample_rect_kernel does. Offsets come
+ * from the CPU grid and each output column's rectangle is resolved once per
+ * frame, so the rows only read the corners of their pixels and divide.
+ * Rows are split into bands, one per thread, and use AVX2 when the CPU
+ * supports it.
+ * Not thread safe.
+ */
+void SATDecoder::SampleFrameRectCPU(uint8_t *target_frame, int target_width,
+                                    int target_height, int target_linesize,
+                                    const uint32_t *source_frame,
+                                    int source_width, int source_height,
+                                    float center_x, float center_y) {
+  InitializeGridCPU(target_width, target_height, source_width, source_height);
+  int origin_x = center_x * source_width;
+  int origin_y = center_y * source_height;
+
+  std::vector<SampleColumn> columns(target_width);
+  for (int i = 0; i < target_width; i++) {
+    int x = origin_x + cpu_grid_x[i + 1];
+    int x_minus = origin_x + cpu_grid_x[i];
+    if (x >= source_width && x_minus >= source_width) {
+      x -= source_width;
+      x_minus -= source_width;
+    } else if (x < 0 && x_minus < 0) {
+      x += source_width;
+      x_minus += source_width;
+    }
+    if (!((x >= 0 && x < source_width) ||
+          (x_minus >= 0 && x_minus < source_width))) {
+      columns[i].x = -1;
+      continue;
     }
+    x = std::min(std::max(x, 1), source_width - 1);
+    x_minus = std::min(std::max(x_minus, 0), x - 1);
+    columns[i].x = x;
+    columns[i].x_minus = x_minus;
+    columns[i].max_height = (int)(MAX_RECT_AREA / (x - x_minus));
   }
 
-  return;
-Error:
-  std::cerr << "Some error occurred in SampleFrameRect" << std::endl;
+  int bytes_per_pixel = target_linesize / target_width;
+  bool use_avx2 = HasAVX2();
+  cpu_pool.Run([&](int part, int part_count) {
+    int begin = (int64_t)target_height * part / part_count;
+    int end = (int64_t)target_height * (part + 1) / part_count;
+    for (int j = begin; j < end; j++) {
+      int y = origin_y + cpu_grid_y[j + 1];
+      int y_minus = origin_y + cpu_grid_y[j];
+      if (!((y >= 0 && y < source_height) ||
+            (y_minus >= 0 && y_minus < source_height))) {
+        continue;
+      }
+      y = std::min(std::max(y, 1), source_height - 1);
+      y_minus = std::min(std::max(y_minus, 0), y - 1);
+      uint8_t *target_row = target_frame + (size_t)j * target_linesize;
+      if (use_avx2) {
+        SampleRowAVX2(target_row, bytes_per_pixel, source_frame, source_width,
+                      source_height, columns.data(), target_width, y, y_minus);
+      } else {
+        SampleRow(target_row, bytes_per_pixel, source_frame, source_width,
+                  columns.data(), target_width, y, y_minus);
+      }
+    }
+  });
 }
 
 void SATDecoder::PrintClProgramBuildFailure(cl_int ret, cl_program program,
@@ -777,17 +954,20 @@ void SATDecoder::CreateReducedSAT(cl_mem cl_target_buffer, int target_width,
                                   int source_linesize, cl_mem u_buffer,
                                   cl_mem v_buffer, cl_mem sv_buffer,
                                   float center_x, float center_y, int sv_count,
-                                  float delta_range[3]) {
+                                  float delta_range[3], cl::Event *event) {
   if (!use_opencl) {
     std::cerr << "[SATDecoder::CreateReducedSAT] Not initialized with OpenCL"
               << std::endl;
     return;
   }
 
-  if (grid_size == -1) {
+  if (grid == NULL) {
     std::cerr << "[SATDecoder::CreateReducedSAT] Grid Not Initialized"
               << std::endl;
     InitializeGrid(target_width, target_height, source_width, source_height);
+    if (grid == NULL) {
+      return;
+    }
   }
 
   cl_int ret = 0;
@@ -801,7 +981,7 @@ void SATDecoder::CreateReducedSAT(cl_mem cl_target_buffer, int target_width,
   ret = create_reduced_sat_kernel.setArg(4, sizeof(int), &source_width);
   ret = create_reduced_sat_kernel.setArg(5, sizeof(int), &source_height);
   ret = create_reduced_sat_kernel.setArg(6, sizeof(int), &source_linesize);
-  ret = create_reduced_sat_kernel.setArg(7, sizeof(cl_mem), &grid_buffer);
+  ret = create_reduced_sat_kernel.setArg(7, sizeof(cl_mem), &(*grid)());
   ret = create_reduced_sat_kernel.setArg(8, sizeof(float), &center_x);
   ret = create_reduced_sat_kernel.setArg(9, sizeof(float), &center_y);
   ret = create_reduced_sat_kernel.setArg(10, sizeof(cl_mem), &u_buffer);
@@ -821,7 +1001,7 @@ void SATDecoder::CreateReducedSAT(cl_mem cl_target_buffer, int target_width,
   cl::NDRange local_item_size(8, 8);
   ret = cl_manager->command_queue.enqueueNDRangeKernel(
       create_reduced_sat_kernel, 0, global_item_size, local_item_size, NULL,
-      NULL);
+      event);
   if (ret != CL_SUCCESS) {
     std::cerr
         << "[SATDecoder::CreateReducedSAT] Sample rect kernel launch failed:"
@@ -832,10 +1012,10 @@ void SATDecoder::CreateReducedSAT(cl_mem cl_target_buffer, int target_width,
   return;
 }
 
-void SATDecoder::SampleFrameFromReducedSAT(cl_mem cl_target_buffer,
-                                           int target_width, int target_height,
-                                           int target_linesize,
-                                           cl_mem cl_reduced_sat) {
+void SATDecoder::SampleFrameFromReducedSAT(
+    cl_mem cl_target_buffer, int target_width, int target_height,
+    int target_linesize, cl_mem cl_reduced_sat, float channel_mean[3],
+    cl::Event *event) {
   if (!use_opencl) {
     std::cerr
         << "[SATDecoder::SampleFrameFromReducedSAT] Not initialized with OpenCL"
@@ -843,16 +1023,18 @@ void SATDecoder::SampleFrameFromReducedSAT(cl_mem cl_target_buffer,
     return;
   }
 
-  if (grid_size == -1) {
+  if (grid == NULL) {
     std::cerr << "[SATDecoder::SampleFrameFromReducedSAT] Grid Not Initialized"
               << std::endl;
     exit(1);
   }
 
   cl_int ret = 0;
+  cl_float3 cl_channel_mean =
+      (cl_float3){channel_mean[0], channel_mean[1], channel_mean[2]};
 
   // __global uchar *output_buffer, int output_width, int output_height,
-  // int output_linesize, __global uint *source_buffer
+  // int output_linesize, __global float *source_buffer, float3 channel_mean
   // Set all the parameters and call the kernel
   ret = sample_rect_from_reduced_sat_kernel.setArg(0, sizeof(cl_mem),
                                                    &cl_target_buffer);
@@ -864,24 +1046,70 @@ void SATDecoder::SampleFrameFromReducedSAT(cl_mem cl_target_buffer,
                                                    &target_linesize);
   ret = sample_rect_from_reduced_sat_kernel.setArg(4, sizeof(cl_mem),
                                                    &cl_reduced_sat);
-  ret = sample_rect_from_reduced_sat_kernel.setArg(5, sizeof(cl_mem),
-                                                   &cl_reduced_sat);
+  ret = sample_rect_from_reduced_sat_kernel.setArg(5, sizeof(cl_float3),
+                                                   &cl_channel_mean);
+  if (ret != CL_SUCCESS) {
+    std::cerr << "[SATDecoder::SampleFrameFromReducedSAT] Set arg failed:"
+              << ret << ":" << OpenCLManager::GetCLErrorString(ret)
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
 
-  cl::NDRange global_item_size((size_t)target_width, (size_t)target_height);
+  cl::NDRange global_item_size(8 * (size_t)((target_width + 7) / 8),
+                               8 * (size_t)((target_height + 7) / 8));
   cl::NDRange local_item_size(8, 8);
   ret = cl_manager->command_queue.enqueueNDRangeKernel(
       sample_rect_from_reduced_sat_kernel, 0, global_item_size, local_item_size,
-      NULL, NULL);
+      NULL, event);
   if (ret != CL_SUCCESS) {
     std::cerr << "[SATDecoder::SampleFrameFromReducedSAT] Sample rect kernel "
                  "launch failed:"
               << ret << std::endl;
     return;
   }
-  return;
-Error:
-  std::cerr << "[SATDecoder::SampleFrameFromReducedSAT] Some error occurred"
-            << std::endl;
+}
+
+void SATDecoder::SampleFrameFromLatticeSAT(cl_mem cl_target_buffer,
+                                           int target_width, int target_height,
+                                           int target_linesize,
+                                           cl_mem cl_lattice_sat,
+                                           cl::Event *event) {
+  if (!use_opencl) {
+    std::cerr
+        << "[SATDecoder::SampleFrameFromLatticeSAT] Not initialized with OpenCL"
+        << std::endl;
+    return;
+  }
+
+  cl_int ret = 0;
+  ret = sample_rect_from_lattice_sat_kernel.setArg(0, sizeof(cl_mem),
+                                                   &cl_target_buffer);
+  ret =
+      sample_rect_from_lattice_sat_kernel.setArg(1, sizeof(int), &target_width);
+  ret = sample_rect_from_lattice_sat_kernel.setArg(2, sizeof(int),
+                                                   &target_height);
+  ret = sample_rect_from_lattice_sat_kernel.setArg(3, sizeof(int),
+                                                   &target_linesize);
+  ret = sample_rect_from_lattice_sat_kernel.setArg(4, sizeof(cl_mem),
+                                                   &cl_lattice_sat);
+  if (ret != CL_SUCCESS) {
+    std::cerr << "[SATDecoder::SampleFrameFromLatticeSAT] Set arg failed:"
+              << ret << ":" << OpenCLManager::GetCLErrorString(ret)
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  cl::NDRange global_item_size(8 * (size_t)((target_width + 7) / 8),
+                               8 * (size_t)((target_height + 7) / 8));
+  cl::NDRange local_item_size(8, 8);
+  ret = cl_manager->command_queue.enqueueNDRangeKernel(
+      sample_rect_from_lattice_sat_kernel, 0, global_item_size, local_item_size,
+      NULL, event);
+  if (ret != CL_SUCCESS) {
+    std::cerr << "[SATDecoder::SampleFrameFromLatticeSAT] Sample rect kernel "
+                 "launch failed:"
+              << ret << std::endl;
+  }
 }
 
 void SATDecoder::InterpolateFrameRectGPU(
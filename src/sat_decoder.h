@@ -13,8 +13,11 @@ extern "C" {
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <vector>
 
+#include "cpu_worker_pool.h"
 #include "opencl_manager.h"
 
 class SATDecoder {
@@ -24,14 +27,24 @@ class SATDecoder {
   cl::Kernel decode_kernel;
   cl::Program sample_rect_program;
   cl::Kernel sample_rect_kernel;
+  cl::Kernel sample_rect_candidates_kernel;
   cl::Kernel sample_rect_360_kernel;
+  cl::Kernel sample_rect_yuv420_kernel;
   cl::Kernel create_grid_kernel;
   cl::Kernel sample_rect_from_reduced_sat_kernel;
+  cl::Kernel sample_rect_from_lattice_sat_kernel;
   cl::Kernel create_reduced_sat_kernel;
   cl::Program interpolate_program;
   cl::Kernel interpolate_kernel;
-  cl::Buffer grid_buffer;
-  int64_t grid_size = -1;
+  // Shared with the other samplers of the context through its grid cache.
+  std::shared_ptr<const cl::Buffer> grid;
+  // Grid of the CPU path. It is separable, so only the x offsets of its
+  // columns and the y offsets of its rows are kept, as create_grid_kernel
+  // computes them.
+  std::vector<int> cpu_grid_x;
+  std::vector<int> cpu_grid_y;
+  int cpu_grid_source_width = 0;
+  int cpu_grid_source_height = 0;
 
   bool use_opencl = false;
 
@@ -42,11 +55,21 @@ class SATDecoder {
   float lerp(float a, float b, float c) { return a * (1.0 - c) + b * c; }
 
  public:
+  // Largest rectangle, in pixels, whose sum is read from the SAT. The SAT
+  // wraps around at 2^32, and corner differences are only exact while the
+  // sum of 8-bit values fits in 32 bits. Taller rectangles are cut from the
+  // top. As defined in sat_decoder_sample_rect_kernel.cl.
+  static const uint32_t MAX_RECT_AREA = 0xFFFFFFFFu / 255;
+  // Threads of the CPU path, started by the first CPU sample.
+  CPUWorkerPool cpu_pool;
+
   SATDecoder();
   SATDecoder(OpenCLManager *cl_manager);
   ~SATDecoder();
   void InitializeGrid(int target_width, int target_height, int source_width,
                       int source_height);
+  void InitializeGridCPU(int target_width, int target_height, int source_width,
+                         int source_height);
   void DecodeFrameGPU(cl_mem cl_target_buffer, int target_linesize,
                       cl_mem cl_source_buffer, int width, int height);
   void DecodeFrameCPU(AVFrame *target_frame, uint32_t *buffer,
@@ -56,14 +79,35 @@ class SATDecoder {
                         int source_width, int source_height,
                         int source_linesize, cl_mem u_buffer, cl_mem v_buffer,
                         cl_mem sv_buffer, float center_x, float center_y,
-                        int sv_count, float delta_range[3]);
+                        int sv_count, float delta_range[3],
+                        cl::Event *event = NULL);
   void SampleFrameFromReducedSAT(cl_mem cl_target_buffer, int target_width,
                                  int target_height, int target_linesize,
-                                 cl_mem cl_reduced_sat);
+                                 cl_mem cl_reduced_sat, float channel_mean[3],
+                                 cl::Event *event = NULL);
+  void SampleFrameFromLatticeSAT(cl_mem cl_target_buffer, int target_width,
+                                 int target_height, int target_linesize,
+                                 cl_mem cl_lattice_sat,
+                                 cl::Event *event = NULL);
+  // Grid of the last InitializeGrid, for SATEncoder::EncodeLatticeGPU.
+  cl_mem GetGridBuffer() { return grid == NULL ? NULL : (*grid)(); }
+  std::shared_ptr<const cl::Buffer> GetGrid() { return grid; }
   void SampleFrameRectGPU(cl_mem cl_target_buffer, int target_width,
                           int target_height, int target_linesize,
                           cl_mem cl_source_buffer, AVCodecContext *codec_ctx,
-                          float center_x, float center_y);
+                          float center_x, float center_y,
+                          cl::Event *event = NULL);
+  void SampleFrameRectCandidatesGPU(cl_mem cl_target_buffer, int target_width,
+                                    int target_height, int target_linesize,
+                                    cl_mem cl_source_buffer,
+                                    AVCodecContext *codec_ctx,
+                                    cl_mem cl_centers, int candidate_count,
+                                    cl::Event *event = NULL);
+  void SampleFrameRectYUV420GPU(cl_mem cl_target_buffer, int target_width,
+                                int target_height, cl_mem cl_source_buffer,
+                                int source_width, int source_height,
+                                float center_x, float center_y,
+                                cl::Event *event = NULL);
   void SampleFrameRectGPU360(cl_mem cl_target_buffer, int target_width,
                              int target_height, int target_linesize,
                              cl_mem cl_source_buffer, AVCodecContext *codec_ctx,
@@ -71,6 +115,10 @@ class SATDecoder {
   void SampleFrameRectCPU(AVFrame *target_frame, uint32_t *buffer,
                           AVCodecContext *codec_ctx, float center_x,
                           float center_y);
+  void SampleFrameRectCPU(uint8_t *target_frame, int target_width,
+                          int target_height, int target_linesize,
+                          const uint32_t *source_frame, int source_width,
+                          int source_height, float center_x, float center_y);
   void ExpandSampledFrameRectCPU(AVFrame *target_frame, AVFrame *source_frame,
                                  float center_x, float center_y);
   void InterpolateFrameRectCPU(AVFrame *target_frame, AVFrame *source_frame,
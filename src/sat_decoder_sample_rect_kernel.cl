@@ -1,3 +1,10 @@
+// SAT values wrap around at 2^32, so the sum of a rectangle taken from its
+// corners is exact as long as it covers at most MAX_RECT_AREA pixels of up
+// to 255. Taller rectangles are cut from the top.
+#define MAX_RECT_AREA 16843009
+
+// SAT value of one channel at (x, y) from the rank sv_count factors and the
+// 8-bit residual. The factors are of the SAT of the mean centered frame.
 float sample_sat_value_from_svd(int x, int y, __global uchar *source_buffer,
                                 __global float *sv_buffer,
                                 __global float *u_buffer,
@@ -18,16 +25,21 @@ float sample_sat_value_from_svd(int x, int y, __global uchar *source_buffer,
       (source_buffer[y * source_linesize + x * bytes_per_pixel + color] *
            (range / 255.0f) -
        (range / 2.0f));
-  return max(final_value, 0.0f);
+  return final_value;
 }
 
-// Sample from the reduced sat
+// Sample from the reduced sat. Each grid point holds the three channel SATs
+// and the source position they were taken at.
 __kernel void sample_rect_from_reduced_sat_kernel(
     __global uchar *output_buffer, int output_width, int output_height,
-    int output_linesize, __global float *source_buffer) {
+    int output_linesize, __global float *source_buffer, float3 channel_mean) {
   int i = get_global_id(0);
   int j = get_global_id(1);
 
+  if (i >= output_width || j >= output_height) {
+    return;
+  }
+
   int input_bytes_per_pixel = 5;
   int input_linesize = input_bytes_per_pixel * (output_width + 1);
 
@@ -39,43 +51,70 @@ __kernel void sample_rect_from_reduced_sat_kernel(
   int output_bytes_per_pixel = output_linesize / output_width;
   int output_coordinate = j * output_linesize + i * output_bytes_per_pixel;
 
-  float min_value = 0;
-  float max_value = 255;
+  float rect_x = source_buffer[bottom_right_coord + 3] -
+                 source_buffer[bottom_left_coord + 3];
+  float rect_y = source_buffer[bottom_right_coord + 4] -
+                 source_buffer[top_right_coord + 4];
+  // Rectangles entirely above or below the frame are left untouched, as in
+  // sample_rect_kernel.
+  if (rect_x <= 0 || rect_y <= 0) {
+    return;
+  }
 
-  int rect_x = source_buffer[bottom_right_coord + 3] -
-               source_buffer[bottom_left_coord + 3];
-  int rect_y = source_buffer[bottom_right_coord + 4] -
-               source_buffer[top_right_coord + 4];
+  float3 value = (vload3(0, source_buffer + bottom_right_coord) -
+                  vload3(0, source_buffer + top_right_coord) +
+                  vload3(0, source_buffer + top_left_coord) -
+                  vload3(0, source_buffer + bottom_left_coord)) /
+                     (rect_x * rect_y) +
+                 channel_mean;
+  vstore3(convert_uchar3_sat_rte(value), 0, output_buffer + output_coordinate);
+}
 
-  for (int color = 0; color < 3; color++) {
-    float top_left_value = source_buffer[top_left_coord + color] * (rect_x > 0);
-    float top_right_value =
-        source_buffer[top_right_coord + color] * (rect_y > 0);
-    float bottom_left_value =
-        source_buffer[bottom_left_coord + color] * (rect_x > 0 && rect_y > 0);
-    float bottom_right_value =
-        source_buffer[bottom_right_coord + color] * (rect_x > 0 || rect_y > 0);
-
-    int rectangle_size = max(rect_x, 1) * max(rect_y, 1);
-    output_buffer[output_coordinate + color] =
-        (uchar)clamp((bottom_right_value - top_right_value + top_left_value -
-                      bottom_left_value) /
-                         rectangle_size,
-                     min_value, max_value);
+// Sample from a lattice SAT built by SATEncoder::EncodeLatticeGPU. Grid points
+// are laid out as in sample_rect_from_reduced_sat_kernel, with sums that wrap
+// around at 2^32 and positions stored as int.
+__kernel void sample_rect_from_lattice_sat_kernel(
+    __global uchar *output_buffer, int output_width, int output_height,
+    int output_linesize, __global uint *source_buffer) {
+  int i = get_global_id(0);
+  int j = get_global_id(1);
+
+  if (i >= output_width || j >= output_height) {
+    return;
   }
-  //   if (output_buffer[output_coordinate] > 250) {
-  //     printf("Color is white at %d,%d\n", i, j);
-  //     //   printf("rect size %d %d, %d\n\n", rectangle_size, rect_x, rect_y);
-  //     //   printf("Values %f \n\n", (bottom_right_value - top_right_value +
-  //     //                             top_left_value - bottom_left_value) /
-  //     //                                rectangle_size);
-  //     output_buffer[output_coordinate + 0] = 255;
-  //     output_buffer[output_coordinate + 1] = 0;
-  //     output_buffer[output_coordinate + 2] = 0;
-  //   }
+
+  int input_bytes_per_pixel = 5;
+  int input_linesize = input_bytes_per_pixel * (output_width + 1);
+
+  int top_left_coord = j * input_linesize + i * input_bytes_per_pixel;
+  int top_right_coord = top_left_coord + input_bytes_per_pixel;
+  int bottom_left_coord = top_left_coord + input_linesize;
+  int bottom_right_coord = bottom_left_coord + input_bytes_per_pixel;
+
+  int output_bytes_per_pixel = output_linesize / output_width;
+  int output_coordinate = j * output_linesize + i * output_bytes_per_pixel;
+
+  int rect_x = as_int(source_buffer[bottom_right_coord + 3]) -
+               as_int(source_buffer[bottom_left_coord + 3]);
+  int rect_y = as_int(source_buffer[bottom_right_coord + 4]) -
+               as_int(source_buffer[top_right_coord + 4]);
+  if (rect_x <= 0 || rect_y <= 0) {
+    return;
+  }
+
+  uint3 value = (vload3(0, source_buffer + bottom_right_coord) -
+                 vload3(0, source_buffer + top_right_coord) +
+                 vload3(0, source_buffer + top_left_coord) -
+                 vload3(0, source_buffer + bottom_left_coord)) /
+                (uint3)(rect_x * rect_y);
+  vstore3(convert_uchar3_sat(value), 0, output_buffer + output_coordinate);
 }
 
-// Recreate a sat along the destination points from the SVD
+// Recreate a sat along the destination points from the SVD.
+// Grid point (i, j) is the bottom right corner of output pixel (i - 1, j - 1).
+// Rows above the frame have a SAT of 0 and rows below repeat the last row.
+// Columns are not wrapped, so rectangles across the seam keep their width.
+// Instead, each wrap around the frame adds the SAT of the last column.
 __kernel void create_reduced_sat_kernel(
     __global float *output_buffer, int output_width, int output_height,
     __global uchar *source_buffer, int source_width, int source_height,
@@ -95,52 +134,49 @@ __kernel void create_reduced_sat_kernel(
   int i = get_global_id(0);
   int j = get_global_id(1);
 
-  if (i >= output_width || j >= output_height) {
+  if (i >= grid_width || j >= grid_height) {
     return;
   }
 
-  int delta_x = grid_buffer[(j)*grid_linesize + (i)*grid_bytes_per_pixel];
-  int delta_x_minus =
-      grid_buffer[(j)*grid_linesize + (i - 1) * grid_bytes_per_pixel];
-  int delta_y = grid_buffer[(j)*grid_linesize + (i)*grid_bytes_per_pixel + 1];
-  int delta_y_minus =
-      grid_buffer[(j - 1) * grid_linesize + (i)*grid_bytes_per_pixel + 1];
+  int delta_x = grid_buffer[j * grid_linesize + i * grid_bytes_per_pixel];
+  int delta_y = grid_buffer[j * grid_linesize + i * grid_bytes_per_pixel + 1];
   int x_pos = center_x * source_width + delta_x;
-  int x_pos_minus = center_x * source_width + delta_x_minus;
-  int y_pos = center_y * source_height + delta_y;
-  int y_pos_minus = center_y * source_height + delta_y_minus;
-
-  if (((x_pos >= 0 && x_pos < source_width) ||
-       (x_pos_minus >= 0 && x_pos_minus < source_width)) &&
-      ((y_pos >= 0 && y_pos < source_height) ||
-       (y_pos_minus >= 0 && y_pos_minus < source_height))) {
-    x_pos = clamp(x_pos, 0, source_width - 1);
-    y_pos = clamp(y_pos, 0, source_height - 1);
-
-    int target_coord = j * output_linesize + i * output_bytes_per_pixel;
-    output_buffer[target_coord] = sample_sat_value_from_svd(
-        x_pos, y_pos, source_buffer, sv_buffer, u_buffer, v_buffer,
-        source_width, source_height, source_linesize, source_bytes_per_pixel,
-        sv_count, 0, delta_range.x);
-    output_buffer[target_coord + 1] = sample_sat_value_from_svd(
-        x_pos, y_pos, source_buffer, sv_buffer, u_buffer, v_buffer,
-        source_width, source_height, source_linesize, source_bytes_per_pixel,
-        sv_count, 1, delta_range.y);
-    output_buffer[target_coord + 2] = sample_sat_value_from_svd(
-        x_pos, y_pos, source_buffer, sv_buffer, u_buffer, v_buffer,
-        source_width, source_height, source_linesize, source_bytes_per_pixel,
-        sv_count, 2, delta_range.z);
-    output_buffer[target_coord + 3] = x_pos;
-    output_buffer[target_coord + 4] = y_pos;
+  int y_pos = clamp((int)(center_y * source_height) + delta_y, -1,
+                    source_height - 1);
+  int wraps = x_pos >= 0 ? x_pos / source_width
+                         : -((source_width - 1 - x_pos) / source_width);
+  int x_wrapped = x_pos - wraps * source_width;
+
+  float ranges[3] = {delta_range.x, delta_range.y, delta_range.z};
+  int target_coord = j * output_linesize + i * output_bytes_per_pixel;
+  for (int color = 0; color < 3; color++) {
+    float value = 0;
+    if (y_pos >= 0) {
+      value = sample_sat_value_from_svd(
+          x_wrapped, y_pos, source_buffer, sv_buffer, u_buffer, v_buffer,
+          source_width, source_height, source_linesize, source_bytes_per_pixel,
+          sv_count, color, ranges[color]);
+      if (wraps != 0) {
+        value += wraps * sample_sat_value_from_svd(
+                             source_width - 1, y_pos, source_buffer,
+                             sv_buffer, u_buffer, v_buffer, source_width,
+                             source_height, source_linesize,
+                             source_bytes_per_pixel, sv_count, color,
+                             ranges[color]);
+      }
+    }
+    output_buffer[target_coord + color] = value;
   }
+  output_buffer[target_coord + 3] = x_pos;
+  output_buffer[target_coord + 4] = y_pos;
 }
 
-__kernel void sample_rect_kernel(__global uchar4 *output_buffer,
-                                 int output_width, int output_height,
-                                 int output_linesize,
-                                 __global uint *source_buffer, int source_width,
-                                 int source_height,
-                                 __global short *grid_buffer, float2 center) {
+// Samples output pixel (i, j) for a gaze at center.
+void sample_rect(__global uchar4 *output_buffer, int output_width,
+                 int output_height, int output_linesize,
+                 __global uint *source_buffer, int source_width,
+                 int source_height, __global short *grid_buffer, float2 center,
+                 int i, int j) {
   int rect_buffer_width = output_width;
   int rect_buffer_height = output_height;
 
@@ -156,8 +192,6 @@ __kernel void sample_rect_kernel(__global uchar4 *output_buffer,
   float lambdaX = (float)source_width / (exp(1.0f) - 1);
   float lambdaY = (float)source_height / (exp(1.0f) - 1);
 
-  int i = get_global_id(0);
-  int j = get_global_id(1);
   int u = i - output_width / 2;
   int v = j - output_height / 2;
 
@@ -202,6 +236,7 @@ __kernel void sample_rect_kernel(__global uchar4 *output_buffer,
     pos.y = clamp(pos.y, 1, source_height - 1);
     pos_minus.x = clamp(pos_minus.x, 0, pos.x - 1);
     pos_minus.y = clamp(pos_minus.y, 0, pos.y - 1);
+    pos_minus.y = max(pos_minus.y, pos.y - MAX_RECT_AREA / (pos.x - pos_minus.x));
     int target_coord = j * o_linesize + i;
     if (pos.x > 0 && pos.y > 0) {
       int top_left_coord = pos_minus.y * i_linesize + pos_minus.x;
@@ -240,6 +275,123 @@ __kernel void sample_rect_kernel(__global uchar4 *output_buffer,
   }
 }
 
+__kernel void sample_rect_kernel(__global uchar4 *output_buffer,
+                                 int output_width, int output_height,
+                                 int output_linesize,
+                                 __global uint *source_buffer, int source_width,
+                                 int source_height,
+                                 __global short *grid_buffer, float2 center) {
+  sample_rect(output_buffer, output_width, output_height, output_linesize,
+              source_buffer, source_width, source_height, grid_buffer, center,
+              get_global_id(0), get_global_id(1));
+}
+
+// Samples one frame per center in a single launch. Dimension 2 indexes the
+// candidate, whose frame follows the previous one in output_buffer.
+__kernel void sample_rect_candidates_kernel(
+    __global uchar4 *output_buffer, int output_width, int output_height,
+    int output_linesize, __global uint *source_buffer, int source_width,
+    int source_height, __global short *grid_buffer,
+    __global float2 *centers) {
+  int candidate = get_global_id(2);
+  sample_rect(output_buffer + candidate * output_height * (output_linesize / 4),
+              output_width, output_height, output_linesize, source_buffer,
+              source_width, source_height, grid_buffer, centers[candidate],
+              get_global_id(0), get_global_id(1));
+}
+
+// Mean of a single channel plane over the rectangle (pos_minus, pos], read
+// from its SAT and clamped as in sample_rect. Returns -1 if the rectangle
+// misses the plane.
+int sample_plane_rect(__global uint *sat, int width, int height, int2 pos,
+                      int2 pos_minus) {
+  if (pos.x >= width && pos_minus.x >= width) {
+    pos.x -= width;
+    pos_minus.x -= width;
+  } else if (pos.x < 0 && pos_minus.x < 0) {
+    pos.x += width;
+    pos_minus.x += width;
+  }
+  if (!((pos.x >= 0 && pos.x < width) ||
+        (pos_minus.x >= 0 && pos_minus.x < width)) ||
+      !((pos.y >= 0 && pos.y < height) ||
+        (pos_minus.y >= 0 && pos_minus.y < height))) {
+    return -1;
+  }
+  pos.x = clamp(pos.x, 1, width - 1);
+  pos.y = clamp(pos.y, 1, height - 1);
+  pos_minus.x = clamp(pos_minus.x, 0, pos.x - 1);
+  pos_minus.y = clamp(pos_minus.y, 0, pos.y - 1);
+  pos_minus.y = max(pos_minus.y, pos.y - MAX_RECT_AREA / (pos.x - pos_minus.x));
+  uint sum = sat[pos.y * width + pos.x] - sat[pos_minus.y * width + pos.x] +
+             sat[pos_minus.y * width + pos_minus.x] -
+             sat[pos.y * width + pos_minus.x];
+  return sum / ((pos.x - pos_minus.x) * (pos.y - pos_minus.y));
+}
+
+// Samples a YUV420P frame for a gaze at center from the plane SATs of
+// copy_scan_yuv420_rows_kernel. The output planes follow each other with the
+// width of each plane as its linesize. Each work-item samples luma pixel
+// (i, j), and chroma pixel (i / 2, j / 2) if i and j are even, from the
+// rectangle of the two by two grid cells it covers.
+__kernel void sample_rect_yuv420_kernel(__global uchar *output_buffer,
+                                        int output_width, int output_height,
+                                        __global uint *source_buffer,
+                                        int source_width, int source_height,
+                                        __global short *grid_buffer,
+                                        float2 center) {
+  int i = get_global_id(0);
+  int j = get_global_id(1);
+  if (i >= output_width || j >= output_height) {
+    return;
+  }
+  // Grid offsets are separable, so x is read from the first grid row and y
+  // from the first grid column.
+  int grid_linesize = 2 * (output_width + 1);
+  int2 origin = (int2)(center.x * source_width, center.y * source_height);
+  int2 pos_minus = origin + (int2)(grid_buffer[2 * i],
+                                   grid_buffer[j * grid_linesize + 1]);
+  int2 pos = origin + (int2)(grid_buffer[2 * (i + 1)],
+                             grid_buffer[(j + 1) * grid_linesize + 1]);
+  int value = sample_plane_rect(source_buffer, source_width, source_height,
+                                pos, pos_minus);
+  if (value >= 0) {
+    output_buffer[j * output_width + i] = value;
+  }
+  if (i % 2 != 0 || j % 2 != 0) {
+    return;
+  }
+
+  int source_chroma_width = (source_width + 1) / 2;
+  int source_chroma_height = (source_height + 1) / 2;
+  int chroma_width = (output_width + 1) / 2;
+  int chroma_height = (output_height + 1) / 2;
+  int i_plus = min(i + 2, output_width);
+  int j_plus = min(j + 2, output_height);
+  pos = origin + (int2)(grid_buffer[2 * i_plus],
+                        grid_buffer[j_plus * grid_linesize + 1]);
+  // Chroma pixel c covers luma pixels 2c and 2c + 1. A luma SAT position
+  // maps to the last chroma pixel it covers entirely.
+  int2 chroma_pos = ((pos + 1) >> 1) - 1;
+  int2 chroma_pos_minus = ((pos_minus + 1) >> 1) - 1;
+
+  __global uint *u_sat = source_buffer + source_width * source_height;
+  __global uint *v_sat = u_sat + source_chroma_width * source_chroma_height;
+  __global uchar *u_output = output_buffer + output_width * output_height;
+  __global uchar *v_output = u_output + chroma_width * chroma_height;
+  int chroma_coord = (j / 2) * chroma_width + i / 2;
+  value = sample_plane_rect(u_sat, source_chroma_width, source_chroma_height,
+                            chroma_pos, chroma_pos_minus);
+  if (value >= 0) {
+    u_output[chroma_coord] = value;
+  }
+  value = sample_plane_rect(v_sat, source_chroma_width, source_chroma_height,
+                            chroma_pos, chroma_pos_minus);
+  if (value >= 0) {
+    v_output[chroma_coord] = value;
+  }
+}
+
 __kernel void create_grid_kernel(__global short *grid_buffer, int output_width,
                                  int output_height, int source_width,
                                  int source_height) {
@@ -343,6 +495,7 @@ __kernel void sample_rect_360_kernel(
     pos.y = clamp(pos.y, 1, source_height - 1);
     pos_minus.x = clamp(pos_minus.x, 0, pos.x - 1);
     pos_minus.y = clamp(pos_minus.y, 0, pos.y - 1);
+    pos_minus.y = max(pos_minus.y, pos.y - MAX_RECT_AREA / (pos.x - pos_minus.x));
     int target_coord = j * o_linesize + i;
     if (pos.x > 0 && pos.y > 0) {
       int top_left_coord = pos_minus.y * i_linesize + pos_minus.x;
@@ -16,8 +16,15 @@ extern "C" {
 #include <iostream>
 #include <vector>
 
+#include "cpu_worker_pool.h"
 #include "opencl_manager.h"
 
+/**
+ * Builds the summed area table of a frame as three uint32 per pixel. Sums
+ * larger than 32 bits wrap around, which happens for 8-bit frames of more
+ * than 16.8M pixels such as 8K. Differences of wrapped corners remain exact
+ * for rectangles of at most SATDecoder::MAX_RECT_AREA pixels.
+ */
 class SATEncoder {
  private:
   bool use_OpenCL;
@@ -27,12 +34,56 @@ class SATEncoder {
   cl_kernel copy_image_back_kernel;
   cl_kernel scan_rows_kernel;
   cl_kernel scan_columns_kernel;
+  cl_kernel scan_rows_tiled_kernel;
+  cl_kernel transpose_kernel;
+  cl_kernel copy_scan_rows_kernel;
+  cl_kernel scan_columns_coalesced_kernel;
+  cl_kernel copy_scan_yuv420_rows_kernel;
+  cl_kernel scan_yuv420_columns_kernel;
+  cl_kernel lattice_row_sums_kernel;
+  cl_kernel lattice_column_sums_kernel;
+  cl_kernel lattice_column_prefix_kernel;
+  cl_kernel lattice_row_prefix_kernel;
+  // Transposed SAT for the column pass of TILED_SCAN.
+  cl_mem transpose_buffer = NULL;
+  size_t transpose_buffer_size = 0;
+  // Per row cell sums of EncodeLatticeGPU.
+  cl_mem lattice_cells_buffer = NULL;
+  size_t lattice_cells_buffer_size = 0;
 
   void FreeClResources();
   void PrintClProgramBuildFailure(cl_int ret, cl_program program,
                                   cl_device_id device_id);
+  void EncodeFrameFused(cl_mem cl_target_buffer, cl_mem cl_source_buffer,
+                        int source_width, int source_height,
+                        int source_linesize);
+  bool ScanRowsTiled(cl_mem cl_buffer, int width, int height, int linesize);
+  bool Transpose(cl_mem cl_target_buffer, int target_linesize,
+                 cl_mem cl_source_buffer, int width, int height,
+                 int source_linesize);
 
  public:
+  // Work-group sizes, as defined in sat_encoder_encode_kernels.cl.
+  static const int SCAN_TILE = 256;
+  static const int TRANSPOSE_TILE = 16;
+  // Work-group size of scan_columns_coalesced_kernel.
+  static const int COLUMN_GROUP_SIZE = 64;
+  // Words of a row each CPU thread accumulates columns for at a time, a
+  // multiple of the 16 words of a cache line.
+  static const int CPU_COLUMN_TILE = 64;
+  // SERIAL_SCAN scans each row and then each column with one work-item.
+  // TILED_SCAN scans rows with a work-group each, then transposes, scans the
+  // columns as rows and transposes back.
+  // FUSED_SCAN scans rows as TILED_SCAN while copying them from the source,
+  // then scans the columns in place with one work-item per channel.
+  enum ScanMethod { SERIAL_SCAN, TILED_SCAN, FUSED_SCAN };
+  ScanMethod scan_method = FUSED_SCAN;
+  // Layouts of the CPU path. INTERLEAVED is the layout of EncodeFrameGPU.
+  // PLANAR writes the three channels as consecutive width x height planes.
+  enum CPULayout { INTERLEAVED, PLANAR };
+  // Threads of the CPU path, started by the first CPU encode.
+  CPUWorkerPool cpu_pool;
+
   SATEncoder();
   SATEncoder(OpenCLManager *cl_manager);
   ~SATEncoder();
@@ -40,4 +91,18 @@ class SATEncoder {
                       int source_width, int source_height, int source_linesize);
   void EncodeFrameCPU(uint32_t *target_frame, AVCodecContext *codec_ctx,
                       AVFrame *frame);
+  void EncodeFrameCPU(uint32_t *target_frame, const uint8_t *source_frame,
+                      int source_width, int source_height, int source_linesize,
+                      CPULayout layout = INTERLEAVED);
+  void EncodeFrameYUV420GPU(cl_mem cl_target_buffer, cl_mem cl_source_buffer,
+                            int source_width, int source_height,
+                            int y_linesize, int uv_linesize);
+  static size_t GetYUV420SATSize(int width, int height);
+  void EncodeLatticeGPU(cl_mem cl_target_buffer, cl_mem cl_grid_buffer,
+                        int target_width, int target_height,
+                        cl_mem cl_source_buffer, int source_width,
+                        int source_height, int source_linesize,
+                        float center_x, float center_y,
+                        cl_event *start_event = NULL,
+                        cl_event *end_event = NULL);
 };
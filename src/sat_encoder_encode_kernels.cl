@@ -72,3 +72,399 @@ __kernel void scan_columns_kernel(__global uint* output_buffer, int width, int h
 		}
 	}
 }
+
+// Work-group size of scan_rows_tiled_kernel. Must be a power of two.
+#define SCAN_TILE 256
+// Tiles of transpose_kernel are TRANSPOSE_TILE x TRANSPOSE_TILE pixels.
+#define TRANSPOSE_TILE 16
+
+// Scans one tile of a row of three channel pixels with a Blelloch scan in
+// local memory, where work-item i holds pixel i of the tile. The tile is
+// offset by carry, which is then advanced by the tile's sum. Returns the
+// inclusive sum at the work-item's pixel. Must be reached by the whole
+// work-group.
+uint3 scan_tile(__local uint *tile, __local uint *carry, uint3 value, int i)
+{
+	barrier(CLK_LOCAL_MEM_FENCE);
+	tile[i] = value.x;
+	tile[SCAN_TILE + i] = value.y;
+	tile[2 * SCAN_TILE + i] = value.z;
+
+	// Up-sweep, leaving the tile's sum in its last element.
+	for (int stride = 1; stride < SCAN_TILE; stride *= 2) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		int index = (i + 1) * 2 * stride - 1;
+		if (index < SCAN_TILE) {
+			for (int c = 0; c < 3; c++) {
+				tile[c * SCAN_TILE + index] += tile[c * SCAN_TILE + index - stride];
+			}
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	uint3 tile_sum = (uint3)(tile[SCAN_TILE - 1], tile[2 * SCAN_TILE - 1], tile[3 * SCAN_TILE - 1]);
+	uint3 base = (uint3)(carry[0], carry[1], carry[2]);
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (i < 3) {
+		tile[i * SCAN_TILE + SCAN_TILE - 1] = 0;
+		carry[i] += i == 0 ? tile_sum.x : (i == 1 ? tile_sum.y : tile_sum.z);
+	}
+
+	// Down-sweep to the exclusive scan.
+	for (int stride = SCAN_TILE / 2; stride > 0; stride /= 2) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		int index = (i + 1) * 2 * stride - 1;
+		if (index < SCAN_TILE) {
+			for (int c = 0; c < 3; c++) {
+				uint left = tile[c * SCAN_TILE + index - stride];
+				tile[c * SCAN_TILE + index - stride] = tile[c * SCAN_TILE + index];
+				tile[c * SCAN_TILE + index] += left;
+			}
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	uint3 exclusive = (uint3)(tile[i], tile[SCAN_TILE + i], tile[2 * SCAN_TILE + i]);
+	return base + exclusive + value;
+}
+
+// Inclusive scan of each row of three channel pixels. One work-group of
+// SCAN_TILE work-items scans a row, SCAN_TILE pixels at a time. Launched with
+// a global size of (SCAN_TILE, height).
+__kernel void scan_rows_tiled_kernel(__global uint *buffer, int width, int height, int linesize)
+{
+	__local uint tile[3 * SCAN_TILE];
+	__local uint carry[3];
+	int i = get_local_id(0);
+	int y = get_global_id(1);
+	if (y >= height) {
+		return;
+	}
+	__global uint *row = buffer + y * linesize;
+	if (i < 3) {
+		carry[i] = 0;
+	}
+
+	for (int tile_start = 0; tile_start < width; tile_start += SCAN_TILE) {
+		int x = tile_start + i;
+		uint3 value = x < width ? vload3(x, row) : (uint3)(0);
+		uint3 sum = scan_tile(tile, carry, value, i);
+		if (x < width) {
+			vstore3(sum, x, row);
+		}
+	}
+}
+
+// Like copy_image_kernel followed by scan_rows_tiled_kernel, but the source
+// pixels are widened as they are scanned so the row sums are written once.
+// Launched with a global size of (SCAN_TILE, source_height).
+__kernel void copy_scan_rows_kernel(__global uint *output_buffer,
+    int target_linesize,
+    __global uchar *source_buffer,
+    int source_width,
+    int source_height,
+    int source_linesize)
+{
+	__local uint tile[3 * SCAN_TILE];
+	__local uint carry[3];
+	int source_bytes_per_pixel = source_linesize / source_width;
+	int i = get_local_id(0);
+	int y = get_global_id(1);
+	if (y >= source_height) {
+		return;
+	}
+	__global uchar *source_row = source_buffer + y * source_linesize;
+	__global uint *target_row = output_buffer + y * target_linesize;
+	if (i < 3) {
+		carry[i] = 0;
+	}
+
+	for (int tile_start = 0; tile_start < source_width; tile_start += SCAN_TILE) {
+		int x = tile_start + i;
+		uint3 value = (uint3)(0);
+		if (x < source_width) {
+			__global uchar *pixel = source_row + x * source_bytes_per_pixel;
+			value = (uint3)(pixel[0], pixel[1], pixel[2]);
+		}
+		uint3 sum = scan_tile(tile, carry, value, i);
+		if (x < source_width) {
+			vstore3(sum, x, target_row);
+		}
+	}
+}
+
+// Inclusive scan of each column. Each work-item walks down one channel of
+// one column, so neighbouring work-items touch neighbouring words and every
+// row is read and written with coalesced accesses. Launched with a global
+// size of at least 3 * width.
+__kernel void scan_columns_coalesced_kernel(__global uint *buffer, int width, int height, int linesize)
+{
+	int x = get_global_id(0);
+	if (x >= 3 * width) {
+		return;
+	}
+	uint sum = 0;
+	for (int y = 0; y < height; y++) {
+		int position = y * linesize + x;
+		sum += buffer[position];
+		buffer[position] = sum;
+	}
+}
+
+// Writes the transpose of the width x height image of three channel pixels
+// in source to target. Tiles go through local memory so that both the reads
+// and the writes are coalesced. The extra column avoids bank conflicts.
+__kernel void transpose_kernel(__global uint *target, int target_linesize,
+    __global uint *source, int width, int height, int source_linesize)
+{
+	__local uint tile[3][TRANSPOSE_TILE][TRANSPOSE_TILE + 1];
+	int local_x = get_local_id(0);
+	int local_y = get_local_id(1);
+	int x = get_group_id(0) * TRANSPOSE_TILE + local_x;
+	int y = get_group_id(1) * TRANSPOSE_TILE + local_y;
+	if (x < width && y < height) {
+		uint3 value = vload3(x, source + y * source_linesize);
+		tile[0][local_y][local_x] = value.x;
+		tile[1][local_y][local_x] = value.y;
+		tile[2][local_y][local_x] = value.z;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Row target_y of the target is column target_y of the source.
+	int target_x = get_group_id(1) * TRANSPOSE_TILE + local_x;
+	int target_y = get_group_id(0) * TRANSPOSE_TILE + local_y;
+	if (target_x < height && target_y < width) {
+		uint3 value = (uint3)(tile[0][local_x][local_y], tile[1][local_x][local_y], tile[2][local_x][local_y]);
+		vstore3(value, target_x, target + target_y * target_linesize);
+	}
+}
+
+// Single channel version of scan_tile.
+uint scan_tile_plane(__local uint *tile, __local uint *carry, uint value, int i)
+{
+	barrier(CLK_LOCAL_MEM_FENCE);
+	tile[i] = value;
+
+	// Up-sweep, leaving the tile's sum in its last element.
+	for (int stride = 1; stride < SCAN_TILE; stride *= 2) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		int index = (i + 1) * 2 * stride - 1;
+		if (index < SCAN_TILE) {
+			tile[index] += tile[index - stride];
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	uint tile_sum = tile[SCAN_TILE - 1];
+	uint base = carry[0];
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (i == 0) {
+		tile[SCAN_TILE - 1] = 0;
+		carry[0] += tile_sum;
+	}
+
+	// Down-sweep to the exclusive scan.
+	for (int stride = SCAN_TILE / 2; stride > 0; stride /= 2) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		int index = (i + 1) * 2 * stride - 1;
+		if (index < SCAN_TILE) {
+			uint left = tile[index - stride];
+			tile[index - stride] = tile[index];
+			tile[index] += left;
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	return base + tile[i] + value;
+}
+
+// Scans the rows of each plane of a YUV420P frame into a single channel SAT
+// per plane, with a work-group per row. The source holds the luma plane and
+// then the U and V planes of half the width and height, rounded up, with
+// linesizes y_linesize and uv_linesize. The SATs follow each other in the
+// same order with the width of their plane as linesize.
+// Launched with a global size of (SCAN_TILE, height + 2 * ((height + 1) / 2)).
+__kernel void copy_scan_yuv420_rows_kernel(__global uint *output_buffer,
+    __global uchar *source_buffer, int width, int height, int y_linesize,
+    int uv_linesize)
+{
+	__local uint tile[SCAN_TILE];
+	__local uint carry[1];
+	int chroma_width = (width + 1) / 2;
+	int chroma_height = (height + 1) / 2;
+	int i = get_local_id(0);
+	int row = get_global_id(1);
+	int row_width = width;
+	__global uchar *source_row;
+	__global uint *target_row;
+	if (row < height) {
+		source_row = source_buffer + row * y_linesize;
+		target_row = output_buffer + row * width;
+	} else if (row < height + 2 * chroma_height) {
+		// The V rows directly follow the U rows in both buffers.
+		int chroma_row = row - height;
+		row_width = chroma_width;
+		source_row = source_buffer + height * y_linesize + chroma_row * uv_linesize;
+		target_row = output_buffer + width * height + chroma_row * chroma_width;
+	} else {
+		return;
+	}
+	if (i == 0) {
+		carry[0] = 0;
+	}
+
+	for (int tile_start = 0; tile_start < row_width; tile_start += SCAN_TILE) {
+		int x = tile_start + i;
+		uint value = x < row_width ? source_row[x] : 0;
+		uint sum = scan_tile_plane(tile, carry, value, i);
+		if (x < row_width) {
+			target_row[x] = sum;
+		}
+	}
+}
+
+// Scans the columns of the SATs of copy_scan_yuv420_rows_kernel in place,
+// one work-item per column. The luma columns come first, then the U and the
+// V columns.
+// Launched with a global size of at least width + 2 * ((width + 1) / 2).
+__kernel void scan_yuv420_columns_kernel(__global uint *buffer, int width,
+    int height)
+{
+	int chroma_width = (width + 1) / 2;
+	int chroma_height = (height + 1) / 2;
+	int x = get_global_id(0);
+	int plane_width = width;
+	int plane_height = height;
+	__global uint *column = buffer + x;
+	if (x >= width) {
+		x -= width;
+		if (x >= 2 * chroma_width) {
+			return;
+		}
+		plane_width = chroma_width;
+		plane_height = chroma_height;
+		column = buffer + width * height +
+			(x / chroma_width) * chroma_width * chroma_height + x % chroma_width;
+	}
+	uint sum = 0;
+	for (int y = 0; y < plane_height; y++) {
+		sum += column[y * plane_width];
+		column[y * plane_width] = sum;
+	}
+}
+
+// Source position of lattice column i and lattice row j for a gaze at
+// center, as in create_reduced_sat_kernel. Grid offsets from
+// create_grid_kernel are separable, so columns are read from the first grid
+// row and rows from the first grid column. Columns are not wrapped.
+int lattice_x(__global short *grid_buffer, int i, float center_x,
+    int source_width)
+{
+	return center_x * source_width + grid_buffer[2 * i];
+}
+
+int lattice_y(__global short *grid_buffer, int grid_width, int j,
+    float center_y, int source_height)
+{
+	return clamp((int)(center_y * source_height) + grid_buffer[2 * j * grid_width + 1],
+		-1, source_height - 1);
+}
+
+// Sums each source row over the columns of each lattice cell. Cell i of row y
+// covers the columns after lattice column i - 1 up to lattice column i,
+// wrapped around the frame, and cell 0 is empty. Cells are grid_width pixels
+// of three uint per source row.
+// Launched with a global size of at least (grid_width, source_height).
+__kernel void lattice_row_sums_kernel(__global uint *cells, int grid_width,
+    __global uchar *source_buffer, int source_width, int source_height,
+    int source_linesize, __global short *grid_buffer, float center_x)
+{
+	int i = get_global_id(0);
+	int y = get_global_id(1);
+	if (i >= grid_width || y >= source_height) {
+		return;
+	}
+	int source_bytes_per_pixel = source_linesize / source_width;
+	__global uchar *row = source_buffer + y * source_linesize;
+
+	uint3 sum = (uint3)(0);
+	if (i > 0) {
+		int x = lattice_x(grid_buffer, i - 1, center_x, source_width) + 1;
+		int x_end = lattice_x(grid_buffer, i, center_x, source_width);
+		int wrapped = x % source_width;
+		if (wrapped < 0) {
+			wrapped += source_width;
+		}
+		for (; x <= x_end; x++) {
+			__global uchar *pixel = row + wrapped * source_bytes_per_pixel;
+			sum += (uint3)(pixel[0], pixel[1], pixel[2]);
+			if (++wrapped == source_width) {
+				wrapped = 0;
+			}
+		}
+	}
+	vstore3(sum, y * grid_width + i, cells);
+}
+
+// Adds up the cells of each lattice column between lattice row j - 1 and
+// lattice row j, writing the sum at grid point (i, j) along with its source
+// position. Each grid point takes 5 uint: three channel sums, then x and y as
+// int. Row 0 takes the cells from the top of the frame. Lattice rows above
+// the frame and rows below it cover no cells.
+// Launched with a global size of at least (grid_width, grid_height).
+__kernel void lattice_column_sums_kernel(__global uint *lattice,
+    int grid_width, int grid_height, __global uint *cells, int source_width,
+    int source_height, __global short *grid_buffer, float center_x,
+    float center_y)
+{
+	int i = get_global_id(0);
+	int j = get_global_id(1);
+	if (i >= grid_width || j >= grid_height) {
+		return;
+	}
+	int x_pos = lattice_x(grid_buffer, i, center_x, source_width);
+	int y_pos = lattice_y(grid_buffer, grid_width, j, center_y, source_height);
+	// Lattice rows only move down the frame.
+	int y = j == 0 ? 0 : lattice_y(grid_buffer, grid_width, j - 1, center_y,
+		source_height) + 1;
+
+	uint3 sum = (uint3)(0);
+	for (; y <= y_pos; y++) {
+		sum += vload3(y * grid_width + i, cells);
+	}
+	__global uint *point = lattice + 5 * (j * grid_width + i);
+	vstore3(sum, 0, point);
+	point[3] = as_uint(x_pos);
+	point[4] = as_uint(y_pos);
+}
+
+// Adds up the interval sums down each lattice column, so that each grid
+// point holds the sum of its column from the top of the frame.
+// Launched with a global size of at least grid_width.
+__kernel void lattice_column_prefix_kernel(__global uint *lattice,
+    int grid_width, int grid_height)
+{
+	int i = get_global_id(0);
+	if (i >= grid_width) {
+		return;
+	}
+	__global uint *point = lattice + 5 * i;
+	uint3 sum = (uint3)(0);
+	for (int j = 0; j < grid_height; j++, point += 5 * grid_width) {
+		sum += vload3(0, point);
+		vstore3(sum, 0, point);
+	}
+}
+
+// Adds up the column sums along each lattice row, which turns them into the
+// lattice SAT. Launched with a global size of at least grid_height.
+__kernel void lattice_row_prefix_kernel(__global uint *lattice,
+    int grid_width, int grid_height)
+{
+	int j = get_global_id(0);
+	if (j >= grid_height) {
+		return;
+	}
+	__global uint *point = lattice + 5 * j * grid_width;
+	uint3 sum = (uint3)(0);
+	for (int i = 0; i < grid_width; i++, point += 5) {
+		sum += vload3(0, point);
+		vstore3(sum, 0, point);
+	}
+}
@@ -0,0 +1,118 @@
+#include "sat_factorizer.h"
+
+SATFactorizer::SATFactorizer(int width, int height, int rank,
+                             bool with_residual) {
+  this->width = width;
+  this->height = height;
+  this->rank = std::min(rank, std::min(width, height));
+  this->with_residual = with_residual;
+  sample_count = std::min(this->rank + OVERSAMPLING, std::min(width, height));
+  sat.resize(height, width);
+  std::mt19937 random_engine(5489u);
+  std::normal_distribution<double> distribution(0.0, 1.0);
+  omega.resize(width, sample_count);
+  for (int i = 0; i < omega.size(); i++) {
+    omega.data()[i] = distribution(random_engine);
+  }
+}
+
+/** Replaces the columns of m with an orthonormal basis of their span. */
+void SATFactorizer::Orthonormalize(Matrix *m) {
+  Eigen::HouseholderQR<Matrix> qr(*m);
+  *m = qr.householderQ() * Matrix::Identity(m->rows(), m->cols());
+}
+
+/**
+ * Factorizes the SAT of an 8-bit RGB frame with bytes_per_pixel bytes per
+ * pixel.
+ */
+void SATFactorizer::Factorize(const uint8_t *frame, int linesize,
+                              int bytes_per_pixel, SATFactors *factors) {
+  factors->width = width;
+  factors->height = height;
+  factors->rank = rank;
+  factors->sv.assign(3 * rank, 0.0f);
+  factors->u.assign((size_t)3 * height * rank, 0.0f);
+  factors->v.assign((size_t)3 * rank * width, 0.0f);
+  if (with_residual) {
+    factors->residual.assign((size_t)3 * width * height, 0);
+  } else {
+    factors->residual.clear();
+  }
+
+  for (int color = 0; color < 3; color++) {
+    double channel_sum = 0.0;
+    for (int y = 0; y < height; y++) {
+      const uint8_t *row = frame + (size_t)y * linesize + color;
+      for (int x = 0; x < width; x++) {
+        channel_sum += row[x * bytes_per_pixel];
+      }
+    }
+    double mean = channel_sum / ((double)width * height);
+
+    // Integrate rows, then columns.
+    for (int y = 0; y < height; y++) {
+      const uint8_t *row = frame + (size_t)y * linesize + color;
+      double row_sum = 0.0;
+      for (int x = 0; x < width; x++) {
+        row_sum += row[x * bytes_per_pixel] - mean;
+        sat(y, x) = row_sum + (y > 0 ? sat(y - 1, x) : 0.0);
+      }
+    }
+
+    // Range finder: range_basis spans the dominant columns of the SAT.
+    range_basis.noalias() = sat * omega;
+    for (int i = 0; i < POWER_ITERATIONS; i++) {
+      Orthonormalize(&range_basis);
+      Matrix row_basis = sat.transpose() * range_basis;
+      Orthonormalize(&row_basis);
+      range_basis.noalias() = sat * row_basis;
+    }
+    Orthonormalize(&range_basis);
+
+    // The small projected matrix has the same leading singular values.
+    Matrix projected = range_basis.transpose() * sat;
+    Eigen::JacobiSVD<Matrix> svd(projected,
+                                 Eigen::ComputeThinU | Eigen::ComputeThinV);
+    Matrix u = range_basis * svd.matrixU().leftCols(rank);
+    Matrix v = svd.matrixV().leftCols(rank);
+    Eigen::VectorXd singular_values = svd.singularValues().head(rank);
+
+    factors->channel_mean[color] = mean;
+    for (int i = 0; i < rank; i++) {
+      factors->sv[color * rank + i] = singular_values(i);
+    }
+    for (int y = 0; y < height; y++) {
+      for (int i = 0; i < rank; i++) {
+        factors->u[((size_t)color * height + y) * rank + i] = u(y, i);
+      }
+    }
+    for (int i = 0; i < rank; i++) {
+      for (int x = 0; x < width; x++) {
+        factors->v[((size_t)color * rank + i) * width + x] = v(x, i);
+      }
+    }
+
+    if (!with_residual) {
+      factors->delta_range[color] = 0.0f;
+      continue;
+    }
+    // The residual is taken against the float factors the sampler uses.
+    Eigen::MatrixXf u_float = u.cast<float>();
+    Eigen::MatrixXf v_float = v.cast<float>();
+    Eigen::VectorXf sv_float = singular_values.cast<float>();
+    sat -= (u_float * sv_float.asDiagonal() * v_float.transpose())
+               .cast<double>();
+    double max_residual = std::max(sat.cwiseAbs().maxCoeff(), 1e-3);
+    float delta_range = 2.0 * max_residual;
+    factors->delta_range[color] = delta_range;
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        double quantized =
+            std::round((sat(y, x) + delta_range / 2.0) * (255.0 / delta_range));
+        factors->residual[((size_t)y * width + x) * 3 + color] =
+            (uint8_t)std::min(std::max(quantized, 0.0), 255.0);
+      }
+    }
+  }
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <Eigen/QR>
+#include <Eigen/SVD>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+/**
+ * Rank k approximation of the summed area table of one frame.
+ * Each channel's SAT is taken of the frame minus the channel mean, which
+ * keeps its values near zero for most frames. Samplers add the mean back.
+ * The values are still only held to float precision: each corner read is
+ * off by up to half an ulp, 2^-24 of its magnitude, so a rectangle's sum is
+ * off by up to 2^-22 of the corners' magnitude. At SAT values around 1e8
+ * that is +-16, which for the 1x1 rectangles of the fovea is the error of
+ * the pixel itself.
+ * The SAT of channel c is approximately
+ * u[c] * diag(sv[c]) * v[c] + residual[c], where
+ *   sv holds 3 * rank singular values, sv[c * rank + i],
+ *   u holds 3 * height * rank values, u[(c * height + y) * rank + i],
+ *   v holds 3 * rank * width values, v[(c * rank + i) * width + x].
+ * The residual is optional. It is quantized to 8 bits per channel over
+ * [-delta_range[c] / 2, delta_range[c] / 2] and stored as interleaved RGB.
+ */
+struct SATFactors {
+  int width = 0;
+  int height = 0;
+  int rank = 0;
+  float channel_mean[3] = {0, 0, 0};
+  float delta_range[3] = {0, 0, 0};
+  std::vector<float> sv;
+  std::vector<float> u;
+  std::vector<float> v;
+  std::vector<uint8_t> residual;
+};
+
+/**
+ * Computes SATFactors with a randomized truncated SVD (Halko et al.), which
+ * only needs a few products with the SAT instead of a full decomposition.
+ * The random test matrix is drawn once from a fixed seed, so the output
+ * does not depend on which factorizer handles a frame. A factorizer keeps its
+ * scratch matrices between frames. Use one per thread.
+ */
+class SATFactorizer {
+ public:
+  // Extra columns sampled beyond the rank, and power iterations, trading
+  // time for accuracy of the leading singular vectors.
+  static const int OVERSAMPLING = 10;
+  static const int POWER_ITERATIONS = 2;
+
+  SATFactorizer(int width, int height, int rank, bool with_residual);
+  void Factorize(const uint8_t *frame, int linesize, int bytes_per_pixel,
+                 SATFactors *factors);
+
+ private:
+  typedef Eigen::MatrixXd Matrix;
+  int width;
+  int height;
+  int rank;
+  int sample_count;
+  bool with_residual;
+  Matrix sat;
+  Matrix omega;
+  Matrix range_basis;
+
+  void Orthonormalize(Matrix *m);
+};
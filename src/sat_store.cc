@@ -0,0 +1,262 @@
+#include "sat_store.h"
+
+SATStoreWriter::SATStoreWriter() {}
+
+SATStoreWriter::~SATStoreWriter() {
+  if (file != NULL) {
+    Close();
+  }
+}
+
+bool SATStoreWriter::Open(const std::string &path, int width, int height,
+                          SATStoreHeader::Encoding encoding,
+                          int frame_rate_num, int frame_rate_den) {
+  this->path = path;
+  file = fopen(path.c_str(), "wb");
+  if (file == NULL) {
+    std::cerr << "[SATStoreWriter::Open] Failed to open " << path
+              << std::endl;
+    return false;
+  }
+  header = SATStoreHeader();
+  header.encoding = encoding;
+  header.width = width;
+  header.height = height;
+  header.frame_rate_num = frame_rate_num;
+  header.frame_rate_den = frame_rate_den;
+  index.clear();
+  offset = 0;
+  // The header is written again with the index offset on Close.
+  return Write(&header, sizeof(header));
+}
+
+bool SATStoreWriter::AddFrame(const uint32_t *sat, int64_t pts,
+                              int64_t pkt_dts) {
+  if (file == NULL) {
+    return false;
+  }
+  const size_t row_elements = 3 * (size_t)header.width;
+  const size_t frame_size =
+      row_elements * header.height * sizeof(uint32_t);
+  if (header.encoding == SATStoreHeader::RAW) {
+    if (!PadTo(SATStoreHeader::RAW_ALIGNMENT)) {
+      return false;
+    }
+    index.push_back({offset, frame_size, pts, pkt_dts});
+    return Write(sat, frame_size);
+  }
+
+  index.push_back({offset, 0, pts, pkt_dts});
+  for (uint32_t chunk_start = 0; chunk_start < header.height;
+       chunk_start += header.chunk_rows) {
+    uint32_t chunk_end = std::min(chunk_start + header.chunk_rows,
+                                  header.height);
+    const uint32_t *chunk = sat + chunk_start * row_elements;
+    size_t chunk_elements = (chunk_end - chunk_start) * row_elements;
+    // The first row of each chunk is kept so chunks decode on their own.
+    // Sums wrap around, and so do the deltas.
+    delta_rows.resize(chunk_elements);
+    std::memcpy(delta_rows.data(), chunk, row_elements * sizeof(uint32_t));
+    for (size_t i = row_elements; i < chunk_elements; i++) {
+      delta_rows[i] = chunk[i] - chunk[i - row_elements];
+    }
+    uLongf compressed_size = compressBound(chunk_elements * sizeof(uint32_t));
+    compressed.resize(compressed_size);
+    int ret = compress2(compressed.data(), &compressed_size,
+                        reinterpret_cast<const Bytef *>(delta_rows.data()),
+                        chunk_elements * sizeof(uint32_t), Z_BEST_COMPRESSION);
+    if (ret != Z_OK) {
+      std::cerr << "[SATStoreWriter::AddFrame] compress2 failed: " << ret
+                << std::endl;
+      return false;
+    }
+    uint32_t chunk_size = compressed_size;
+    if (!Write(&chunk_size, sizeof(chunk_size)) ||
+        !Write(compressed.data(), compressed_size)) {
+      return false;
+    }
+  }
+  index.back().size = offset - index.back().offset;
+  return true;
+}
+
+bool SATStoreWriter::Close() {
+  if (file == NULL) {
+    return false;
+  }
+  bool ok = PadTo(sizeof(uint64_t));
+  header.frame_count = index.size();
+  header.index_offset = offset;
+  ok = ok && Write(index.data(), index.size() * sizeof(SATStoreIndexEntry));
+  ok = ok && fseek(file, 0, SEEK_SET) == 0 &&
+       fwrite(&header, sizeof(header), 1, file) == 1;
+  ok = fclose(file) == 0 && ok;
+  file = NULL;
+  if (!ok) {
+    std::cerr << "[SATStoreWriter::Close] Failed to write " << path
+              << std::endl;
+  }
+  return ok;
+}
+
+bool SATStoreWriter::Write(const void *data, size_t size) {
+  if (size > 0 && fwrite(data, size, 1, file) != 1) {
+    std::cerr << "[SATStoreWriter::Write] Failed to write " << path
+              << std::endl;
+    return false;
+  }
+  offset += size;
+  return true;
+}
+
+bool SATStoreWriter::PadTo(size_t alignment) {
+  static const uint8_t zeros[SATStoreHeader::RAW_ALIGNMENT] = {0};
+  size_t padding = (alignment - offset % alignment) % alignment;
+  return Write(zeros, padding);
+}
+
+SATStore::SATStore() {}
+
+SATStore::~SATStore() { Close(); }
+
+/**
+ * Maps the store at path. Returns false if it is missing or malformed.
+ */
+bool SATStore::Open(const std::string &path) {
+  Close();
+  fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 ||
+      (size_t)file_stat.st_size < sizeof(SATStoreHeader)) {
+    Close();
+    return false;
+  }
+  mapping_size = file_stat.st_size;
+  void *address = mmap(NULL, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (address == MAP_FAILED) {
+    std::cerr << "[SATStore::Open] Failed to map " << path << std::endl;
+    Close();
+    return false;
+  }
+  mapping = reinterpret_cast<uint8_t *>(address);
+  std::memcpy(&header, mapping, sizeof(header));
+  uint64_t index_size =
+      (uint64_t)header.frame_count * sizeof(SATStoreIndexEntry);
+  if (header.magic != SATStoreHeader::MAGIC ||
+      header.version != SATStoreHeader::VERSION ||
+      (header.encoding != SATStoreHeader::RAW &&
+       header.encoding != SATStoreHeader::ROW_DELTA_ZLIB) ||
+      header.index_offset > mapping_size ||
+      index_size > mapping_size - header.index_offset ||
+      header.chunk_rows == 0) {
+    std::cerr << "[SATStore::Open] Invalid SAT store " << path << std::endl;
+    Close();
+    return false;
+  }
+  index = reinterpret_cast<const SATStoreIndexEntry *>(mapping +
+                                                       header.index_offset);
+  // Raw frames are used in place, so each must hold exactly one frame.
+  bool raw = header.encoding == SATStoreHeader::RAW;
+  for (uint32_t i = 0; i < header.frame_count; i++) {
+    if (index[i].offset > header.index_offset ||
+        index[i].size > header.index_offset - index[i].offset ||
+        (raw && (index[i].size != GetFrameSize() ||
+                 index[i].offset % SATStoreHeader::RAW_ALIGNMENT != 0))) {
+      std::cerr << "[SATStore::Open] Invalid frame index in " << path
+                << std::endl;
+      Close();
+      return false;
+    }
+  }
+  // Frames are read in order.
+  madvise(mapping, mapping_size, MADV_SEQUENTIAL);
+  return true;
+}
+
+void SATStore::Close() {
+  if (mapping != NULL) {
+    munmap(mapping, mapping_size);
+    mapping = NULL;
+  }
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+  index = NULL;
+}
+
+double SATStore::GetFrameRate() {
+  if (header.frame_rate_num <= 0 || header.frame_rate_den <= 0) {
+    return 0.0;
+  }
+  return header.frame_rate_num / (double)header.frame_rate_den;
+}
+
+/**
+ * Returns the frame inside the mapping, or NULL if the store is compressed.
+ */
+const uint32_t *SATStore::GetRawFrame(int frame) {
+  if (header.encoding != SATStoreHeader::RAW || frame < 0 ||
+      frame >= (int)header.frame_count) {
+    return NULL;
+  }
+  return reinterpret_cast<const uint32_t *>(mapping + index[frame].offset);
+}
+
+/**
+ * Copies or decodes the frame into target, which holds GetFrameSize() bytes.
+ */
+bool SATStore::ReadFrame(int frame, uint32_t *target) {
+  if (frame < 0 || frame >= (int)header.frame_count) {
+    return false;
+  }
+  const uint8_t *data = mapping + index[frame].offset;
+  const uint8_t *data_end = data + index[frame].size;
+  if (header.encoding == SATStoreHeader::RAW) {
+    std::memcpy(target, data, GetFrameSize());
+    return true;
+  }
+  const size_t row_elements = 3 * (size_t)header.width;
+  for (uint32_t chunk_start = 0; chunk_start < header.height;
+       chunk_start += header.chunk_rows) {
+    uint32_t chunk_end = std::min(chunk_start + header.chunk_rows,
+                                  header.height);
+    uint32_t *chunk = target + chunk_start * row_elements;
+    size_t chunk_elements = (chunk_end - chunk_start) * row_elements;
+    uint32_t chunk_size = 0;
+    if (data + sizeof(chunk_size) > data_end) {
+      return false;
+    }
+    std::memcpy(&chunk_size, data, sizeof(chunk_size));
+    data += sizeof(chunk_size);
+    uLongf decompressed_size = chunk_elements * sizeof(uint32_t);
+    if (data + chunk_size > data_end ||
+        uncompress(reinterpret_cast<Bytef *>(chunk), &decompressed_size, data,
+                   chunk_size) != Z_OK ||
+        decompressed_size != chunk_elements * sizeof(uint32_t)) {
+      std::cerr << "[SATStore::ReadFrame] Corrupt frame " << frame
+                << std::endl;
+      return false;
+    }
+    data += chunk_size;
+    for (size_t i = row_elements; i < chunk_elements; i++) {
+      chunk[i] += chunk[i - row_elements];
+    }
+  }
+  return true;
+}
+
+/** Stores sit next to their video, with the extension replaced. */
+std::string SATStore::GetStorePath(const std::string &video_filename,
+                                   const std::string &extension) {
+  size_t extension_start = video_filename.find_last_of('.');
+  size_t directory = video_filename.find_last_of('/');
+  if (extension_start == std::string::npos ||
+      (directory != std::string::npos && extension_start < directory)) {
+    return video_filename + extension;
+  }
+  return video_filename.substr(0, extension_start) + extension;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/**
+ * File of precomputed summed area tables, one per video frame, in the
+ * layout SATEncoder writes: width * height pixels of 3 interleaved uint32
+ * channel sums.
+ *
+ * The file starts with a fixed header, followed by the frames and then a
+ * frame index with the offset, size, pts and pkt_dts of each frame.
+ * Frames are stored either raw, page aligned so they can be uploaded straight
+ * from the mapping, or row-delta coded and deflated. Row deltas of a SAT are
+ * the running sums along each row, which need far fewer bits than the SAT.
+ * Compressed frames are split into chunks of CHUNK_ROWS rows that decode
+ * independently, each prefixed with its compressed size.
+ * All values are little endian.
+ */
+struct SATStoreHeader {
+  static const uint64_t MAGIC = 0x3152545354415346;  // "FSATSTR1"
+  static const uint32_t VERSION = 1;
+  enum Encoding : uint32_t { RAW = 0, ROW_DELTA_ZLIB = 1 };
+  static const uint32_t CHUNK_ROWS = 64;
+  static const size_t RAW_ALIGNMENT = 4096;
+
+  uint64_t magic = MAGIC;
+  uint32_t version = VERSION;
+  uint32_t encoding = RAW;
+  uint32_t width = 0;
+  uint32_t height = 0;
+  uint32_t frame_count = 0;
+  uint32_t chunk_rows = CHUNK_ROWS;
+  int32_t frame_rate_num = 0;
+  int32_t frame_rate_den = 1;
+  uint64_t index_offset = 0;
+  uint64_t reserved[2] = {0, 0};
+};
+
+struct SATStoreIndexEntry {
+  uint64_t offset;
+  uint64_t size;
+  int64_t pts;
+  int64_t pkt_dts;
+};
+
+/** Writes a SAT store one frame at a time. */
+class SATStoreWriter {
+ public:
+  SATStoreWriter();
+  ~SATStoreWriter();
+  bool Open(const std::string &path, int width, int height,
+            SATStoreHeader::Encoding encoding, int frame_rate_num,
+            int frame_rate_den);
+  bool AddFrame(const uint32_t *sat, int64_t pts, int64_t pkt_dts);
+  bool Close();
+
+ private:
+  FILE *file = NULL;
+  std::string path;
+  SATStoreHeader header;
+  std::vector<SATStoreIndexEntry> index;
+  uint64_t offset = 0;
+  std::vector<uint32_t> delta_rows;
+  std::vector<uint8_t> compressed;
+
+  bool Write(const void *data, size_t size);
+  bool PadTo(size_t alignment);
+};
+
+/**
+ * Reads a SAT store through a read-only memory mapping. Raw frames are
+ * returned as pointers into the mapping. Compressed frames are decoded into a
+ * caller buffer. Any number of threads may read at once.
+ */
+class SATStore {
+ public:
+  SATStore();
+  ~SATStore();
+  bool Open(const std::string &path);
+  bool IsOpen() { return mapping != NULL; }
+  int GetWidth() { return header.width; }
+  int GetHeight() { return header.height; }
+  int GetFrameCount() { return header.frame_count; }
+  double GetFrameRate();
+  SATStoreHeader::Encoding GetEncoding() {
+    return (SATStoreHeader::Encoding)header.encoding;
+  }
+  size_t GetFrameSize() {
+    return (size_t)3 * header.width * header.height * sizeof(uint32_t);
+  }
+  const SATStoreIndexEntry &GetIndexEntry(int frame) { return index[frame]; }
+  const uint32_t *GetRawFrame(int frame);
+  bool ReadFrame(int frame, uint32_t *target);
+  static std::string GetStorePath(const std::string &video_filename,
+                                  const std::string &extension = ".satstore");
+
+ private:
+  int fd = -1;
+  uint8_t *mapping = NULL;
+  size_t mapping_size = 0;
+  SATStoreHeader header;
+  const SATStoreIndexEntry *index = NULL;
+
+  void Close();
+};
@@ -0,0 +1,90 @@
+#include "server_metrics.h"
+
+void ServerMetrics::StageHistograms::Record(Stage stage, int64_t value_us) {
+  histograms[stage].Record(value_us);
+  if (parent != NULL) {
+    parent->Record(stage, value_us);
+  }
+}
+
+void ServerMetrics::StageHistograms::RecordSince(Stage stage,
+                                                 clock::time_point start) {
+  using namespace std::chrono;
+  Record(stage, duration_cast<microseconds>(clock::now() - start).count());
+}
+
+std::shared_ptr<ServerMetrics::StageHistograms> ServerMetrics::AddSession(
+    int session_id) {
+  std::shared_ptr<StageHistograms> histograms =
+      std::make_shared<StageHistograms>(&global);
+  std::lock_guard<std::mutex> lock(mutex);
+  sessions[session_id] = histograms;
+  return histograms;
+}
+
+void ServerMetrics::RemoveSession(int session_id) {
+  std::lock_guard<std::mutex> lock(mutex);
+  sessions.erase(session_id);
+}
+
+const char *ServerMetrics::GetStageName(Stage stage) {
+  switch (stage) {
+    case DECODE:
+      return "decode";
+    case UPLOAD:
+      return "upload";
+    case SAT:
+      return "sat";
+    case SAMPLE:
+      return "sample";
+    case READBACK:
+      return "readback";
+    case ENCODE:
+      return "encode";
+    case MUX:
+      return "mux";
+    case SEND:
+      return "send";
+    case FRAME:
+      return "frame";
+    default:
+      return "unknown";
+  }
+}
+
+std::string ServerMetrics::ToPrometheusText() {
+  std::ostringstream out;
+  out << "# HELP foveated_stage_latency_seconds Latency of each frame "
+         "pipeline stage.\n";
+  out << "# TYPE foveated_stage_latency_seconds summary\n";
+  WriteSummary(out, global, "session=\"all\"");
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto &session : sessions) {
+    WriteSummary(out, *session.second,
+                 "session=\"" + std::to_string(session.first) + "\"");
+  }
+  return out.str();
+}
+
+void ServerMetrics::WriteSummary(std::ostringstream &out,
+                                 const StageHistograms &histograms,
+                                 const std::string &labels) {
+  const char *name = "foveated_stage_latency_seconds";
+  const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+  for (int i = 0; i < STAGE_COUNT; i++) {
+    const LatencyHistogram &histogram = histograms.Get((Stage)i);
+    if (histogram.Count() == 0) {
+      continue;
+    }
+    std::string stage_labels =
+        labels + ",stage=\"" + GetStageName((Stage)i) + "\"";
+    for (double quantile : quantiles) {
+      out << name << "{" << stage_labels << ",quantile=\"" << quantile
+          << "\"} " << histogram.Percentile(100.0 * quantile) * 1e-6 << "\n";
+    }
+    out << name << "_sum{" << stage_labels << "} " << histogram.Sum() * 1e-6
+        << "\n";
+    out << name << "_count{" << stage_labels << "} " << histogram.Count()
+        << "\n";
+  }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+#include "latency_histogram.h"
+
+/**
+ * Latency histograms for every stage of the server's frame pipeline, both
+ * per session and for the whole server. Stages shared by all sessions on a
+ * video, such as decoding and building the SAT, are only recorded globally.
+ * The histograms are exported in the Prometheus text format as summaries.
+ */
+class ServerMetrics {
+ public:
+  typedef std::chrono::steady_clock clock;
+
+  enum Stage {
+    DECODE,
+    UPLOAD,
+    SAT,
+    SAMPLE,
+    READBACK,
+    ENCODE,
+    MUX,
+    SEND,
+    // From the frame's release by the scheduler until it is sent.
+    FRAME,
+    STAGE_COUNT
+  };
+
+  /** One histogram per stage. Records also go to the parent, if any. */
+  class StageHistograms {
+   public:
+    StageHistograms(StageHistograms *parent = NULL) : parent(parent) {}
+    void Record(Stage stage, int64_t value_us);
+    void RecordSince(Stage stage, clock::time_point start);
+    const LatencyHistogram &Get(Stage stage) const {
+      return histograms[stage];
+    }
+
+   private:
+    StageHistograms *parent;
+    LatencyHistogram histograms[STAGE_COUNT];
+  };
+
+  StageHistograms *GetGlobal() { return &global; }
+  std::shared_ptr<StageHistograms> AddSession(int session_id);
+  void RemoveSession(int session_id);
+  std::string ToPrometheusText();
+  static const char *GetStageName(Stage stage);
+
+ private:
+  StageHistograms global;
+  std::map<int, std::shared_ptr<StageHistograms>> sessions;
+  std::mutex mutex;
+
+  static void WriteSummary(std::ostringstream &out,
+                           const StageHistograms &histograms,
+                           const std::string &labels);
+};
@@ -0,0 +1,67 @@
+#include "session_executor.h"
+
+SessionExecutor::SessionExecutor(int thread_count) {
+  if (thread_count <= 0) {
+    thread_count = std::max(2u, std::thread::hardware_concurrency());
+  }
+  for (int i = 0; i < thread_count; i++) {
+    threads.push_back(std::thread(&SessionExecutor::WorkerLoop, this));
+  }
+}
+
+SessionExecutor::~SessionExecutor() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    exit_threads = true;
+  }
+  wake_cv.notify_all();
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+}
+
+void SessionExecutor::Post(clock::time_point deadline,
+                           std::function<void()> step) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    ready_steps.push(
+        Step{clock::now(), deadline, next_sequence++, std::move(step)});
+  }
+  wake_cv.notify_one();
+}
+
+void SessionExecutor::PostAfter(clock::duration delay,
+                                clock::time_point deadline,
+                                std::function<void()> step) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    delayed_steps.push(
+        Step{clock::now() + delay, deadline, next_sequence++, std::move(step)});
+  }
+  // A sleeping worker may need to wake earlier than it planned to.
+  wake_cv.notify_all();
+}
+
+void SessionExecutor::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!exit_threads) {
+    clock::time_point now = clock::now();
+    while (!delayed_steps.empty() && delayed_steps.top().ready_time <= now) {
+      ready_steps.push(delayed_steps.top());
+      delayed_steps.pop();
+    }
+    if (ready_steps.empty()) {
+      if (delayed_steps.empty()) {
+        wake_cv.wait(lock);
+      } else {
+        wake_cv.wait_until(lock, delayed_steps.top().ready_time);
+      }
+      continue;
+    }
+    Step step = ready_steps.top();
+    ready_steps.pop();
+    lock.unlock();
+    step.run();
+    lock.lock();
+  }
+}
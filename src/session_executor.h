@@ -0,0 +1,65 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+/**
+ * Runs session steps on a fixed pool of worker threads.
+ * Steps are short and never block on the GPU or the encoder. A step that has
+ * to wait posts itself again with a delay. Ready steps run earliest deadline
+ * first, so whichever worker is free picks up the most urgent session.
+ */
+class SessionExecutor {
+ public:
+  typedef std::chrono::steady_clock clock;
+
+  SessionExecutor(int thread_count);
+  ~SessionExecutor();
+  void Post(clock::time_point deadline, std::function<void()> step);
+  void PostAfter(clock::duration delay, clock::time_point deadline,
+                 std::function<void()> step);
+  int GetThreadCount() { return threads.size(); }
+
+ private:
+  struct Step {
+    clock::time_point ready_time;
+    clock::time_point deadline;
+    uint64_t sequence;
+    std::function<void()> run;
+  };
+  struct LaterDeadline {
+    bool operator()(const Step &a, const Step &b) const {
+      if (a.deadline != b.deadline) {
+        return a.deadline > b.deadline;
+      }
+      return a.sequence > b.sequence;
+    }
+  };
+  struct LaterReadyTime {
+    bool operator()(const Step &a, const Step &b) const {
+      if (a.ready_time != b.ready_time) {
+        return a.ready_time > b.ready_time;
+      }
+      return a.sequence > b.sequence;
+    }
+  };
+
+  std::priority_queue<Step, std::vector<Step>, LaterDeadline> ready_steps;
+  std::priority_queue<Step, std::vector<Step>, LaterReadyTime> delayed_steps;
+  uint64_t next_sequence = 0;
+  std::mutex mutex;
+  std::condition_variable wake_cv;
+  bool exit_threads = false;
+  std::vector<std::thread> threads;
+
+  void WorkerLoop();
+};
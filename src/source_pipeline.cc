@@ -0,0 +1,518 @@
+#include "source_pipeline.h"
+
+SourcePipeline::SourcePipeline(std::string video_filename,
+                               ServerMetrics::StageHistograms *histograms,
+                               double start_time,
+                               VideoDecoder *decoder) {
+  this->video_filename = video_filename;
+  this->histograms = histograms;
+  this->start_time = start_time;
+  cl_manager = new OpenCLManager();
+  if (histograms != NULL) {
+    cl_manager->queue_properties = CL_QUEUE_PROFILING_ENABLE;
+  }
+  cl_manager->InitializeContext(OpenCLManager::GetSharedManager());
+  video_decoder = decoder;
+  if (video_decoder == NULL) {
+    video_decoder = new VideoDecoder();
+    video_decoder->OpenVideo(video_filename.c_str());
+  }
+  if (!IsOpen()) {
+    std::cerr << "[SourcePipeline::SourcePipeline] Failed to open "
+              << video_filename << std::endl;
+    return;
+  }
+  width = video_decoder->source_codec_ctx->width;
+  height = video_decoder->source_codec_ctx->height;
+  AVRational source_frame_rate = video_decoder->source_codec_ctx->framerate;
+  if (source_frame_rate.num > 0 && source_frame_rate.den > 0) {
+    frame_rate = av_q2d(source_frame_rate);
+  }
+  cl_sat_buffer_size = (size_t)3 * width * height * sizeof(uint32_t);
+
+  // The video is still opened above for its codec parameters, but frames
+  // come from the store if there is one.
+  std::string store_path = SATStore::GetStorePath(video_filename);
+  sat_store = new SATStore();
+  if (sat_store->Open(store_path) && sat_store->GetWidth() == width &&
+      sat_store->GetHeight() == height && sat_store->GetFrameCount() > 0) {
+    std::cout << "[SourcePipeline::SourcePipeline] Serving SATs from "
+              << store_path << std::endl;
+    if (sat_store->GetFrameRate() > 0) {
+      frame_rate = sat_store->GetFrameRate();
+    }
+    sat_thread = std::thread(&SourcePipeline::StoreLoop, this);
+    return;
+  }
+  if (sat_store->IsOpen()) {
+    std::cerr << "[SourcePipeline::SourcePipeline] Ignoring " << store_path
+              << ", it does not match the video" << std::endl;
+  }
+  delete sat_store;
+  sat_store = NULL;
+  if (OpenSVDStore()) {
+    sat_thread = std::thread(&SourcePipeline::SVDStoreLoop, this);
+    return;
+  }
+
+  lattice = LATTICE_SAT;
+  yuv420 = !lattice && YUV420_SAT;
+  for (int i = 0; i < RGB_FRAME_COUNT; i++) {
+    rgb_frames.push_back(av_frame_alloc());
+    free_rgb_frames.Push(rgb_frames.back());
+  }
+  if (yuv420) {
+    cl_source_frame_size =
+        av_image_get_buffer_size(AV_PIX_FMT_YUV420P, width, height, 1);
+    cl_sat_buffer_size = SATEncoder::GetYUV420SATSize(width, height);
+  } else {
+    cl_source_frame_size = 4 * width * height * sizeof(uint8_t);
+  }
+  if (!lattice) {
+    sat_encoder = new SATEncoder(cl_manager);
+    cl_source_frame = cl::Buffer(cl_manager->context, CL_MEM_READ_WRITE,
+                                 cl_source_frame_size);
+  }
+  if (video_decoder->OpenIndex()) {
+    video_decoder->loop = true;
+    int start_frame = GetStartFrame(video_decoder->GetFrameCount());
+    if (start_frame != video_decoder->GetNextFrame()) {
+      video_decoder->Seek(start_frame);
+    }
+  } else {
+    std::cerr << "[SourcePipeline::SourcePipeline] Failed to index "
+              << video_filename << ", playing it once" << std::endl;
+  }
+
+  decode_thread = std::thread(&SourcePipeline::DecodeLoop, this);
+  sat_thread = std::thread(&SourcePipeline::SATLoop, this);
+}
+
+SourcePipeline::~SourcePipeline() {
+  Stop();
+  latest_frame.reset();
+  sat_frame_pool.clear();
+  cl_source_frame = cl::Buffer();
+  delete sat_encoder;
+  delete sat_store;
+  delete svd_store;
+  delete video_decoder;
+  delete cl_manager;
+  for (AVFrame *rgb_frame : rgb_frames) {
+    av_frame_free(&rgb_frame);
+  }
+}
+
+/**
+ * Stops decoding and publishing. The decoder is no longer used once this
+ * returns.
+ */
+void SourcePipeline::Stop() {
+  exit_thread = true;
+  free_rgb_frames.Close();
+  decoded_rgb_frames.Close();
+  if (decode_thread.joinable()) {
+    decode_thread.join();
+  }
+  if (sat_thread.joinable()) {
+    sat_thread.join();
+  }
+}
+
+/**
+ * Opens the SVD store next to the video if there is one that matches it.
+ */
+bool SourcePipeline::OpenSVDStore() {
+  std::string store_path = SVDStore::GetStorePath(video_filename);
+  svd_store = new SVDStore();
+  if (svd_store->Open(store_path) && svd_store->GetWidth() == width &&
+      svd_store->GetHeight() == height && svd_store->GetFrameCount() > 0) {
+    std::cout << "[SourcePipeline::OpenSVDStore] Serving rank "
+              << svd_store->GetRank() << " SAT factors from " << store_path
+              << std::endl;
+    if (svd_store->GetFrameRate() > 0) {
+      frame_rate = svd_store->GetFrameRate();
+    }
+    low_rank = true;
+    return true;
+  }
+  if (svd_store->IsOpen()) {
+    std::cerr << "[SourcePipeline::OpenSVDStore] Ignoring " << store_path
+              << ", it does not match the video" << std::endl;
+  }
+  delete svd_store;
+  svd_store = NULL;
+  return false;
+}
+
+bool SourcePipeline::IsOpen() {
+  return video_decoder != NULL && video_decoder->av_format_opened &&
+         video_decoder->source_codec_ctx != NULL;
+}
+
+/**
+ * Waits until a frame newer than frame_tick is published or the timeout
+ * expires. Returns the latest frame either way so callers can keep sampling
+ * the last frame if the video ends. Returns NULL before the first frame.
+ */
+std::shared_ptr<const SourcePipeline::SATFrame> SourcePipeline::WaitForFrame(
+    int64_t *frame_tick, std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(frame_mutex);
+  frame_cv.wait_for(lock, timeout,
+                    [&] { return latest_frame_tick > *frame_tick; });
+  *frame_tick = latest_frame_tick;
+  return latest_frame;
+}
+
+std::shared_ptr<const SourcePipeline::SATFrame>
+SourcePipeline::GetLatestFrame() {
+  std::lock_guard<std::mutex> lock(frame_mutex);
+  return latest_frame;
+}
+
+/** Frame of a video of frame_count frames that is start_time in. */
+int SourcePipeline::GetStartFrame(int frame_count) {
+  if (frame_count <= 0) {
+    return 0;
+  }
+  return (int64_t)(start_time * frame_rate) % frame_count;
+}
+
+/**
+ * Timestamp increment for each loop of a video, with the last frame lasting
+ * as long as the average frame.
+ */
+int64_t SourcePipeline::GetLoopDuration(int64_t first_pts, int64_t last_pts,
+                                        int frame_count) {
+  int64_t duration = last_pts - first_pts;
+  if (frame_count > 1) {
+    duration += duration / (frame_count - 1);
+  }
+  return std::max<int64_t>(duration, 1);
+}
+
+std::shared_ptr<SourcePipeline::SATFrame> SourcePipeline::GetFreeSATFrame() {
+  std::lock_guard<std::mutex> lock(frame_mutex);
+  for (auto &sat_frame : sat_frame_pool) {
+    if (sat_frame.use_count() == 1) {
+      return sat_frame;
+    }
+  }
+  std::shared_ptr<SATFrame> sat_frame = std::make_shared<SATFrame>();
+  if (svd_store != NULL) {
+    sat_frame->sv_buffer = cl::Buffer(cl_manager->context, CL_MEM_READ_ONLY,
+                                      svd_store->GetSVSize());
+    sat_frame->u_buffer = cl::Buffer(cl_manager->context, CL_MEM_READ_ONLY,
+                                     svd_store->GetUSize());
+    sat_frame->v_buffer = cl::Buffer(cl_manager->context, CL_MEM_READ_ONLY,
+                                     svd_store->GetVSize());
+    sat_frame->residual_buffer =
+        cl::Buffer(cl_manager->context, CL_MEM_READ_ONLY,
+                   svd_store->HasResidual() ? svd_store->GetResidualSize()
+                                            : 3 * sizeof(uint8_t));
+  } else if (lattice) {
+    sat_frame->frame_buffer = cl::Buffer(cl_manager->context, CL_MEM_READ_ONLY,
+                                         cl_source_frame_size);
+  } else {
+    sat_frame->sat_buffer =
+        cl::Buffer(cl_manager->context, CL_MEM_READ_WRITE, cl_sat_buffer_size);
+  }
+  sat_frame_pool.push_back(sat_frame);
+  return sat_frame;
+}
+
+/**
+ * Decodes ahead of the SAT thread until the video ends or the queues close.
+ * Frames that fail to decode, e.g. from a corrupt packet, are skipped.
+ * Decoding stops on errors that will not go away or after MAX_DECODE_ERRORS
+ * failures in a row.
+ */
+void SourcePipeline::DecodeLoop() {
+  AVFrame *rgb_frame = NULL;
+  int failed_frames = 0;
+  std::array<char, AV_ERROR_MAX_STRING_SIZE> err_buf;
+  while (!exit_thread && free_rgb_frames.Pop(&rgb_frame)) {
+    ServerMetrics::clock::time_point decode_start = ServerMetrics::clock::now();
+    int ret = video_decoder->GetFrame(
+        rgb_frame, yuv420 ? AV_PIX_FMT_YUV420P : AV_PIX_FMT_RGB0);
+    if (histograms != NULL && ret == 0) {
+      histograms->RecordSince(ServerMetrics::DECODE, decode_start);
+    }
+    if (ret == AVERROR_EOF) {
+      free_rgb_frames.Push(rgb_frame);
+      break;
+    }
+    if (ret != 0) {
+      free_rgb_frames.Push(rgb_frame);
+      av_make_error_string(err_buf.data(), err_buf.size(), ret);
+      if (ret == AVERROR(ENOMEM) || ret == AVERROR_EXIT ||
+          ++failed_frames >= MAX_DECODE_ERRORS) {
+        std::cerr << "[SourcePipeline::DecodeLoop] Decoding stopped after "
+                  << failed_frames << " failed frames; " << err_buf.data()
+                  << std::endl;
+        break;
+      }
+      std::cerr << "[SourcePipeline::DecodeLoop] Skipping frame; "
+                << err_buf.data() << std::endl;
+      continue;
+    }
+    failed_frames = 0;
+    if (!decoded_rgb_frames.Push(rgb_frame)) {
+      break;
+    }
+  }
+  decoded_rgb_frames.Close();
+}
+
+/**
+ * Uploads decoded frames, builds their SATs and publishes them at the source
+ * frame rate. The decoder loops the video if it could be indexed. Otherwise
+ * the last frame stays published once the video ends.
+ */
+void SourcePipeline::SATLoop() {
+  using namespace std::chrono;
+  int ret = 0;
+  const steady_clock::duration frame_interval =
+      duration_cast<steady_clock::duration>(duration<double>(1.0 / frame_rate));
+  steady_clock::time_point next_frame_time = steady_clock::now();
+  AVFrame *rgb_frame = NULL;
+  while (!exit_thread && decoded_rgb_frames.Pop(&rgb_frame)) {
+    std::shared_ptr<SATFrame> sat_frame = GetFreeSATFrame();
+    cl::Event upload_event, upload_end_event, sat_event;
+    // In lattice mode the frame is uploaded straight into the SATFrame.
+    ret = UploadFrame(rgb_frame,
+                      lattice ? sat_frame->frame_buffer : cl_source_frame,
+                      &upload_event, &upload_end_event);
+    if (ret != CL_SUCCESS) {
+      std::cerr << "[SourcePipeline::SATLoop] Failed to upload frame. "
+                << OpenCLManager::GetCLErrorString(ret) << std::endl;
+    }
+    if (lattice) {
+      sat_frame->frame_linesize = rgb_frame->linesize[0];
+    } else if (yuv420) {
+      sat_encoder->EncodeFrameYUV420GPU(
+          sat_frame->sat_buffer(), cl_source_frame(), width, height,
+          rgb_frame->linesize[0], rgb_frame->linesize[1]);
+    } else {
+      sat_encoder->EncodeFrameGPU(sat_frame->sat_buffer(), cl_source_frame(),
+                                  width, height, rgb_frame->linesize[0]);
+    }
+    if (histograms != NULL) {
+      cl_manager->command_queue.enqueueMarkerWithWaitList(NULL, &sat_event);
+    }
+    clFinish(cl_manager->command_queue());
+    if (histograms != NULL && ret == CL_SUCCESS) {
+      // Device times. The marker ends once the SAT kernels have finished.
+      int64_t upload_us =
+          OpenCLManager::GetProfiledTimeUs(upload_event, upload_end_event);
+      int64_t total_us =
+          OpenCLManager::GetProfiledTimeUs(upload_event, sat_event);
+      if (upload_us >= 0 && total_us >= upload_us) {
+        histograms->Record(ServerMetrics::UPLOAD, upload_us);
+        if (!lattice) {
+          histograms->Record(ServerMetrics::SAT, total_us - upload_us);
+        }
+      }
+    }
+    sat_frame->pts = rgb_frame->pts;
+    sat_frame->pkt_dts = rgb_frame->pkt_dts;
+    free_rgb_frames.Push(rgb_frame);
+    PublishFrame(sat_frame, frame_interval, &next_frame_time);
+  }
+}
+
+/**
+ * Enqueues the upload of a decoded frame to target. The planes of a YUV420P
+ * frame are uploaded one after the other, each with its linesize.
+ * start_event and end_event are set to the first and the last write.
+ */
+cl_int SourcePipeline::UploadFrame(AVFrame *frame, cl::Buffer &target,
+                                   cl::Event *start_event,
+                                   cl::Event *end_event) {
+  if (!yuv420) {
+    cl_int ret = cl_manager->command_queue.enqueueWriteBuffer(
+        target, CL_FALSE, 0, cl_source_frame_size, frame->data[0], NULL,
+        start_event);
+    *end_event = *start_event;
+    return ret;
+  }
+  int chroma_height = (height + 1) / 2;
+  size_t plane_sizes[3] = {(size_t)frame->linesize[0] * height,
+                           (size_t)frame->linesize[1] * chroma_height,
+                           (size_t)frame->linesize[2] * chroma_height};
+  size_t offset = 0;
+  for (int plane = 0; plane < 3; plane++) {
+    // Frames are decoded without padding, so the planes fill the buffer.
+    if (offset + plane_sizes[plane] > (size_t)cl_source_frame_size) {
+      return CL_INVALID_VALUE;
+    }
+    cl_int ret = cl_manager->command_queue.enqueueWriteBuffer(
+        target, CL_FALSE, offset, plane_sizes[plane], frame->data[plane], NULL,
+        plane == 0 ? start_event : (plane == 2 ? end_event : NULL));
+    if (ret != CL_SUCCESS) {
+      return ret;
+    }
+    offset += plane_sizes[plane];
+  }
+  return CL_SUCCESS;
+}
+
+/**
+ * Uploads precomputed SATs from the store and publishes them like SATLoop,
+ * looping over the store. Raw frames are uploaded straight from the mapping.
+ * Compressed frames are decoded into a staging buffer first.
+ */
+void SourcePipeline::StoreLoop() {
+  using namespace std::chrono;
+  int ret = 0;
+  const steady_clock::duration frame_interval =
+      duration_cast<steady_clock::duration>(duration<double>(1.0 / frame_rate));
+  steady_clock::time_point next_frame_time = steady_clock::now();
+  std::vector<uint32_t> staging;
+  if (sat_store->GetEncoding() != SATStoreHeader::RAW) {
+    staging.resize(sat_store->GetFrameSize() / sizeof(uint32_t));
+  }
+  int frame_count = sat_store->GetFrameCount();
+  int64_t loop_duration =
+      GetLoopDuration(sat_store->GetIndexEntry(0).pts,
+                      sat_store->GetIndexEntry(frame_count - 1).pts,
+                      frame_count);
+  for (int64_t tick = GetStartFrame(frame_count); !exit_thread; tick++) {
+    int frame = tick % frame_count;
+    int64_t pts_offset = tick / frame_count * loop_duration;
+    std::shared_ptr<SATFrame> sat_frame = GetFreeSATFrame();
+    const uint32_t *sat = sat_store->GetRawFrame(frame);
+    if (sat == NULL) {
+      ServerMetrics::clock::time_point decode_start =
+          ServerMetrics::clock::now();
+      if (!sat_store->ReadFrame(frame, staging.data())) {
+        break;
+      }
+      if (histograms != NULL) {
+        histograms->RecordSince(ServerMetrics::DECODE, decode_start);
+      }
+      sat = staging.data();
+    }
+    cl::Event upload_event;
+    ret = cl_manager->command_queue.enqueueWriteBuffer(
+        sat_frame->sat_buffer, CL_TRUE, 0, cl_sat_buffer_size, sat, NULL,
+        &upload_event);
+    if (ret != CL_SUCCESS) {
+      std::cerr << "[SourcePipeline::StoreLoop] Failed to upload frame. "
+                << OpenCLManager::GetCLErrorString(ret) << std::endl;
+      break;
+    }
+    if (histograms != NULL) {
+      int64_t upload_us =
+          OpenCLManager::GetProfiledTimeUs(upload_event, upload_event);
+      if (upload_us >= 0) {
+        histograms->Record(ServerMetrics::UPLOAD, upload_us);
+      }
+    }
+    sat_frame->pts = sat_store->GetIndexEntry(frame).pts + pts_offset;
+    sat_frame->pkt_dts = sat_store->GetIndexEntry(frame).pkt_dts + pts_offset;
+    PublishFrame(sat_frame, frame_interval, &next_frame_time);
+  }
+}
+
+/**
+ * Uploads the SAT factors and residuals of an SVD store and publishes them
+ * like StoreLoop. Factors are uploaded straight from the mapping.
+ */
+void SourcePipeline::SVDStoreLoop() {
+  using namespace std::chrono;
+  int ret = 0;
+  const steady_clock::duration frame_interval =
+      duration_cast<steady_clock::duration>(duration<double>(1.0 / frame_rate));
+  steady_clock::time_point next_frame_time = steady_clock::now();
+  std::vector<uint8_t> residual(svd_store->HasResidual()
+                                    ? svd_store->GetResidualSize()
+                                    : 3);
+  int frame_count = svd_store->GetFrameCount();
+  int64_t loop_duration =
+      GetLoopDuration(svd_store->GetIndexEntry(0).pts,
+                      svd_store->GetIndexEntry(frame_count - 1).pts,
+                      frame_count);
+  for (int64_t tick = GetStartFrame(frame_count); !exit_thread; tick++) {
+    int frame = tick % frame_count;
+    int64_t pts_offset = tick / frame_count * loop_duration;
+    std::shared_ptr<SATFrame> sat_frame = GetFreeSATFrame();
+    const SVDStoreFrameHeader *frame_header = svd_store->GetFrameHeader(frame);
+    if (svd_store->HasResidual()) {
+      ServerMetrics::clock::time_point decode_start =
+          ServerMetrics::clock::now();
+      if (!svd_store->ReadResidual(frame, residual.data())) {
+        break;
+      }
+      if (histograms != NULL) {
+        histograms->RecordSince(ServerMetrics::DECODE, decode_start);
+      }
+    }
+    cl::Event upload_start_event, upload_event;
+    ret = cl_manager->command_queue.enqueueWriteBuffer(
+        sat_frame->sv_buffer, CL_FALSE, 0, svd_store->GetSVSize(),
+        svd_store->GetSV(frame), NULL, &upload_start_event);
+    if (ret == CL_SUCCESS) {
+      ret = cl_manager->command_queue.enqueueWriteBuffer(
+          sat_frame->u_buffer, CL_FALSE, 0, svd_store->GetUSize(),
+          svd_store->GetU(frame));
+    }
+    if (ret == CL_SUCCESS) {
+      ret = cl_manager->command_queue.enqueueWriteBuffer(
+          sat_frame->v_buffer, CL_FALSE, 0, svd_store->GetVSize(),
+          svd_store->GetV(frame));
+    }
+    if (ret == CL_SUCCESS) {
+      ret = cl_manager->command_queue.enqueueWriteBuffer(
+          sat_frame->residual_buffer, CL_FALSE, 0, residual.size(),
+          residual.data(), NULL, &upload_event);
+    }
+    clFinish(cl_manager->command_queue());
+    if (ret != CL_SUCCESS) {
+      std::cerr << "[SourcePipeline::SVDStoreLoop] Failed to upload frame. "
+                << OpenCLManager::GetCLErrorString(ret) << std::endl;
+      break;
+    }
+    if (histograms != NULL) {
+      int64_t upload_us =
+          OpenCLManager::GetProfiledTimeUs(upload_start_event, upload_event);
+      if (upload_us >= 0) {
+        histograms->Record(ServerMetrics::UPLOAD, upload_us);
+      }
+    }
+    sat_frame->rank = svd_store->GetRank();
+    for (int color = 0; color < 3; color++) {
+      sat_frame->channel_mean[color] = frame_header->channel_mean[color];
+      sat_frame->delta_range[color] =
+          svd_store->HasResidual() ? frame_header->delta_range[color] : 0.0f;
+    }
+    sat_frame->residual_linesize =
+        svd_store->HasResidual() ? 3 * width : 0;
+    sat_frame->pts = frame_header->pts + pts_offset;
+    sat_frame->pkt_dts = frame_header->pkt_dts + pts_offset;
+    PublishFrame(sat_frame, frame_interval, &next_frame_time);
+  }
+}
+
+/**
+ * Publishes sat_frame at next_frame_time and advances it by one frame.
+ * Publish times are absolute so jitter does not accumulate.
+ */
+void SourcePipeline::PublishFrame(
+    std::shared_ptr<SATFrame> sat_frame,
+    std::chrono::steady_clock::duration frame_interval,
+    std::chrono::steady_clock::time_point *next_frame_time) {
+  using namespace std::chrono;
+  *next_frame_time += frame_interval;
+  if (*next_frame_time < steady_clock::now()) {
+    // Fell behind, publish immediately and restart the clock from here.
+    *next_frame_time = steady_clock::now();
+  }
+  std::this_thread::sleep_until(*next_frame_time);
+  {
+    std::lock_guard<std::mutex> lock(frame_mutex);
+    latest_frame = sat_frame;
+    latest_frame_tick++;
+  }
+  frame_cv.notify_all();
+}
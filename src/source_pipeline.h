@@ -0,0 +1,147 @@
+#pragma once
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+#include <libswscale/swscale.h>
+}
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bounded_queue.h"
+#include "opencl_manager.h"
+#include "parameters.h"
+#include "sat_encoder.h"
+#include "sat_store.h"
+#include "server_metrics.h"
+#include "svd_store.h"
+#include "video_decoder.h"
+
+/**
+ * The SourcePipeline decodes a video and builds its summed area table once
+ * per frame for every session watching that video.
+ * A decode-ahead thread keeps a few RGB frames ready so decoding overlaps the
+ * upload and SAT of the previous frame on the SAT thread.
+ * If a SATStore built offline sits next to the video, its frames are uploaded
+ * instead and nothing is decoded or integrated while serving. Failing that,
+ * an SVDStore's low rank factors are uploaded, and sessions build the SAT
+ * only at their grid points. With LATTICE_SAT, decoded frames are uploaded
+ * as they are and sessions sum them only between their grid points. With
+ * YUV420_SAT, frames are decoded to YUV420P and each plane gets its own
+ * SAT.
+ * Sessions hold a shared_ptr to the pipeline and sample from the latest
+ * published SATFrame. A SATFrame stays valid for as long as a session holds
+ * a reference to it.
+ * Playback starts start_time seconds into the video and loops, with
+ * timestamps that keep increasing across loops. The pipeline takes ownership
+ * of decoder if one is given, at any position, and opens the video
+ * otherwise.
+ */
+class SourcePipeline {
+ public:
+  struct SATFrame {
+    int64_t pts = 0;
+    int64_t pkt_dts = 0;
+    cl::Buffer sat_buffer;
+    // Set instead of sat_buffer when serving an SVDStore. The layouts are
+    // those of SATFactors. residual_linesize is 0 without a residual, and
+    // residual_buffer then holds a single pixel.
+    int rank = 0;
+    float channel_mean[3] = {0, 0, 0};
+    float delta_range[3] = {0, 0, 0};
+    cl::Buffer sv_buffer;
+    cl::Buffer u_buffer;
+    cl::Buffer v_buffer;
+    cl::Buffer residual_buffer;
+    int residual_linesize = 0;
+    // Set instead of sat_buffer in lattice mode, the RGB0 frame.
+    cl::Buffer frame_buffer;
+    int frame_linesize = 0;
+  };
+
+  OpenCLManager *cl_manager = NULL;
+  VideoDecoder *video_decoder = NULL;
+  int width = 0;
+  int height = 0;
+  // Source r_frame_rate. Frames are published at this rate.
+  double frame_rate = 30.0;
+  // Frames carry SAT factors instead of a SAT.
+  bool low_rank = false;
+  // Frames carry the decoded frame instead of a SAT.
+  bool lattice = false;
+  // Frames carry the plane SATs of SATEncoder::EncodeFrameYUV420GPU.
+  bool yuv420 = false;
+
+  SourcePipeline(std::string video_filename,
+                 ServerMetrics::StageHistograms *histograms = NULL,
+                 double start_time = 0.0,
+                 VideoDecoder *decoder = NULL);
+  ~SourcePipeline();
+  void Stop();
+  bool IsOpen();
+  std::shared_ptr<const SATFrame> WaitForFrame(
+      int64_t *frame_tick, std::chrono::milliseconds timeout);
+  std::shared_ptr<const SATFrame> GetLatestFrame();
+
+ private:
+  std::string video_filename;
+  double start_time = 0.0;
+  // Decode, upload and SAT latencies are recorded here if set.
+  ServerMetrics::StageHistograms *histograms = NULL;
+  // Only the SAT thread uses the encoder, store and source frame. Neither
+  // the encoder nor the source frame is used in lattice mode.
+  SATEncoder *sat_encoder = NULL;
+  SATStore *sat_store = NULL;
+  SVDStore *svd_store = NULL;
+  cl::Buffer cl_source_frame;
+  int cl_source_frame_size = 0;
+  size_t cl_sat_buffer_size = 0;
+
+  // All SAT buffers ever allocated. A buffer is free once the pool holds
+  // the only reference to it.
+  std::vector<std::shared_ptr<SATFrame>> sat_frame_pool;
+  std::shared_ptr<SATFrame> latest_frame;
+  int64_t latest_frame_tick = -1;
+  std::mutex frame_mutex;
+  std::condition_variable frame_cv;
+
+  // Decoded frames, RGB0 or YUV420P in yuv420 mode, cycle from
+  // free_rgb_frames through the decode thread and decoded_rgb_frames to the
+  // SAT thread and back.
+  static const int RGB_FRAME_COUNT = 4;
+  std::vector<AVFrame *> rgb_frames;
+  BoundedQueue<AVFrame *> free_rgb_frames{RGB_FRAME_COUNT};
+  BoundedQueue<AVFrame *> decoded_rgb_frames{RGB_FRAME_COUNT};
+  // Failed frames in a row after which decoding stops, so a broken stream
+  // does not spin the decode thread.
+  static const int MAX_DECODE_ERRORS = 30;
+
+  std::atomic<bool> exit_thread{false};
+  std::thread decode_thread;
+  std::thread sat_thread;
+
+  void DecodeLoop();
+  void SATLoop();
+  void StoreLoop();
+  void SVDStoreLoop();
+  bool OpenSVDStore();
+  void PublishFrame(std::shared_ptr<SATFrame> sat_frame,
+                    std::chrono::steady_clock::duration frame_interval,
+                    std::chrono::steady_clock::time_point *next_frame_time);
+  std::shared_ptr<SATFrame> GetFreeSATFrame();
+  cl_int UploadFrame(AVFrame *frame, cl::Buffer &target,
+                     cl::Event *start_event, cl::Event *end_event);
+  int GetStartFrame(int frame_count);
+  static int64_t GetLoopDuration(int64_t first_pts, int64_t last_pts,
+                                 int frame_count);
+};
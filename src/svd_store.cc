@@ -0,0 +1,278 @@
+#include "svd_store.h"
+
+SVDStoreWriter::SVDStoreWriter() {}
+
+SVDStoreWriter::~SVDStoreWriter() {
+  if (file != NULL) {
+    Close();
+  }
+}
+
+bool SVDStoreWriter::Open(const std::string &path, int width, int height,
+                          int rank,
+                          SVDStoreHeader::ResidualEncoding residual_encoding,
+                          int frame_rate_num, int frame_rate_den) {
+  this->path = path;
+  file = fopen(path.c_str(), "wb");
+  if (file == NULL) {
+    std::cerr << "[SVDStoreWriter::Open] Failed to open " << path
+              << std::endl;
+    return false;
+  }
+  header = SVDStoreHeader();
+  header.residual_encoding = residual_encoding;
+  header.width = width;
+  header.height = height;
+  header.rank = rank;
+  header.frame_rate_num = frame_rate_num;
+  header.frame_rate_den = frame_rate_den;
+  index.clear();
+  offset = 0;
+  // The header is written again with the index offset on Close.
+  return Write(&header, sizeof(header));
+}
+
+bool SVDStoreWriter::AddFrame(const SATFactors &factors, int64_t pts,
+                              int64_t pkt_dts) {
+  if (file == NULL) {
+    return false;
+  }
+  if (factors.width != (int)header.width ||
+      factors.height != (int)header.height ||
+      factors.rank != (int)header.rank) {
+    std::cerr << "[SVDStoreWriter::AddFrame] Factors do not match the store"
+              << std::endl;
+    return false;
+  }
+  SVDStoreFrameHeader frame_header;
+  frame_header.frame = index.size();
+  frame_header.pts = pts;
+  frame_header.pkt_dts = pkt_dts;
+  for (int color = 0; color < 3; color++) {
+    frame_header.channel_mean[color] = factors.channel_mean[color];
+    frame_header.delta_range[color] = factors.delta_range[color];
+  }
+  if (header.residual_encoding == SVDStoreHeader::ZLIB) {
+    uLongf compressed_size = compressBound(factors.residual.size());
+    compressed.resize(compressed_size);
+    int ret = compress2(compressed.data(), &compressed_size,
+                        factors.residual.data(), factors.residual.size(),
+                        Z_BEST_COMPRESSION);
+    if (ret != Z_OK) {
+      std::cerr << "[SVDStoreWriter::AddFrame] compress2 failed: " << ret
+                << std::endl;
+      return false;
+    }
+    frame_header.residual_size = compressed_size;
+  }
+
+  index.push_back({offset, 0, pts, pkt_dts});
+  bool ok = Write(&frame_header, sizeof(frame_header)) &&
+            Write(factors.sv.data(), factors.sv.size() * sizeof(float)) &&
+            Write(factors.u.data(), factors.u.size() * sizeof(float)) &&
+            Write(factors.v.data(), factors.v.size() * sizeof(float)) &&
+            Write(compressed.data(), frame_header.residual_size) &&
+            PadTo(sizeof(uint64_t));
+  index.back().size = offset - index.back().offset;
+  return ok;
+}
+
+bool SVDStoreWriter::Close() {
+  if (file == NULL) {
+    return false;
+  }
+  header.frame_count = index.size();
+  header.index_offset = offset;
+  bool ok =
+      Write(index.data(), index.size() * sizeof(SVDStoreIndexEntry));
+  ok = ok && fseek(file, 0, SEEK_SET) == 0 &&
+       fwrite(&header, sizeof(header), 1, file) == 1;
+  ok = fclose(file) == 0 && ok;
+  file = NULL;
+  if (!ok) {
+    std::cerr << "[SVDStoreWriter::Close] Failed to write " << path
+              << std::endl;
+  }
+  return ok;
+}
+
+bool SVDStoreWriter::Write(const void *data, size_t size) {
+  if (size > 0 && fwrite(data, size, 1, file) != 1) {
+    std::cerr << "[SVDStoreWriter::Write] Failed to write " << path
+              << std::endl;
+    return false;
+  }
+  offset += size;
+  return true;
+}
+
+bool SVDStoreWriter::PadTo(size_t alignment) {
+  static const uint8_t zeros[sizeof(uint64_t)] = {0};
+  size_t padding = (alignment - offset % alignment) % alignment;
+  return Write(zeros, padding);
+}
+
+SVDStore::SVDStore() {}
+
+SVDStore::~SVDStore() { Close(); }
+
+/**
+ * Maps the store at path. Returns false if it is missing or malformed.
+ */
+bool SVDStore::Open(const std::string &path) {
+  Close();
+  fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 ||
+      (size_t)file_stat.st_size < sizeof(SVDStoreHeader)) {
+    Close();
+    return false;
+  }
+  mapping_size = file_stat.st_size;
+  void *address = mmap(NULL, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (address == MAP_FAILED) {
+    std::cerr << "[SVDStore::Open] Failed to map " << path << std::endl;
+    Close();
+    return false;
+  }
+  mapping = reinterpret_cast<uint8_t *>(address);
+  std::memcpy(&header, mapping, sizeof(header));
+  if (header.magic != SVDStoreHeader::MAGIC ||
+      header.version != SVDStoreHeader::VERSION || header.rank == 0 ||
+      !ReadIndex(path)) {
+    std::cerr << "[SVDStore::Open] Invalid SVD store " << path << std::endl;
+    Close();
+    return false;
+  }
+  madvise(mapping, mapping_size, MADV_SEQUENTIAL);
+  return true;
+}
+
+/**
+ * Copies the index, or rebuilds it from the records if the writer did not
+ * finish.
+ */
+bool SVDStore::ReadIndex(const std::string &path) {
+  if (header.index_offset == 0) {
+    std::cerr << "[SVDStore::ReadIndex] " << path
+              << " has no index, reading its records" << std::endl;
+    return ScanRecords();
+  }
+  uint64_t index_size =
+      (uint64_t)header.frame_count * sizeof(SVDStoreIndexEntry);
+  if (header.index_offset + index_size > mapping_size) {
+    return false;
+  }
+  const SVDStoreIndexEntry *entries =
+      reinterpret_cast<const SVDStoreIndexEntry *>(mapping +
+                                                   header.index_offset);
+  index.assign(entries, entries + header.frame_count);
+  size_t factors_size = GetSVSize() + GetUSize() + GetVSize();
+  for (const SVDStoreIndexEntry &entry : index) {
+    if (entry.offset + entry.size > header.index_offset ||
+        entry.size < sizeof(SVDStoreFrameHeader) + factors_size) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/** Walks the records after the header up to the first incomplete one. */
+bool SVDStore::ScanRecords() {
+  size_t factors_size = GetSVSize() + GetUSize() + GetVSize();
+  uint64_t record_offset = sizeof(SVDStoreHeader);
+  index.clear();
+  while (record_offset + sizeof(SVDStoreFrameHeader) <= mapping_size) {
+    SVDStoreFrameHeader frame_header;
+    std::memcpy(&frame_header, mapping + record_offset, sizeof(frame_header));
+    uint64_t record_size =
+        sizeof(frame_header) + factors_size + frame_header.residual_size;
+    record_size = (record_size + 7) / 8 * 8;
+    if (frame_header.magic != SVDStoreFrameHeader::MAGIC ||
+        frame_header.frame != index.size() ||
+        record_offset + record_size > mapping_size) {
+      break;
+    }
+    index.push_back({record_offset, record_size, frame_header.pts,
+                     frame_header.pkt_dts});
+    record_offset += record_size;
+  }
+  return true;
+}
+
+void SVDStore::Close() {
+  if (mapping != NULL) {
+    munmap(mapping, mapping_size);
+    mapping = NULL;
+  }
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+  index.clear();
+}
+
+double SVDStore::GetFrameRate() {
+  if (header.frame_rate_num <= 0 || header.frame_rate_den <= 0) {
+    return 0.0;
+  }
+  return header.frame_rate_num / (double)header.frame_rate_den;
+}
+
+const SVDStoreFrameHeader *SVDStore::GetFrameHeader(int frame) {
+  if (frame < 0 || frame >= (int)index.size()) {
+    return NULL;
+  }
+  return reinterpret_cast<const SVDStoreFrameHeader *>(mapping +
+                                                       index[frame].offset);
+}
+
+const float *SVDStore::GetSV(int frame) {
+  if (frame < 0 || frame >= (int)index.size()) {
+    return NULL;
+  }
+  return reinterpret_cast<const float *>(mapping + index[frame].offset +
+                                         sizeof(SVDStoreFrameHeader));
+}
+
+const float *SVDStore::GetU(int frame) {
+  const float *sv = GetSV(frame);
+  return sv == NULL ? NULL : sv + GetSVSize() / sizeof(float);
+}
+
+const float *SVDStore::GetV(int frame) {
+  const float *u = GetU(frame);
+  return u == NULL ? NULL : u + GetUSize() / sizeof(float);
+}
+
+/**
+ * Inflates the residual into target, which holds GetResidualSize() bytes.
+ * Returns false if the store has no residuals.
+ */
+bool SVDStore::ReadResidual(int frame, uint8_t *target) {
+  const SVDStoreFrameHeader *frame_header = GetFrameHeader(frame);
+  if (frame_header == NULL || !HasResidual()) {
+    return false;
+  }
+  const uint8_t *data = reinterpret_cast<const uint8_t *>(GetV(frame)) +
+                        GetVSize();
+  uLongf decompressed_size = GetResidualSize();
+  if (sizeof(SVDStoreFrameHeader) + GetSVSize() + GetUSize() + GetVSize() +
+              frame_header->residual_size >
+          index[frame].size ||
+      uncompress(target, &decompressed_size, data,
+                 frame_header->residual_size) != Z_OK ||
+      decompressed_size != GetResidualSize()) {
+    std::cerr << "[SVDStore::ReadResidual] Corrupt frame " << frame
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+std::string SVDStore::GetStorePath(const std::string &video_filename) {
+  return SATStore::GetStorePath(video_filename, ".svdstore");
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "sat_factorizer.h"
+#include "sat_store.h"
+
+/**
+ * File of low rank SAT factors, one SATFactors record per video frame.
+ * A frame takes 3 * rank * (width + height + 1) floats plus an optional
+ * deflated 8-bit residual, instead of the 3 * width * height uint32 of a
+ * SATStore frame.
+ *
+ * The file starts with a fixed header, followed by the frame records and
+ * then a frame index. Each record is a SVDStoreFrameHeader followed by sv, u
+ * and v as in SATFactors, then residual_size bytes of residual, padded to
+ * 8 bytes. Records are written as soon as a frame is factorized, so a file
+ * whose writer has not finished has no index but can still be read by
+ * walking the records.
+ * All values are little endian.
+ */
+struct SVDStoreHeader {
+  static const uint64_t MAGIC = 0x3152545344565346;  // "FSVDSTR1"
+  static const uint32_t VERSION = 1;
+  enum ResidualEncoding : uint32_t { NONE = 0, ZLIB = 1 };
+
+  uint64_t magic = MAGIC;
+  uint32_t version = VERSION;
+  uint32_t residual_encoding = NONE;
+  uint32_t width = 0;
+  uint32_t height = 0;
+  uint32_t rank = 0;
+  uint32_t frame_count = 0;
+  int32_t frame_rate_num = 0;
+  int32_t frame_rate_den = 1;
+  // 0 until the writer is closed.
+  uint64_t index_offset = 0;
+  uint64_t reserved[2] = {0, 0};
+};
+
+struct SVDStoreFrameHeader {
+  static const uint32_t MAGIC = 0x46445653;  // "SVDF"
+
+  uint32_t magic = MAGIC;
+  uint32_t frame = 0;
+  int64_t pts = 0;
+  int64_t pkt_dts = 0;
+  float channel_mean[3] = {0, 0, 0};
+  float delta_range[3] = {0, 0, 0};
+  uint32_t residual_size = 0;
+  uint32_t reserved = 0;
+};
+
+struct SVDStoreIndexEntry {
+  uint64_t offset;
+  uint64_t size;
+  int64_t pts;
+  int64_t pkt_dts;
+};
+
+/** Writes an SVD store one frame at a time, in frame order. */
+class SVDStoreWriter {
+ public:
+  SVDStoreWriter();
+  ~SVDStoreWriter();
+  bool Open(const std::string &path, int width, int height, int rank,
+            SVDStoreHeader::ResidualEncoding residual_encoding,
+            int frame_rate_num, int frame_rate_den);
+  bool AddFrame(const SATFactors &factors, int64_t pts, int64_t pkt_dts);
+  bool Close();
+
+ private:
+  FILE *file = NULL;
+  std::string path;
+  SVDStoreHeader header;
+  std::vector<SVDStoreIndexEntry> index;
+  uint64_t offset = 0;
+  std::vector<uint8_t> compressed;
+
+  bool Write(const void *data, size_t size);
+  bool PadTo(size_t alignment);
+};
+
+/**
+ * Reads an SVD store through a read-only memory mapping. Factors are
+ * returned as pointers into the mapping. Residuals are inflated into a
+ * caller buffer. Any number of threads may read at once.
+ */
+class SVDStore {
+ public:
+  SVDStore();
+  ~SVDStore();
+  bool Open(const std::string &path);
+  bool IsOpen() { return mapping != NULL; }
+  int GetWidth() { return header.width; }
+  int GetHeight() { return header.height; }
+  int GetRank() { return header.rank; }
+  int GetFrameCount() { return index.size(); }
+  double GetFrameRate();
+  bool HasResidual() {
+    return header.residual_encoding != SVDStoreHeader::NONE;
+  }
+  size_t GetSVSize() { return (size_t)3 * header.rank * sizeof(float); }
+  size_t GetUSize() {
+    return (size_t)3 * header.height * header.rank * sizeof(float);
+  }
+  size_t GetVSize() {
+    return (size_t)3 * header.rank * header.width * sizeof(float);
+  }
+  size_t GetResidualSize() { return (size_t)3 * header.width * header.height; }
+  const SVDStoreIndexEntry &GetIndexEntry(int frame) { return index[frame]; }
+  const SVDStoreFrameHeader *GetFrameHeader(int frame);
+  const float *GetSV(int frame);
+  const float *GetU(int frame);
+  const float *GetV(int frame);
+  bool ReadResidual(int frame, uint8_t *target);
+  static std::string GetStorePath(const std::string &video_filename);
+
+ private:
+  int fd = -1;
+  uint8_t *mapping = NULL;
+  size_t mapping_size = 0;
+  SVDStoreHeader header;
+  std::vector<SVDStoreIndexEntry> index;
+
+  bool ReadIndex(const std::string &path);
+  bool ScanRecords();
+  void Close();
+};
@@ -0,0 +1,328 @@
+#include "video_catalog.h"
+
+VideoCatalog::VideoCatalog(std::string directory, int decoder_pool_size,
+                           int spare_encoder_count, bool precompute_grids)
+    : directory(directory),
+      decoder_pool_size(decoder_pool_size),
+      spare_encoder_count(spare_encoder_count),
+      precompute_grids(precompute_grids) {}
+
+VideoCatalog::~VideoCatalog() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    exit_thread = true;
+  }
+  tasks_cv.notify_all();
+  if (warm_thread.joinable()) {
+    warm_thread.join();
+  }
+  for (auto &pooled : decoder_pool) {
+    delete pooled.second;
+  }
+  for (auto &spare : spare_encoders) {
+    delete spare.second;
+  }
+}
+
+/** Starts warming up in the background. */
+void VideoCatalog::Start() {
+  warm_thread = std::thread(&VideoCatalog::WarmLoop, this);
+  Post([this] { BuildPrograms(); });
+  Post([this] { ScanDirectory(); });
+}
+
+/**
+ * Looks up a video by the name sessions request it by. Videos added to the
+ * directory after the scan are opened on the first request.
+ */
+bool VideoCatalog::Find(const std::string &name, VideoInfo *info) {
+  if (name.empty() || name.find('/') != std::string::npos) {
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = videos.find(name);
+    if (it != videos.end()) {
+      *info = it->second;
+      return true;
+    }
+  }
+  std::string path = GetPath(name);
+  {
+    // Check for file existance.
+    std::ifstream f(path);
+    if (!f.good()) {
+      return false;
+    }
+  }
+  VideoDecoder *decoder = OpenDecoder(path);
+  if (decoder == NULL) {
+    return false;
+  }
+  AddVideo(name, decoder);
+  std::lock_guard<std::mutex> lock(mutex);
+  *info = videos[name];
+  return true;
+}
+
+std::vector<VideoCatalog::VideoInfo> VideoCatalog::List() {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::vector<VideoInfo> list;
+  for (auto &video : videos) {
+    list.push_back(video.second);
+  }
+  return list;
+}
+
+/**
+ * Returns an open, indexed decoder for the video, from the pool if one is
+ * there. The caller owns the decoder and should give it back with
+ * ReturnDecoder. Its position is wherever its last user left it. Returns
+ * NULL if the video cannot be opened.
+ */
+VideoDecoder *VideoCatalog::TakeDecoder(const std::string &name) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = decoder_pool.begin(); it != decoder_pool.end(); ++it) {
+      if (it->first == name) {
+        VideoDecoder *decoder = it->second;
+        decoder_pool.erase(it);
+        return decoder;
+      }
+    }
+  }
+  return OpenDecoder(GetPath(name));
+}
+
+void VideoCatalog::ReturnDecoder(const std::string &name,
+                                 VideoDecoder *decoder) {
+  if (decoder == NULL) {
+    return;
+  }
+  if (!decoder->av_format_opened || decoder->source_codec_ctx == NULL) {
+    delete decoder;
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  PoolDecoder(name, decoder);
+}
+
+/**
+ * Returns an encoder for frames of codec_ctx's size and timing. A spare one
+ * is used if it matches, and a new spare is opened in the background for the
+ * next session of that size.
+ */
+VideoEncoder *VideoCatalog::TakeEncoder(AVCodecContext *codec_ctx) {
+  encoder_key key = GetEncoderKey(codec_ctx);
+  VideoEncoder *encoder = NULL;
+  if (spare_encoder_count > 0) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = spare_encoders.begin(); it != spare_encoders.end(); ++it) {
+      if (it->first == key) {
+        encoder = it->second;
+        spare_encoders.erase(it);
+        break;
+      }
+    }
+  }
+  if (encoder == NULL) {
+    encoder = OpenEncoder(key);
+  }
+  if (spare_encoder_count > 0) {
+    Post([this, key] { BuildSpareEncoder(key); });
+  }
+  return encoder;
+}
+
+std::string VideoCatalog::GetPath(const std::string &name) {
+  return directory + "/" + name + ".mp4";
+}
+
+/** Opens and indexes the video at path. Returns NULL on failure. */
+VideoDecoder *VideoCatalog::OpenDecoder(const std::string &path) {
+  VideoDecoder *decoder = new VideoDecoder();
+  decoder->OpenVideo(path);
+  if (!decoder->av_format_opened || decoder->source_codec_ctx == NULL) {
+    std::cerr << "[VideoCatalog::OpenDecoder] Failed to open " << path
+              << std::endl;
+    delete decoder;
+    return NULL;
+  }
+  decoder->OpenIndex();
+  return decoder;
+}
+
+/** Records the video's stream info and pools its decoder. */
+void VideoCatalog::AddVideo(const std::string &name, VideoDecoder *decoder) {
+  VideoInfo info;
+  info.name = name;
+  info.path = GetPath(name);
+  info.width = decoder->source_codec_ctx->width;
+  info.height = decoder->source_codec_ctx->height;
+  AVRational frame_rate = decoder->source_codec_ctx->framerate;
+  if (frame_rate.num > 0 && frame_rate.den > 0) {
+    info.frame_rate = av_q2d(frame_rate);
+  }
+  info.frame_count = decoder->GetFrameCount();
+  bool new_size = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    videos[name] = info;
+    PoolDecoder(name, decoder);
+    if (precompute_grids) {
+      new_size = grids.emplace(std::make_pair(info.width, info.height),
+                               std::vector<std::shared_ptr<const cl::Buffer>>())
+                     .second;
+    }
+  }
+  if (new_size) {
+    Post([this, info] { BuildGrids(info.width, info.height); });
+  }
+}
+
+/** Adds the decoder as the most recently used. Requires the mutex. */
+void VideoCatalog::PoolDecoder(const std::string &name,
+                               VideoDecoder *decoder) {
+  decoder_pool.emplace_front(name, decoder);
+  while ((int)decoder_pool.size() > decoder_pool_size) {
+    delete decoder_pool.back().second;
+    decoder_pool.pop_back();
+  }
+}
+
+void VideoCatalog::Post(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks.push_back(task);
+  }
+  tasks_cv.notify_one();
+}
+
+void VideoCatalog::WarmLoop() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      tasks_cv.wait(lock, [&] { return exit_thread || !tasks.empty(); });
+      if (exit_thread) {
+        return;
+      }
+      task = tasks.front();
+      tasks.pop_front();
+    }
+    task();
+  }
+}
+
+/**
+ * Builds the programs of the SAT encoder and decoder into OpenCLManager's
+ * program cache, so the first pipeline and session do not compile them.
+ */
+void VideoCatalog::BuildPrograms() {
+  OpenCLManager cl_manager;
+  cl_manager.InitializeContext(OpenCLManager::GetSharedManager());
+  SATEncoder sat_encoder(&cl_manager);
+  SATDecoder sat_decoder(&cl_manager);
+}
+
+/** Opens and indexes every video in the directory not yet in the catalog. */
+void VideoCatalog::ScanDirectory() {
+  std::error_code error;
+  std::filesystem::directory_iterator it(directory, error);
+  if (error) {
+    std::cerr << "[VideoCatalog::ScanDirectory] Cannot read " << directory
+              << ": " << error.message() << std::endl;
+    return;
+  }
+  int count = 0;
+  for (; it != std::filesystem::directory_iterator(); it.increment(error)) {
+    if (error) {
+      break;
+    }
+    std::filesystem::path path = it->path();
+    if (path.extension() != ".mp4") {
+      continue;
+    }
+    std::string name = path.stem().string();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (exit_thread) {
+        return;
+      }
+      if (videos.count(name) > 0) {
+        continue;
+      }
+    }
+    VideoDecoder *decoder = OpenDecoder(path.string());
+    if (decoder != NULL) {
+      AddVideo(name, decoder);
+      count++;
+    }
+  }
+  std::cout << "[VideoCatalog::ScanDirectory] Found " << count
+            << " videos in " << directory << std::endl;
+}
+
+/**
+ * Builds the SAT sampling grids of the default ladder rungs for a source
+ * size and holds on to them, so sessions of the shared context take them
+ * from the grid cache instead of building them on their first frame.
+ */
+void VideoCatalog::BuildGrids(int source_width, int source_height) {
+  OpenCLManager cl_manager;
+  cl_manager.InitializeContext(OpenCLManager::GetSharedManager());
+  SATDecoder sat_decoder(&cl_manager);
+  std::vector<std::shared_ptr<const cl::Buffer>> source_grids;
+  for (ResolutionLadder::Rung rung : ResolutionLadder::DefaultRungs()) {
+    sat_decoder.InitializeGrid(rung.width, rung.height, source_width,
+                               source_height);
+    source_grids.push_back(sat_decoder.GetGrid());
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  grids[std::make_pair(source_width, source_height)] = source_grids;
+}
+
+/** Opens a spare encoder for key unless there already is one. */
+void VideoCatalog::BuildSpareEncoder(encoder_key key) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &spare : spare_encoders) {
+      if (spare.first == key) {
+        return;
+      }
+    }
+  }
+  VideoEncoder *encoder = OpenEncoder(key);
+  if (encoder == NULL) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  spare_encoders.emplace_front(key, encoder);
+  while ((int)spare_encoders.size() > spare_encoder_count) {
+    delete spare_encoders.back().second;
+    spare_encoders.pop_back();
+  }
+}
+
+VideoCatalog::encoder_key VideoCatalog::GetEncoderKey(
+    AVCodecContext *codec_ctx) {
+  return encoder_key(codec_ctx->width, codec_ctx->height,
+                     codec_ctx->time_base.num, codec_ctx->time_base.den,
+                     codec_ctx->framerate.num, codec_ctx->framerate.den);
+}
+
+VideoEncoder *VideoCatalog::OpenEncoder(encoder_key key) {
+  AVCodecContext *codec_ctx = avcodec_alloc_context3(NULL);
+  if (codec_ctx == NULL) {
+    std::cerr << "[VideoCatalog::OpenEncoder] Failed to allocate codec context"
+              << std::endl;
+    return NULL;
+  }
+  codec_ctx->width = std::get<0>(key);
+  codec_ctx->height = std::get<1>(key);
+  codec_ctx->time_base = {std::get<2>(key), std::get<3>(key)};
+  codec_ctx->framerate = {std::get<4>(key), std::get<5>(key)};
+  VideoEncoder *encoder = new VideoEncoder(codec_ctx);
+  avcodec_free_context(&codec_ctx);
+  return encoder;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "opencl_manager.h"
+#include "resolution_ladder.h"
+#include "sat_decoder.h"
+#include "sat_encoder.h"
+#include "video_decoder.h"
+#include "video_encoder.h"
+
+/**
+ * The videos sessions can request by name, stored in a directory as
+ * <name>.mp4, with the resources that are slow to create kept ready.
+ * On Start, a background thread builds the OpenCL programs of the SAT
+ * encoder and decoder, then opens and indexes every video in the directory.
+ * The decoders of the most recently used videos are kept open between
+ * pipelines. Encoders for recently used output sizes are opened ahead of the
+ * sessions that need them. With precompute_grids, the sampling grids of the
+ * default ladder rungs are built for every source size and held in the grid
+ * cache.
+ * All methods are thread safe.
+ */
+class VideoCatalog {
+ public:
+  struct VideoInfo {
+    std::string name;
+    std::string path;
+    int width = 0;
+    int height = 0;
+    double frame_rate = 0.0;
+    // 0 if the video could not be indexed.
+    int frame_count = 0;
+  };
+
+  VideoCatalog(std::string directory, int decoder_pool_size,
+               int spare_encoder_count, bool precompute_grids);
+  ~VideoCatalog();
+  void Start();
+  bool Find(const std::string &name, VideoInfo *info);
+  std::vector<VideoInfo> List();
+  VideoDecoder *TakeDecoder(const std::string &name);
+  void ReturnDecoder(const std::string &name, VideoDecoder *decoder);
+  VideoEncoder *TakeEncoder(AVCodecContext *codec_ctx);
+
+ private:
+  // Width, height, time base and frame rate.
+  typedef std::tuple<int, int, int, int, int, int> encoder_key;
+
+  std::string directory;
+  int decoder_pool_size;
+  int spare_encoder_count;
+  bool precompute_grids;
+  std::mutex mutex;
+  std::map<std::string, VideoInfo> videos;
+  // Most recently used first.
+  std::list<std::pair<std::string, VideoDecoder *>> decoder_pool;
+  std::list<std::pair<encoder_key, VideoEncoder *>> spare_encoders;
+  // Grids kept alive in the grid cache, by source width and height.
+  std::map<std::pair<int, int>, std::vector<std::shared_ptr<const cl::Buffer>>>
+      grids;
+
+  // Warm up tasks, run in order on warm_thread.
+  std::deque<std::function<void()>> tasks;
+  std::condition_variable tasks_cv;
+  bool exit_thread = false;
+  std::thread warm_thread;
+
+  std::string GetPath(const std::string &name);
+  VideoDecoder *OpenDecoder(const std::string &path);
+  void AddVideo(const std::string &name, VideoDecoder *decoder);
+  void PoolDecoder(const std::string &name, VideoDecoder *decoder);
+  void Post(std::function<void()> task);
+  void WarmLoop();
+  void BuildPrograms();
+  void ScanDirectory();
+  void BuildGrids(int source_width, int source_height);
+  void BuildSpareEncoder(encoder_key key);
+  static encoder_key GetEncoderKey(AVCodecContext *codec_ctx);
+  static VideoEncoder *OpenEncoder(encoder_key key);
+};
@@ -68,11 +68,29 @@ void VideoClient::on_message(websocketpp::connection_hdl hdl, message_ptr msg) {
       gaze_vec[parsed["frameNum"]] =
           GazePos(parsed["centerX"], parsed["centerY"]);
     } else if (parsed["type"] == "ack") {
+    } else if (parsed["type"] == "videoInfo") {
+      source_width = parsed["width"].get<int>();
+      source_height = parsed["height"].get<int>();
     } else {
       std::cout << "Message received" << std::endl;
       std::cout << msg->get_payload() << std::endl;
     }
   } else {
+    const std::string& payload = msg->get_payload();
+    const uint8_t* payload_data =
+        reinterpret_cast<const uint8_t*>(payload.data());
+    size_t payload_size = payload.size();
+    // Servers without envelope support send the bare fragment. An fMP4 box
+    // never starts with the envelope magic.
+    FrameEnvelope envelope;
+    if (envelope.Read(payload_data, payload_size)) {
+      if (envelope.kind == FrameEnvelope::FRAGMENT) {
+        last_received_pos = GazePos(envelope.center_x, envelope.center_y);
+        gaze_vec[envelope.frame_number % 256] = last_received_pos;
+      }
+      payload_data += envelope.header_size;
+      payload_size -= envelope.header_size;
+    }
     auto curr_time = high_resolution_clock::now();
     if (last_received_pos.x >= 0) {
       // gaze_vec[gaze_rec_pos + 1] = last_received_pos;
@@ -92,15 +110,14 @@ void VideoClient::on_message(websocketpp::connection_hdl hdl, message_ptr msg) {
     // }
 
     int ret = 0;
-    auto payload = msg->get_payload();
-    if (payload.size() + io_buffer.bytesSet > io_buffer.inBuffer.capacity()) {
+    if (payload_size + io_buffer.bytesSet > io_buffer.inBuffer.capacity()) {
       std::cerr << "[VideoClient::on_message] IO Buffer overcapacity"
                 << std::endl;
       exit(EXIT_FAILURE);
     } else {
       std::memcpy(io_buffer.inBuffer.data() + io_buffer.bytesSet,
-                  payload.data(), payload.size());
-      io_buffer.bytesSet += payload.size();
+                  payload_data, payload_size);
+      io_buffer.bytesSet += payload_size;
       avio_ctx->eof_reached = false;
     }
     TryOpenInput();
@@ -115,6 +132,7 @@ void VideoClient::on_open(websocketpp::connection_hdl hdl) {
   json video_request;
   video_request["type"] = "videoRequest";
   video_request["video"] = "03_drone_d5d4gnuAJLo";
+  video_request["envelope"] = FrameEnvelope::VERSION;
   try {
     ws_client.send(hdl, video_request.dump(), websocketpp::frame::opcode::text);
   } catch (websocketpp::exception const& e) {
@@ -220,6 +238,18 @@ void VideoClient::run() {
     }
   }
   std::cout << "Format opened" << std::endl;
+  // The server sends videoInfo before the first fragment.
+  full_width = source_width;
+  full_height = source_height;
+  if (full_width <= 0 || full_height <= 0) {
+    std::cerr << "No videoInfo received, assuming the window size"
+              << std::endl;
+    full_width = window_width;
+    full_height = window_height;
+  }
+  glBindTexture(GL_TEXTURE_2D, gltexture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, (GLint)full_width,
+               (GLint)full_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
 
   int reduced_width = decoder.source_codec_ctx->width;
   int reduced_height = decoder.source_codec_ctx->height;
@@ -344,8 +374,8 @@ void VideoClient::run() {
 
     int mouse_x, mouse_y;
     SDL_GetMouseState(&mouse_x, &mouse_y);
-    float mouse_xf = mouse_x / (float)full_width;
-    float mouse_yf = mouse_y / (float)full_height;
+    float mouse_xf = mouse_x / (float)window_width;
+    float mouse_yf = mouse_y / (float)window_height;
     UpdateGazePosition(mouse_xf, mouse_yf);
 
     // Wait until we're ready.
@@ -451,8 +481,8 @@ void VideoClient::SetupSDL() {
   SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
 
   window = SDL_CreateWindow("Foveated", SDL_WINDOWPOS_UNDEFINED,
-                            SDL_WINDOWPOS_UNDEFINED, full_width, full_height,
-                            SDL_WINDOW_OPENGL);
+                            SDL_WINDOWPOS_UNDEFINED, window_width,
+                            window_height, SDL_WINDOW_OPENGL);
   if (!window) {
     std::cerr << "Failed to create SDL Window" << std::endl;
     exit(EXIT_FAILURE);
@@ -512,7 +542,7 @@ void VideoClient::SetupSDL() {
 
   glDisable(GL_DEPTH_TEST);
   glClearColor(0.5, 0.0, 0.0, 0.0);
-  glViewport(0, 0, full_width, full_height);
+  glViewport(0, 0, window_width, window_height);
 
   glGenVertexArrays(1, &vao);
   glGenBuffers(1, &vbo);
@@ -530,19 +560,19 @@ void VideoClient::SetupSDL() {
   const GLfloat g_vertex_buffer_data[] = {
       /*  R, G, X, Y  */
       0, 0, 0, 0,
-      1, 0, (GLfloat)full_width, 0, 
-      1, 1, (GLfloat)full_width, (GLfloat)full_height,
+      1, 0, (GLfloat)window_width, 0, 
+      1, 1, (GLfloat)window_width, (GLfloat)window_height,
       0, 0, 0, 0,
-      1, 1, (GLfloat)full_width, (GLfloat)full_height,
-      0, 1, 0, (GLfloat)full_height};
+      1, 1, (GLfloat)window_width, (GLfloat)window_height,
+      0, 1, 0, (GLfloat)window_height};
   // clang-format on
 
   glBufferData(GL_ARRAY_BUFFER, sizeof(g_vertex_buffer_data),
                g_vertex_buffer_data, GL_STATIC_DRAW);
 
   t_mat4x4 projection_matrix;
-  mat4x4_ortho(projection_matrix, 0.0f, (float)full_width, (float)full_height,
-               0.0f, 0.0f, 100.0f);
+  mat4x4_ortho(projection_matrix, 0.0f, (float)window_width,
+               (float)window_height, 0.0f, 0.0f, 100.0f);
   glUniformMatrix4fv(glGetUniformLocation(program, "u_projection_matrix"), 1,
                      GL_FALSE, projection_matrix);
 
@@ -553,9 +583,7 @@ void VideoClient::SetupSDL() {
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, (GLint)full_width,
-               (GLint)full_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+  // Storage is allocated once the source size is known.
   glUniform1i(glGetUniformLocation(program, "tex"), 0);
 }
 
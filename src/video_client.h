@@ -9,6 +9,7 @@
 #include <SDL2/SDL_opengl.h>
 #include <SDL2/SDL_opengl_glext.h>
 #include <SDL2/SDL_thread.h>
+#include <atomic>
 #include <chrono>
 #include <filesystem>
 #include <iostream>
@@ -25,6 +26,7 @@ extern "C" {
 #include <libavutil/pixdesc.h>
 #include <libswscale/swscale.h>
 }
+#include "frame_envelope.h"
 #include "gaze_view_points.h"
 #include "opencl_manager.h"
 #include "parameters.h"
@@ -62,8 +64,14 @@ class VideoClient {
   static const std::string vertex_shader;
   static const std::string fragment_shader;
 
-  int full_width = 1920;
-  int full_height = 1080;
+  int window_width = 1920;
+  int window_height = 1080;
+  // Source size from the server's videoInfo message. Frames are rebuilt at
+  // this size and scaled to the window.
+  std::atomic<int> source_width{0};
+  std::atomic<int> source_height{0};
+  int full_width = 0;
+  int full_height = 0;
 
   double total_recv_time = 0;
   uint64_t total_recv_count = 0;
@@ -32,6 +32,7 @@ VideoDecoder::~VideoDecoder() {
 void VideoDecoder::OpenVideo(std::string video_path) {
   int ret;
   std::array<char, 256> err_buf;
+  this->video_path = video_path;
 
   // Open Video File
   if ((ret = avformat_open_input(&source_format_ctx, video_path.c_str(), NULL,
@@ -162,20 +163,16 @@ int VideoDecoder::GetFrame(AVFrame *target_frame, AVPixelFormat pixel_format) {
       cerr << "Allocate frame buffer failed" << endl;
     }
   }
-  if (sws_ctx == NULL || target_pixel_format != pixel_format) {
-    sws_freeContext(sws_ctx);
-    sws_ctx = sws_getContext(source_codec_ctx->width, source_codec_ctx->height,
-                             source_codec_ctx->pix_fmt, source_codec_ctx->width,
-                             source_codec_ctx->height, pixel_format,
-                             SWS_BILINEAR, NULL, NULL, NULL);
-    target_pixel_format = pixel_format;
-  }
+  target_pixel_format = pixel_format;
   int return_value = -100;
   bool read_another_frame = true;
   bool send_another_packet = true;
+  // Loop at most once per call so an undecodable video cannot spin.
+  bool looped = false;
 
   while (read_another_frame) {
-    ret = av_read_frame(source_format_ctx, &source_packet);
+    ret = draining ? AVERROR_EOF
+                   : av_read_frame(source_format_ctx, &source_packet);
     // if (ret == 0) {
     //   std::cout << "RECEIVED: " << std::dec << source_packet.size << " ----";
     //   for (int i = 0; i < 10; i++) {
@@ -216,18 +213,37 @@ int VideoDecoder::GetFrame(AVFrame *target_frame, AVPixelFormat pixel_format) {
         }
       }
 
-      if (ret == 0) {
-        target_frame->pts = source_frame->pts;
-        target_frame->pkt_dts = source_frame->pkt_dts;
-        sws_scale(sws_ctx, source_frame->data, source_frame->linesize, 0,
-                  source_frame->height, target_frame->data,
-                  target_frame->linesize);
+      if (ret == 0 && IsBeforeSeekTarget()) {
+        // Decoded on the way from the keyframe to the seek target.
+        read_another_frame = true;
+      } else if (ret == 0) {
+        ConvertFrame(target_frame);
         return_value = 0;
       } else {
         if (return_value == -100) {
           return_value = ret;
         }
       }
+    } else if (ret == AVERROR_EOF && !frame_index.empty()) {
+      // Drain the frames still held by the decoder.
+      if (!draining) {
+        draining = true;
+        avcodec_send_packet(source_codec_ctx, NULL);
+      }
+      ret = avcodec_receive_frame(source_codec_ctx, source_frame);
+      if (ret == 0 && IsBeforeSeekTarget()) {
+        // Keep draining.
+      } else if (ret == 0) {
+        ConvertFrame(target_frame);
+        return_value = 0;
+        read_another_frame = false;
+      } else if (loop && !looped && Seek(0) == 0) {
+        looped = true;
+        pts_offset += loop_duration;
+      } else {
+        return_value = AVERROR_EOF;
+        read_another_frame = false;
+      }
     } else if (ret != 0) {
       read_another_frame = false;
     }
@@ -235,4 +251,186 @@ int VideoDecoder::GetFrame(AVFrame *target_frame, AVPixelFormat pixel_format) {
   }
   av_packet_unref(&source_packet);
   return return_value;
-}
\ No newline at end of file
+}
+
+bool VideoDecoder::IsBeforeSeekTarget() {
+  return seek_pts != AV_NOPTS_VALUE && source_frame->pts != AV_NOPTS_VALUE &&
+         source_frame->pts < seek_pts;
+}
+
+/** Scales source_frame into target_frame. */
+void VideoDecoder::ConvertFrame(AVFrame *target_frame) {
+  seek_pts = AV_NOPTS_VALUE;
+  if (next_frame >= 0) {
+    next_frame = (next_frame + 1) % frame_index.size();
+  }
+  target_frame->pts = source_frame->pts;
+  target_frame->pkt_dts = source_frame->pkt_dts;
+  if (target_frame->pts != AV_NOPTS_VALUE) {
+    target_frame->pts += pts_offset;
+  }
+  if (target_frame->pkt_dts != AV_NOPTS_VALUE) {
+    target_frame->pkt_dts += pts_offset;
+  }
+  // Frames already in the target format, such as YUV420P for the YUV420
+  // pipeline, are copied as they are.
+  if (source_frame->format == target_pixel_format &&
+      source_frame->width == target_frame->width &&
+      source_frame->height == target_frame->height) {
+    av_frame_copy(target_frame, source_frame);
+    return;
+  }
+  // Streams may change resolution at a keyframe. Frames are always
+  // scaled to the size of target_frame.
+  sws_ctx = sws_getCachedContext(
+      sws_ctx, source_frame->width, source_frame->height,
+      (AVPixelFormat)source_frame->format, target_frame->width,
+      target_frame->height, target_pixel_format, SWS_BILINEAR, NULL, NULL,
+      NULL);
+  sws_scale(sws_ctx, source_frame->data, source_frame->linesize, 0,
+            source_frame->height, target_frame->data, target_frame->linesize);
+}
+
+/**
+ * Loads the frame index from the sidecar file next to the video, or builds it
+ * by reading every packet and writes the sidecar. Only videos opened from a
+ * path can be indexed. Returns false if the video has no frames.
+ */
+bool VideoDecoder::OpenIndex() {
+  if (!frame_index.empty()) {
+    return true;
+  }
+  if (!av_format_opened || video_path.empty()) {
+    return false;
+  }
+  struct stat video_stat;
+  if (stat(video_path.c_str(), &video_stat) != 0) {
+    return false;
+  }
+  std::string index_path = video_path + ".index";
+  if (!LoadIndex(index_path, video_stat)) {
+    if (!ScanIndex()) {
+      return false;
+    }
+    SaveIndex(index_path, video_stat);
+  }
+  const VideoIndexEntry &first = frame_index.front();
+  const VideoIndexEntry &last = frame_index.back();
+  // The last frame lasts as long as the average frame.
+  loop_duration = last.pts - first.pts;
+  if (frame_index.size() > 1) {
+    loop_duration += loop_duration / (int64_t)(frame_index.size() - 1);
+  }
+  loop_duration = std::max<int64_t>(loop_duration, 1);
+  next_frame = 0;
+  return true;
+}
+
+bool VideoDecoder::LoadIndex(const std::string &index_path,
+                             const struct stat &video_stat) {
+  FILE *file = fopen(index_path.c_str(), "rb");
+  if (file == NULL) {
+    return false;
+  }
+  VideoIndexHeader header;
+  bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+            header.magic == VideoIndexHeader::MAGIC &&
+            header.version == VideoIndexHeader::VERSION &&
+            header.video_size == (int64_t)video_stat.st_size &&
+            header.video_mtime == (int64_t)video_stat.st_mtime &&
+            header.frame_count > 0;
+  if (ok) {
+    frame_index.resize(header.frame_count);
+    ok = fread(frame_index.data(), sizeof(VideoIndexEntry),
+               frame_index.size(), file) == frame_index.size();
+  }
+  fclose(file);
+  if (!ok) {
+    frame_index.clear();
+  }
+  return ok;
+}
+
+/**
+ * Reads every packet of the video stream with a second demuxer, so the
+ * decoder's position is unchanged, and sorts them into presentation order.
+ */
+bool VideoDecoder::ScanIndex() {
+  AVFormatContext *fmt_ctx = NULL;
+  if (avformat_open_input(&fmt_ctx, video_path.c_str(), NULL, NULL) != 0) {
+    return false;
+  }
+  std::cout << "[VideoDecoder::ScanIndex] Indexing " << video_path
+            << std::endl;
+  frame_index.clear();
+  AVPacket packet;
+  av_init_packet(&packet);
+  packet.data = NULL;
+  packet.size = 0;
+  while (av_read_frame(fmt_ctx, &packet) == 0) {
+    if (packet.stream_index == video_stream_idx) {
+      int64_t pts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+      frame_index.push_back(
+          {pts, packet.dts, (packet.flags & AV_PKT_FLAG_KEY) ? 1u : 0u, 0});
+    }
+    av_packet_unref(&packet);
+  }
+  avformat_close_input(&fmt_ctx);
+  std::stable_sort(frame_index.begin(), frame_index.end(),
+                   [](const VideoIndexEntry &a, const VideoIndexEntry &b) {
+                     return a.pts < b.pts;
+                   });
+  return !frame_index.empty();
+}
+
+void VideoDecoder::SaveIndex(const std::string &index_path,
+                             const struct stat &video_stat) {
+  VideoIndexHeader header;
+  header.frame_count = frame_index.size();
+  header.video_size = video_stat.st_size;
+  header.video_mtime = video_stat.st_mtime;
+  FILE *file = fopen(index_path.c_str(), "wb");
+  bool ok = file != NULL && fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(frame_index.data(), sizeof(VideoIndexEntry),
+                   frame_index.size(), file) == frame_index.size();
+  if (file != NULL && fclose(file) != 0) {
+    ok = false;
+  }
+  if (!ok) {
+    std::cerr << "[VideoDecoder::SaveIndex] Failed to write " << index_path
+              << std::endl;
+    remove(index_path.c_str());
+  }
+}
+
+/**
+ * Moves to the keyframe at or before frame. The frames between the keyframe
+ * and frame are decoded and dropped by the next GetFrame. Needs an index.
+ */
+int VideoDecoder::Seek(int frame) {
+  if (frame < 0 || frame >= (int)frame_index.size()) {
+    std::cerr << "[VideoDecoder::Seek] No frame " << frame << std::endl;
+    return AVERROR(EINVAL);
+  }
+  int keyframe = frame;
+  while (keyframe > 0 && !frame_index[keyframe].keyframe) {
+    keyframe--;
+  }
+  // Demuxers seek by decode timestamp where they have one.
+  const VideoIndexEntry &entry = frame_index[keyframe];
+  int64_t timestamp = entry.dts != AV_NOPTS_VALUE ? entry.dts : entry.pts;
+  int ret = av_seek_frame(source_format_ctx, video_stream_idx, timestamp,
+                          AVSEEK_FLAG_BACKWARD);
+  if (ret < 0) {
+    std::array<char, 256> err_buf;
+    av_make_error_string(err_buf.data(), err_buf.size(), ret);
+    std::cerr << "[VideoDecoder::Seek] Seek failed; " << err_buf.data()
+              << std::endl;
+    return ret;
+  }
+  avcodec_flush_buffers(source_codec_ctx);
+  draining = false;
+  seek_pts = frame_index[frame].pts;
+  next_frame = frame;
+  return 0;
+}
@@ -11,11 +11,42 @@ extern "C" {
 #include <libswscale/swscale.h>
 }
 
+#include <sys/stat.h>
+
+#include <algorithm>
 #include <array>
 #include <chrono>
+#include <cstdint>
+#include <cstdio>
 #include <iomanip>
 #include <iostream>
+#include <string>
 #include <thread>
+#include <vector>
+
+/**
+ * Sidecar file caching a video's frame index, written next to the video as
+ * <video>.index. It is rebuilt when the video's size or modification time
+ * change. The header is followed by frame_count VideoIndexEntry.
+ */
+struct VideoIndexHeader {
+  static const uint64_t MAGIC = 0x3158444944495646;  // "FVIDIDX1"
+  static const uint32_t VERSION = 1;
+
+  uint64_t magic = MAGIC;
+  uint32_t version = VERSION;
+  uint32_t frame_count = 0;
+  int64_t video_size = 0;
+  int64_t video_mtime = 0;
+};
+
+/** One frame, in presentation order. */
+struct VideoIndexEntry {
+  int64_t pts;
+  int64_t dts;
+  uint32_t keyframe;
+  uint32_t reserved;
+};
 
 class VideoDecoder {
  public:
@@ -30,11 +61,35 @@ class VideoDecoder {
   void OpenVideo(std::string video_path);
   void OpenVideo(AVIOContext *);
   int GetFrame(AVFrame *target_frame, AVPixelFormat pixel_format);
+  bool OpenIndex();
+  int Seek(int frame);
+  int GetFrameCount() { return frame_index.size(); }
+  // Frame that the next GetFrame returns, -1 without an index.
+  int GetNextFrame() { return next_frame; }
+  // With an index, GetFrame restarts from the first frame at the end of the
+  // video instead of returning AVERROR_EOF. Timestamps keep increasing by
+  // the video's duration on every loop.
+  bool loop = false;
 
  private:
+  std::string video_path;
   AVPixelFormat target_pixel_format = AV_PIX_FMT_NONE;
   AVFrame *source_frame = NULL;
   AVPacket source_packet;
+  std::vector<VideoIndexEntry> frame_index;
+  int next_frame = -1;
+  // Decoded frames before this pts are dropped after a seek.
+  int64_t seek_pts = AV_NOPTS_VALUE;
+  // The decoder was sent the flush packet at the end of the video.
+  bool draining = false;
+  // Added to the timestamps of returned frames.
+  int64_t pts_offset = 0;
+  int64_t loop_duration = 0;
   int OpenCodecContext(int *stream_idx, AVCodecContext **dec_ctx,
                        AVFormatContext *fmt_ctx, enum AVMediaType type);
+  bool IsBeforeSeekTarget();
+  void ConvertFrame(AVFrame *target_frame);
+  bool LoadIndex(const std::string &index_path, const struct stat &video_stat);
+  bool ScanIndex();
+  void SaveIndex(const std::string &index_path, const struct stat &video_stat);
 };
\ No newline at end of file
@@ -1,6 +1,6 @@
 #include "video_server.h"
 
-VideoServer::VideoServer() {
+VideoServer::VideoServer() : m_session_executor(SESSION_WORKER_THREADS) {
   using namespace std;
   using websocketpp::lib::bind;
   using websocketpp::lib::placeholders::_1;
@@ -11,9 +11,12 @@ VideoServer::VideoServer() {
   m_server.set_open_handler(bind(&VideoServer::on_open, this, _1));
   m_server.set_close_handler(bind(&VideoServer::on_close, this, _1));
   m_server.set_message_handler(bind(&VideoServer::on_message, this, _1, _2));
+  m_server.set_http_handler(bind(&VideoServer::on_http, this, _1));
+  m_server.set_pong_handler(bind(&VideoServer::on_pong, this, _1, _2));
   m_server.set_access_channels(websocketpp::log::alevel::none);
   m_server.set_error_channels(websocketpp::log::elevel::all);
   m_next_sessionid = 1;
+  m_catalog.Start();
 }
 
 VideoServer::~VideoServer() {}
@@ -46,56 +49,210 @@ void VideoServer::InitializeConnectionData(websocketpp::connection_hdl hdl,
                                            connection_data *data,
                                            std::string video_request) {
   std::cout << "Client requested" << video_request << std::endl;
-  if (data->thread != NULL) {
+  if (data->source_pipeline != NULL) {
     std::cerr << "Connection already initialized" << std::endl;
     return;
   }
-  std::string video_filename = "1080p_videos/" + video_request + ".mp4";
-  {
-    // Check for file existance.
-    std::ifstream f(video_filename);
-    if (!f.good()) {
-      std::cerr << "Cannot find " << video_filename << std::endl;
-      return;
-    }
+  VideoCatalog::VideoInfo video;
+  if (!m_catalog.Find(video_request, &video)) {
+    std::cerr << "Cannot find " << video_request << std::endl;
+    return;
   }
-  OpenCLManager *cl_manager = data->cl_manager = new OpenCLManager();
-  cl_manager->InitializeContext();
-  data->video_decoder = new VideoDecoder();
-  data->sat_encoder = new SATEncoder(data->cl_manager);
+  data->source_pipeline = GetSourcePipeline(video);
+  if (data->source_pipeline == NULL) {
+    return;
+  }
+  if ((data->source_pipeline->low_rank || data->source_pipeline->lattice ||
+       data->source_pipeline->yuv420) &&
+      data->gaze_candidates > 1) {
+    // Every candidate would need its own reduced SAT, and the candidates
+    // kernel only samples RGB SATs.
+    std::cerr << "Gaze candidates are only supported with full RGB SATs"
+              << std::endl;
+    data->gaze_candidates = 1;
+  }
+  data->histograms = m_metrics.AddSession(data->sessionid);
+  data->cl_manager = new OpenCLManager();
+  data->cl_manager->queue_properties = CL_QUEUE_PROFILING_ENABLE;
+  data->cl_manager->InitializeContext(OpenCLManager::GetSharedManager());
   data->sat_decoder = new SATDecoder(data->cl_manager);
+  if (data->source_pipeline->lattice) {
+    data->sat_encoder = new SATEncoder(data->cl_manager);
+  }
+
+  // Clients rebuild frames at the source size, so tell them before the
+  // first fragment.
+  nlohmann::json video_info;
+  video_info["type"] = "videoInfo";
+  video_info["video"] = video.name;
+  video_info["width"] = video.width;
+  video_info["height"] = video.height;
+  video_info["frameRate"] = video.frame_rate;
+  video_info["frameCount"] = video.frame_count;
+  try {
+    m_server.send(hdl, video_info.dump(), websocketpp::frame::opcode::text);
+  } catch (websocketpp::exception const &e) {
+    std::cerr << "Websocket send failed: "
+              << "(" << e.what() << ")" << std::endl;
+  }
+
+  AllocateOutputs(data);
+  for (int i = 0; i < OUTPUT_FRAME_COUNT; i++) {
+    data->free_outputs.Push(i);
+  }
+  av_init_packet(&data->out_packet);
+  data->out_packet.size = 0;
+  data->out_packet.data = NULL;
+  InitializeMuxer(hdl, data);
 
-  data->video_decoder->OpenVideo(video_filename.c_str());
-  AVCodecContext *source_codec_ctx = data->video_decoder->source_codec_ctx;
+  // Each release from the scheduler queues a sample step for this session.
+  m_frame_scheduler.AddSession(
+      data->sessionid, data->source_pipeline->frame_rate,
+      [this, hdl, data] {
+        PostSessionStep(hdl, data, &VideoServer::SampleStep,
+                        SessionExecutor::clock::now());
+      });
+}
+
+/**
+ * Creates the encoder, output frames and sampling grid at the resolution of
+ * the session's current ladder rung.
+ */
+void VideoServer::AllocateOutputs(connection_data *data) {
+  ResolutionLadder::Rung rung = data->resolution_ladder.GetRung();
+  AVCodecContext *source_codec_ctx =
+      data->source_pipeline->video_decoder->source_codec_ctx;
   AVCodecContext output_codec_ctx = *source_codec_ctx;
-  output_codec_ctx.width = REDUCED_BUFFER_WIDTH;
-  output_codec_ctx.height = REDUCED_BUFFER_HEIGHT;
-  data->video_encoder = new VideoEncoder(&output_codec_ctx);
-
-  data->rgb_frame = av_frame_alloc();
-  data->output_frame = av_frame_alloc();
-  data->output_frame->format = AV_PIX_FMT_RGB0;
-  data->output_frame->width = REDUCED_BUFFER_WIDTH;
-  data->output_frame->height = REDUCED_BUFFER_HEIGHT;
-  av_frame_get_buffer(data->output_frame, 1);
-  int attempts = 0;
-  int ret = -1;
-  int width = source_codec_ctx->width;
-  int height = source_codec_ctx->height;
-  data->thread = new std::thread(&VideoServer::SendFrameLoop, this, hdl, data);
+  output_codec_ctx.width = rung.width;
+  output_codec_ctx.height = rung.height;
+  data->video_encoder = m_catalog.TakeEncoder(&output_codec_ctx);
+  data->sat_decoder->InitializeGrid(rung.width, rung.height,
+                                    source_codec_ctx->width,
+                                    source_codec_ctx->height);
+
+  for (int i = 0; i < OUTPUT_FRAME_COUNT; i++) {
+    AVFrame *output_frame = av_frame_alloc();
+    output_frame->width = rung.width;
+    output_frame->height = rung.height;
+    if (data->source_pipeline->yuv420) {
+      // Planes packed as sample_rect_yuv420_kernel writes them, so that the
+      // frame is read back in one piece and encoded without conversion.
+      output_frame->format = AV_PIX_FMT_YUV420P;
+      output_frame->buf[0] = av_buffer_alloc(GetOutputFrameSize(output_frame));
+      av_image_fill_arrays(output_frame->data, output_frame->linesize,
+                           output_frame->buf[0]->data, AV_PIX_FMT_YUV420P,
+                           rung.width, rung.height, 1);
+    } else {
+      output_frame->format = AV_PIX_FMT_RGB0;
+      av_frame_get_buffer(output_frame, 1);
+    }
+    data->output_frames.push_back(output_frame);
+    data->cl_output_buffers.push_back(
+        cl::Buffer(data->cl_manager->context, CL_MEM_READ_WRITE,
+                   data->gaze_candidates * GetOutputFrameSize(output_frame)));
+    if (data->gaze_candidates > 1) {
+      data->cl_candidate_centers.push_back(
+          cl::Buffer(data->cl_manager->context, CL_MEM_READ_ONLY,
+                     data->gaze_candidates * sizeof(cl_float2)));
+    }
+  }
+  data->candidate_centers.resize(OUTPUT_FRAME_COUNT * MAX_GAZE_CANDIDATES);
+  if (data->source_pipeline->low_rank || data->source_pipeline->lattice) {
+    // Three channel sums and the source position per grid point.
+    data->cl_reduced_sat_buffer = cl::Buffer(
+        data->cl_manager->context, CL_MEM_READ_WRITE,
+        5 * sizeof(float) * (rung.width + 1) * (rung.height + 1));
+  }
+}
+
+/** Bytes of an output frame, whose planes have no padding. */
+size_t VideoServer::GetOutputFrameSize(AVFrame *output_frame) {
+  return av_image_get_buffer_size((AVPixelFormat)output_frame->format,
+                                  output_frame->width, output_frame->height,
+                                  1);
+}
+
+void VideoServer::FreeOutputs(connection_data *data) {
+  delete data->video_encoder;
+  data->video_encoder = NULL;
+  for (AVFrame *output_frame : data->output_frames) {
+    av_frame_free(&output_frame);
+  }
+  data->output_frames.clear();
+  data->cl_output_buffers.clear();
+  data->cl_candidate_centers.clear();
+  data->cl_reduced_sat_buffer = cl::Buffer();
 }
 
+/**
+ * Returns the pipeline decoding the video, creating it if no session is
+ * watching that video yet. The pipeline is destroyed with its last session,
+ * and its decoder goes back to the catalog.
+ * All sessions of a video share one playback position.
+ */
+std::shared_ptr<SourcePipeline> VideoServer::GetSourcePipeline(
+    const VideoCatalog::VideoInfo &video) {
+  using namespace std::chrono;
+  std::lock_guard<std::mutex> lock(m_source_pipelines_mutex);
+  std::shared_ptr<SourcePipeline> pipeline =
+      m_source_pipelines[video.name].lock();
+  if (pipeline == NULL) {
+    steady_clock::time_point now = steady_clock::now();
+    steady_clock::time_point playback_start =
+        m_playback_starts.emplace(video.name, now).first->second;
+    std::string name = video.name;
+    pipeline = std::shared_ptr<SourcePipeline>(
+        new SourcePipeline(video.path, m_metrics.GetGlobal(),
+                           duration<double>(now - playback_start).count(),
+                           m_catalog.TakeDecoder(name)),
+        [this, name](SourcePipeline *pipeline) {
+          pipeline->Stop();
+          VideoDecoder *decoder = pipeline->video_decoder;
+          pipeline->video_decoder = NULL;
+          delete pipeline;
+          m_catalog.ReturnDecoder(name, decoder);
+        });
+    if (!pipeline->IsOpen()) {
+      m_source_pipelines.erase(video.name);
+      return NULL;
+    }
+    m_source_pipelines[video.name] = pipeline;
+  }
+  return pipeline;
+}
+
+/**
+ * Closes the session. Queued steps return immediately once closing is set,
+ * and whichever of the connection and its steps lets go of the session last
+ * frees it, so the event loop never waits for a running step.
+ */
 void VideoServer::DestroyConnectionData(websocketpp::connection_hdl hdl) {
   connection_data *data = GetConnectionDataFromHdl(hdl);
-  data->exit_thread = true;
-  data->kill_thread_mutex.lock();
-  delete data->video_decoder;
+  data->closing = true;
+  // No new sample steps are posted once the session is removed.
+  m_frame_scheduler.RemoveSession(data->sessionid);
+  ReleaseConnectionData(data);
+}
+
+/** Drops one hold on the session and frees it with the last one. */
+void VideoServer::ReleaseConnectionData(connection_data *data) {
+  if (--data->pending_steps > 0) {
+    return;
+  }
+  m_metrics.RemoveSession(data->sessionid);
+  if (data->cl_manager != NULL) {
+    clFinish(data->cl_manager->command_queue());
+  }
+  data->sampled_frames.clear();
+  if (data->out_fmt_ctx != NULL) {
+    FreeMuxer(data);
+  }
+  av_packet_unref(&data->out_packet);
+  FreeOutputs(data);
   delete data->sat_decoder;
   delete data->sat_encoder;
-  delete data->video_encoder;
   delete data->cl_manager;
-  av_frame_free(&data->rgb_frame);
-  av_frame_free(&data->output_frame);
+  data->source_pipeline.reset();
   delete data;
 }
 
@@ -109,9 +266,43 @@ void VideoServer::on_message(websocketpp::connection_hdl hdl,
   if (received_arr["type"] == "text") {
     HandleTextMessage(hdl, received_arr);
   } else if (received_arr["type"] == "frameRequest") {
-    new std::thread(&VideoServer::HandleFrameRequest, this, hdl, received_arr);
+    HandleFrameRequest(hdl, received_arr);
   } else if (received_arr["type"] == "videoRequest") {
     connection_data *data = GetConnectionDataFromHdl(hdl);
+    if (data->source_pipeline != NULL) {
+      // The session's steps read these settings without locking, and the
+      // client expects one stream format for the whole session.
+      std::cerr << "Ignoring repeated videoRequest from session "
+                << data->sessionid << std::endl;
+      return;
+    }
+    data->send_acks = received_arr.value("acks", false);
+    // Clients ask for the highest envelope version they can read.
+    data->envelope_version = std::min<int>(received_arr.value("envelope", 0),
+                                           FrameEnvelope::VERSION);
+    // Only clients that rebuild their demuxer and decoder on a new
+    // INIT_SEGMENT envelope can follow a change of output size. Others stay
+    // at the start rung for the whole session.
+    if (!received_arr.value("resize", false) || data->envelope_version == 0) {
+      std::vector<ResolutionLadder::Rung> rungs =
+          ResolutionLadder::DefaultRungs();
+      data->resolution_ladder =
+          ResolutionLadder({rungs[ResolutionLadder::DefaultStartRung()]}, 0);
+    }
+    data->gaze_candidates = std::min(
+        std::max(received_arr.value("gazeCandidates", DEFAULT_GAZE_CANDIDATES),
+                 1),
+        MAX_GAZE_CANDIDATES);
+    std::string predictor_name =
+        received_arr.value("gazePredictor", DEFAULT_GAZE_PREDICTOR);
+    GazePredictor::Type predictor_type = GazePredictor::NONE;
+    if (!GazePredictor::ParseType(predictor_name, &predictor_type)) {
+      std::cerr << "Unknown gaze predictor " << predictor_name << std::endl;
+    }
+    {
+      std::lock_guard<std::mutex> lock(data->gaze_predictor_mutex);
+      data->gaze_predictor.reset(GazePredictor::Create(predictor_type));
+    }
     InitializeConnectionData(hdl, data, received_arr["video"]);
   }
 }
@@ -122,6 +313,61 @@ void VideoServer::on_close(websocketpp::connection_hdl hdl) {
   m_connections.erase(hdl);
 }
 
+/**
+ * Serves the stage latency summaries and scheduler counters in the
+ * Prometheus text format at /metrics.
+ */
+void VideoServer::on_http(websocketpp::connection_hdl hdl) {
+  server::connection_ptr con = m_server.get_con_from_hdl(hdl);
+  if (con->get_resource() == "/videos") {
+    nlohmann::json videos = nlohmann::json::array();
+    for (const VideoCatalog::VideoInfo &video : m_catalog.List()) {
+      videos.push_back({{"name", video.name},
+                        {"width", video.width},
+                        {"height", video.height},
+                        {"frameRate", video.frame_rate},
+                        {"frameCount", video.frame_count}});
+    }
+    con->set_status(websocketpp::http::status_code::ok);
+    con->append_header("Content-Type", "application/json");
+    con->set_body(videos.dump());
+    return;
+  }
+  if (con->get_resource() != "/metrics") {
+    con->set_status(websocketpp::http::status_code::not_found);
+    return;
+  }
+  std::ostringstream frames, misses, skipped, rtts;
+  for (auto &connection : m_connections) {
+    int session_id = connection.second->sessionid;
+    FrameScheduler::SessionStats stats =
+        m_frame_scheduler.GetSessionStats(session_id);
+    std::string labels = "{session=\"" + std::to_string(session_id) + "\"} ";
+    frames << "foveated_session_frames_total" << labels << stats.frame_count
+           << "\n";
+    misses << "foveated_session_deadline_misses_total" << labels
+           << stats.deadline_misses << "\n";
+    skipped << "foveated_session_skipped_frames_total" << labels
+            << stats.skipped_frames << "\n";
+    int64_t rtt_us = connection.second->rtt_us;
+    if (rtt_us >= 0) {
+      rtts << "foveated_session_rtt_seconds" << labels << rtt_us / 1e6
+           << "\n";
+    }
+  }
+  std::ostringstream body;
+  body << m_metrics.ToPrometheusText();
+  body << "# TYPE foveated_session_frames_total counter\n" << frames.str();
+  body << "# TYPE foveated_session_deadline_misses_total counter\n"
+       << misses.str();
+  body << "# TYPE foveated_session_skipped_frames_total counter\n"
+       << skipped.str();
+  body << "# TYPE foveated_session_rtt_seconds gauge\n" << rtts.str();
+  con->set_status(websocketpp::http::status_code::ok);
+  con->append_header("Content-Type", "text/plain; version=0.0.4");
+  con->set_body(body.str());
+}
+
 void VideoServer::Run(uint16_t port) {
   m_server.listen(port);
   std::cout << "Listening on port " << port << std::endl;
@@ -163,19 +409,196 @@ void VideoServer::HandleTextMessage(websocketpp::connection_hdl hdl,
   }
 }
 
+/**
+ * Runs on the websocket thread. Publishes the gaze to the session's slot
+ * without blocking on the send loop.
+ */
 void VideoServer::HandleFrameRequest(websocketpp::connection_hdl hdl,
                                      nlohmann::json received_arr) {
-  // std::cout << "-------------Handle frame request received--------------" <<
-  // std::endl;
   connection_data *conn_data = GetConnectionDataFromHdl(hdl);
-  conn_data->center_xy_mutex.lock();
-  conn_data->center_x = received_arr["centerX"].get<double>();
-  conn_data->center_y = received_arr["centerY"].get<double>();
-  conn_data->center_xy_mutex.unlock();
-  // Acknowledge that this information has been processed
+  int64_t timestamp_us = GetTimestampUs();
+  conn_data->gaze_slot.Write(received_arr["centerX"].get<double>(),
+                             received_arr["centerY"].get<double>(),
+                             timestamp_us,
+                             received_arr["packetNumber"].get<int64_t>());
+  std::lock_guard<std::mutex> lock(conn_data->gaze_predictor_mutex);
+  if (conn_data->gaze_predictor != NULL) {
+    conn_data->gaze_predictor->AddSample(
+        timestamp_us / 1e6, received_arr["centerX"].get<double>(),
+        received_arr["centerY"].get<double>());
+  }
+}
+
+/**
+ * Replaces the gaze with the prediction for when the frame sampled now is
+ * displayed. Samples are half a round trip old when they arrive, and the
+ * frame takes the pipeline delay plus another half round trip to reach the
+ * client. elapsed_us is the part of the pipeline delay already spent since
+ * the frame's release.
+ */
+void VideoServer::PredictGaze(connection_data *conn_data,
+                              GazeSlot::Sample *gaze, int64_t elapsed_us) {
+  int64_t horizon_us =
+      std::max<int64_t>(conn_data->pipeline_delay_us - elapsed_us, 0) +
+      std::max<int64_t>(conn_data->rtt_us, 0);
+  std::lock_guard<std::mutex> lock(conn_data->gaze_predictor_mutex);
+  if (conn_data->gaze_predictor == NULL || gaze->packet_number < 0) {
+    return;
+  }
+  conn_data->gaze_predictor->Predict((GetTimestampUs() + horizon_us) / 1e6,
+                                     &gaze->center_x, &gaze->center_y);
+}
+
+/**
+ * Fills centers with up to gaze_candidates gaze positions to sample: the
+ * predicted gaze, the current gaze if the prediction moved it, then the
+ * predicted gaze moved GAZE_CANDIDATE_SPREAD along and across the predicted
+ * motion. Returns the number of centers.
+ */
+int VideoServer::ChooseGazeCandidates(connection_data *conn_data,
+                                      const GazeSlot::Sample &gaze,
+                                      const GazeSlot::Sample &predicted,
+                                      cl_float2 *centers) {
+  double motion_x = predicted.center_x - gaze.center_x;
+  motion_x -= std::floor(motion_x + 0.5);
+  double motion_y = predicted.center_y - gaze.center_y;
+  double motion = std::hypot(motion_x, motion_y);
+  double along_x = 1.0, along_y = 0.0;
+  if (motion > 1e-6) {
+    along_x = motion_x / motion;
+    along_y = motion_y / motion;
+  }
+  const double offsets[4][2] = {{along_x, along_y},
+                                {-along_x, -along_y},
+                                {-along_y, along_x},
+                                {along_y, -along_x}};
+  int count = 0;
+  centers[count++] = {predicted.center_x, predicted.center_y};
+  if (motion > 1e-6) {
+    centers[count++] = {gaze.center_x, gaze.center_y};
+  }
+  for (int i = 0; i < 4 && count < conn_data->gaze_candidates; i++) {
+    double x = predicted.center_x + GAZE_CANDIDATE_SPREAD * offsets[i][0];
+    double y = predicted.center_y + GAZE_CANDIDATE_SPREAD * offsets[i][1];
+    centers[count++] = {(float)(x - std::floor(x)),
+                        (float)std::min(std::max(y, 0.0), 1.0)};
+  }
+  return std::min(count, conn_data->gaze_candidates);
+}
+
+/**
+ * Enqueues the readback of the given candidate's frame and makes its center
+ * the frame's gaze.
+ */
+void VideoServer::ReadBackCandidate(connection_data *conn_data,
+                                    sampled_frame *sampled, int candidate) {
+  AVFrame *output_frame = conn_data->output_frames[sampled->output_index];
+  size_t frame_size = GetOutputFrameSize(output_frame);
+  cl_int ret = conn_data->cl_manager->command_queue.enqueueReadBuffer(
+      conn_data->cl_output_buffers[sampled->output_index], CL_FALSE,
+      candidate * frame_size, frame_size, output_frame->data[0], NULL,
+      &sampled->readback_event);
+  if (ret != CL_SUCCESS) {
+    std::cerr << "Failed to copy output frame out. " << ret << " "
+              << OpenCLManager::GetCLErrorString(ret) << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  clFlush(conn_data->cl_manager->command_queue());
+  if (sampled->candidate_count > 1) {
+    const cl_float2 &center =
+        conn_data->candidate_centers[sampled->output_index *
+                                         MAX_GAZE_CANDIDATES +
+                                     candidate];
+    sampled->metadata.center_x = center.s[0];
+    sampled->metadata.center_y = center.s[1];
+  }
+}
+
+/**
+ * Reads back the candidate nearest the gaze predicted from the freshest
+ * sample, for the display time of the frame.
+ */
+void VideoServer::SelectGazeCandidate(connection_data *conn_data,
+                                      sampled_frame *sampled) {
+  using namespace std::chrono;
+  GazeSlot::Sample gaze = conn_data->gaze_slot.Read();
+  int64_t elapsed_us = duration_cast<microseconds>(
+                           FrameScheduler::clock::now() - sampled->release_time)
+                           .count();
+  PredictGaze(conn_data, &gaze, elapsed_us);
+  const cl_float2 *centers =
+      &conn_data->candidate_centers[sampled->output_index *
+                                    MAX_GAZE_CANDIDATES];
+  // Compare in degrees, narrowing x towards the poles.
+  double x_scale = 360.0 * std::cos((gaze.center_y - 0.5) * M_PI);
+  int selected = 0;
+  double selected_distance = INFINITY;
+  for (int i = 0; i < sampled->candidate_count; i++) {
+    double delta_x = centers[i].s[0] - gaze.center_x;
+    delta_x -= std::floor(delta_x + 0.5);
+    double distance = std::hypot(delta_x * x_scale,
+                                 (centers[i].s[1] - gaze.center_y) * 180.0);
+    if (distance < selected_distance) {
+      selected = i;
+      selected_distance = distance;
+    }
+  }
+  ReadBackCandidate(conn_data, sampled, selected);
+}
+
+/** Pings the client about once a second to measure the round trip. */
+void VideoServer::SendPing(websocketpp::connection_hdl hdl,
+                           connection_data *conn_data) {
+  int64_t now_us = GetTimestampUs();
+  if (now_us - conn_data->last_ping_us < 1000000) {
+    return;
+  }
+  conn_data->last_ping_us = now_us;
+  try {
+    m_server.ping(hdl, std::to_string(now_us));
+  } catch (websocketpp::exception const &e) {
+    std::cerr << "Websocket ping failed: "
+              << "(" << e.what() << ")" << std::endl;
+  }
+}
+
+void VideoServer::on_pong(websocketpp::connection_hdl hdl,
+                          std::string payload) {
+  connection_data *conn_data = GetConnectionDataFromHdl(hdl);
+  int64_t sent_us = 0;
+  try {
+    sent_us = std::stoll(payload);
+  } catch (std::exception const &e) {
+    return;
+  }
+  int64_t rtt_us = GetTimestampUs() - sent_us;
+  int64_t smoothed_us = conn_data->rtt_us;
+  conn_data->rtt_us =
+      smoothed_us < 0 ? rtt_us : (7 * smoothed_us + rtt_us) / 8;
+}
+
+/** Microseconds of steady_clock, as used for gaze and envelope timestamps. */
+int64_t VideoServer::GetTimestampUs() {
+  using namespace std::chrono;
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/**
+ * Acknowledges the latest frameRequest processed by the send loop, if the
+ * client asked for acks and there is something new to acknowledge.
+ */
+void VideoServer::SendAck(websocketpp::connection_hdl hdl,
+                          connection_data *conn_data,
+                          int64_t packet_number) {
+  if (!conn_data->send_acks || packet_number < 0 ||
+      packet_number == conn_data->last_acked_packet_number) {
+    return;
+  }
+  conn_data->last_acked_packet_number = packet_number;
   nlohmann::json to_return;
   to_return["type"] = "ack";
-  to_return["packetNumber"] = received_arr["packetNumber"].get<int32_t>();
+  to_return["packetNumber"] = packet_number;
   try {
     m_server.send(hdl, to_return.dump(), websocketpp::frame::opcode::text);
   } catch (websocketpp::exception const &e) {
@@ -184,79 +607,476 @@ void VideoServer::HandleFrameRequest(websocketpp::connection_hdl hdl,
   }
 }
 
-int VideoServer::WritePacket(void *opaque, uint8_t *buf, int buf_size) {
-  IOOutput *out = reinterpret_cast<IOOutput *>(opaque);
-  if (buf_size + out->bytesSet < out->maxSize) {
-    memcpy(out->outBuffer + out->bytesSet, buf, buf_size);
-    out->bytesSet += buf_size;
-    return buf_size;
+void VideoServer::PostSessionStep(websocketpp::connection_hdl hdl,
+                                  connection_data *conn_data,
+                                  session_step step,
+                                  SessionExecutor::clock::time_point deadline,
+                                  SessionExecutor::clock::duration delay) {
+  conn_data->pending_steps++;
+  m_session_executor.PostAfter(delay, deadline,
+                               [this, hdl, conn_data, step] {
+                                 if (!conn_data->closing) {
+                                   (this->*step)(hdl, conn_data);
+                                 }
+                                 ReleaseConnectionData(conn_data);
+                               });
+}
+
+/**
+ * Runs when the frame scheduler releases the session. Samples the latest SAT
+ * at the latest gaze and starts an asynchronous readback for the encode step.
+ * Once the video ends the last frame is resampled so the foveation still
+ * follows the gaze. Only one sample step runs at a time per session.
+ */
+void VideoServer::SampleStep(websocketpp::connection_hdl hdl,
+                             connection_data *conn_data) {
+  // If the previous sample step is still running, leave the release to be
+  // counted as skipped.
+  std::unique_lock<std::mutex> sample_lock(conn_data->sample_mutex,
+                                           std::try_to_lock);
+  if (!sample_lock.owns_lock()) {
+    return;
+  }
+  int ret = -1;
+  SourcePipeline *source_pipeline = conn_data->source_pipeline.get();
+  OpenCLManager *cl_manager = conn_data->cl_manager;
+  AVCodecContext *source_codec_ctx =
+      source_pipeline->video_decoder->source_codec_ctx;
+  SATDecoder *sat_decoder = conn_data->sat_decoder;
+
+  std::shared_ptr<const SourcePipeline::SATFrame> sat_frame =
+      source_pipeline->GetLatestFrame();
+  if (sat_frame == NULL) {
+    return;
+  }
+  // If the encode step is behind or the outputs are being resized, leave
+  // the release to be counted as skipped.
+  int output_index = -1;
+  if (conn_data->resize_pending ||
+      !conn_data->free_outputs.TryPop(&output_index)) {
+    return;
+  }
+  FrameScheduler::clock::time_point release_time, deadline;
+  if (!m_frame_scheduler.TakeRelease(conn_data->sessionid, &release_time,
+                                     &deadline)) {
+    conn_data->free_outputs.Push(output_index);
+    return;
   }
-  return 0;
+  AVFrame *output_frame = conn_data->output_frames[output_index];
+  cl::Buffer &cl_output_buffer = conn_data->cl_output_buffers[output_index];
+
+  // Grab the latest gaze position.
+  GazeSlot::Sample current_gaze = conn_data->gaze_slot.Read();
+  GazeSlot::Sample gaze = current_gaze;
+  PredictGaze(conn_data, &gaze);
+  double center_x = gaze.center_x;
+  double center_y = gaze.center_y;
+  SendAck(hdl, conn_data, gaze.packet_number);
+
+  // Sample from the summed area table based on the gaze position.
+  sampled_frame sampled;
+  if (source_pipeline->low_rank) {
+    float delta_range[3] = {sat_frame->delta_range[0],
+                            sat_frame->delta_range[1],
+                            sat_frame->delta_range[2]};
+    float channel_mean[3] = {sat_frame->channel_mean[0],
+                             sat_frame->channel_mean[1],
+                             sat_frame->channel_mean[2]};
+    sat_decoder->CreateReducedSAT(
+        conn_data->cl_reduced_sat_buffer(), output_frame->width,
+        output_frame->height, sat_frame->residual_buffer(),
+        source_pipeline->width, source_pipeline->height,
+        sat_frame->residual_linesize, sat_frame->u_buffer(),
+        sat_frame->v_buffer(), sat_frame->sv_buffer(), center_x, center_y,
+        sat_frame->rank, delta_range, &sampled.reduce_event);
+    sat_decoder->SampleFrameFromReducedSAT(
+        cl_output_buffer(), output_frame->width, output_frame->height,
+        output_frame->linesize[0], conn_data->cl_reduced_sat_buffer(),
+        channel_mean, &sampled.sample_event);
+  } else if (source_pipeline->lattice) {
+    conn_data->sat_encoder->EncodeLatticeGPU(
+        conn_data->cl_reduced_sat_buffer(), sat_decoder->GetGridBuffer(),
+        output_frame->width, output_frame->height, sat_frame->frame_buffer(),
+        source_pipeline->width, source_pipeline->height,
+        sat_frame->frame_linesize, center_x, center_y,
+        &sampled.reduce_start_event(), &sampled.reduce_event());
+    sat_decoder->SampleFrameFromLatticeSAT(
+        cl_output_buffer(), output_frame->width, output_frame->height,
+        output_frame->linesize[0], conn_data->cl_reduced_sat_buffer(),
+        &sampled.sample_event);
+  } else if (source_pipeline->yuv420) {
+    sat_decoder->SampleFrameRectYUV420GPU(
+        cl_output_buffer(), output_frame->width, output_frame->height,
+        sat_frame->sat_buffer(), source_pipeline->width,
+        source_pipeline->height, center_x, center_y, &sampled.sample_event);
+  } else if (conn_data->gaze_candidates > 1) {
+    cl_float2 *centers =
+        &conn_data->candidate_centers[output_index * MAX_GAZE_CANDIDATES];
+    sampled.candidate_count =
+        ChooseGazeCandidates(conn_data, current_gaze, gaze, centers);
+    cl::Buffer &cl_centers = conn_data->cl_candidate_centers[output_index];
+    ret = cl_manager->command_queue.enqueueWriteBuffer(
+        cl_centers, CL_FALSE, 0, sampled.candidate_count * sizeof(cl_float2),
+        centers);
+    if (ret != CL_SUCCESS) {
+      std::cerr << "Failed to copy gaze candidates. " << ret << " "
+                << OpenCLManager::GetCLErrorString(ret) << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    sat_decoder->SampleFrameRectCandidatesGPU(
+        cl_output_buffer(), output_frame->width, output_frame->height,
+        output_frame->linesize[0], sat_frame->sat_buffer(), source_codec_ctx,
+        cl_centers(), sampled.candidate_count, &sampled.sample_event);
+  } else {
+    sat_decoder->SampleFrameRectGPU(
+        cl_output_buffer(), output_frame->width, output_frame->height,
+        output_frame->linesize[0], sat_frame->sat_buffer(), source_codec_ctx,
+        center_x, center_y, &sampled.sample_event);
+  }
+  output_frame->pts = sat_frame->pts;
+  output_frame->pkt_dts = sat_frame->pkt_dts;
+
+  sampled.output_index = output_index;
+  sampled.sat_frame = sat_frame;
+  sampled.metadata.center_x = center_x;
+  sampled.metadata.center_y = center_y;
+  sampled.metadata.packet_number = gaze.packet_number;
+  sampled.metadata.capture_timestamp_us = gaze.timestamp_us;
+  sampled.metadata.release_time = release_time;
+  sampled.release_time = release_time;
+  sampled.deadline = deadline;
+  if (sampled.candidate_count > 1) {
+    // The encode step selects a candidate once they are sampled.
+    clFlush(cl_manager->command_queue());
+  } else {
+    ReadBackCandidate(conn_data, &sampled, 0);
+  }
+  {
+    std::lock_guard<std::mutex> lock(conn_data->sampled_frames_mutex);
+    conn_data->sampled_frames.push_back(sampled);
+  }
+  conn_data->encode_requested = true;
+  PostSessionStep(hdl, conn_data, &VideoServer::EncodeStep, deadline);
 }
 
-void VideoServer::SendFrameLoop(websocketpp::connection_hdl hdl,
+/**
+ * Encodes sampled frames in order. Only one worker encodes a session at a
+ * time. A worker that finds the session busy sets encode_requested so the
+ * busy worker checks again before it returns.
+ */
+void VideoServer::EncodeStep(websocketpp::connection_hdl hdl,
+                             connection_data *conn_data) {
+  while (true) {
+    std::unique_lock<std::mutex> encode_lock(conn_data->encode_mutex,
+                                             std::try_to_lock);
+    if (!encode_lock.owns_lock()) {
+      return;
+    }
+    conn_data->encode_requested = false;
+    if (!EncodeSampledFrames(hdl, conn_data)) {
+      return;
+    }
+    if (conn_data->resize_pending && !ResizeOutputs(hdl, conn_data)) {
+      return;
+    }
+    encode_lock.unlock();
+    if (!conn_data->encode_requested) {
+      return;
+    }
+  }
+}
+
+/**
+ * Encodes the sampled frames whose readback has finished. Instead of blocking
+ * on the readback or the encoder, posts another encode step after 1ms and
+ * returns false.
+ */
+bool VideoServer::EncodeSampledFrames(websocketpp::connection_hdl hdl,
+                                      connection_data *conn_data) {
+  using namespace std::chrono;
+  VideoEncoder *video_encoder = conn_data->video_encoder;
+  int ret = -1;
+  const SessionExecutor::clock::duration retry_delay = milliseconds(1);
+
+  while (true) {
+    if (conn_data->awaiting_packet) {
+      ret = video_encoder->GetPacket(&conn_data->out_packet);
+      if ((ret < 0 || conn_data->out_packet.size == 0) &&
+          conn_data->packet_attempts < 20) {
+        conn_data->packet_attempts++;
+        PostSessionStep(hdl, conn_data, &VideoServer::EncodeStep,
+                        SessionExecutor::clock::now(), retry_delay);
+        return false;
+      }
+      conn_data->awaiting_packet = false;
+      SendEncodedFrame(hdl, conn_data, ret, conn_data->metadata_queue.back());
+      continue;
+    }
+
+    sampled_frame sampled;
+    {
+      std::lock_guard<std::mutex> lock(conn_data->sampled_frames_mutex);
+      if (conn_data->sampled_frames.empty()) {
+        return true;
+      }
+      sampled_frame &front = conn_data->sampled_frames.front();
+      cl_int status = CL_QUEUED;
+      if (front.readback_event() == NULL) {
+        // Select as late as possible, once all candidates are sampled.
+        front.sample_event.getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS,
+                                   &status);
+        if (status <= CL_COMPLETE) {
+          SelectGazeCandidate(conn_data, &front);
+        }
+        status = CL_QUEUED;
+      }
+      if (front.readback_event() != NULL) {
+        front.readback_event.getInfo(CL_EVENT_COMMAND_EXECUTION_STATUS,
+                                     &status);
+      }
+      if (status > CL_COMPLETE) {
+        PostSessionStep(hdl, conn_data, &VideoServer::EncodeStep,
+                        conn_data->sampled_frames.front().deadline,
+                        retry_delay);
+        return false;
+      }
+      sampled = conn_data->sampled_frames.front();
+      conn_data->sampled_frames.pop_front();
+    }
+    sampled.sat_frame.reset();
+    int64_t sample_us = OpenCLManager::GetProfiledTimeUs(sampled.sample_event,
+                                                         sampled.sample_event);
+    int64_t readback_us = OpenCLManager::GetProfiledTimeUs(
+        sampled.readback_event, sampled.readback_event);
+    if (sample_us >= 0 && readback_us >= 0) {
+      conn_data->histograms->Record(ServerMetrics::SAMPLE, sample_us);
+      conn_data->histograms->Record(ServerMetrics::READBACK, readback_us);
+    }
+    if (sampled.reduce_event() != NULL) {
+      // The session's own SAT, at its grid points.
+      int64_t reduce_us = OpenCLManager::GetProfiledTimeUs(
+          sampled.reduce_start_event() != NULL ? sampled.reduce_start_event
+                                               : sampled.reduce_event,
+          sampled.reduce_event);
+      if (reduce_us >= 0) {
+        conn_data->histograms->Record(ServerMetrics::SAT, reduce_us);
+      }
+    }
+    m_frame_scheduler.ReportFrameReady(conn_data->sessionid,
+                                       sampled.release_time, sampled.deadline);
+    AVFrame *output_frame = conn_data->output_frames[sampled.output_index];
+
+    // This will be the new gaze position.
+    conn_data->metadata_queue.push(sampled.metadata);
+
+    ServerMetrics::clock::time_point encode_start = ServerMetrics::clock::now();
+    ret = video_encoder->EncodeFrame(&conn_data->out_packet, output_frame);
+    conn_data->histograms->RecordSince(ServerMetrics::ENCODE, encode_start);
+    // The encoder has copied the frame so it can be sampled into again.
+    conn_data->free_outputs.Push(sampled.output_index);
+    if (ret < 0 || conn_data->out_packet.size == 0) {
+      conn_data->awaiting_packet = true;
+      conn_data->packet_attempts = 0;
+      continue;
+    }
+    SendEncodedFrame(hdl, conn_data, ret, conn_data->metadata_queue.back());
+  }
+}
+
+/**
+ * Moves the session to the current rung of its resolution ladder. Collects
+ * the free outputs and, while some are still being sampled, posts another
+ * encode step after 1ms and returns false. Once they are all back, the
+ * frames left in the old encoder are sent, the outputs, encoder and muxer
+ * are rebuilt at the new size, and the new init segment is sent before the
+ * first fragment at that size. Returns false without finishing if the
+ * session closes. Must hold the encode mutex with no frames left to encode.
+ */
+bool VideoServer::ResizeOutputs(websocketpp::connection_hdl hdl,
                                 connection_data *conn_data) {
   using namespace std::chrono;
+  int output_index = -1;
+  while (conn_data->free_outputs.TryPop(&output_index)) {
+    conn_data->held_outputs.push_back(output_index);
+  }
+  if (conn_data->held_outputs.size() < OUTPUT_FRAME_COUNT) {
+    PostSessionStep(hdl, conn_data, &VideoServer::EncodeStep,
+                    SessionExecutor::clock::now(), milliseconds(1));
+    return false;
+  }
+
+  // Frames still inside the old encoder go out before the new init segment,
+  // so every envelope keeps the metadata of its own frame.
+  while (!conn_data->metadata_queue.empty() && !conn_data->closing) {
+    int ret = conn_data->video_encoder->EncodeFrame(&conn_data->out_packet,
+                                                    NULL);
+    if (ret < 0 || conn_data->out_packet.size == 0) {
+      break;
+    }
+    SendEncodedFrame(hdl, conn_data, ret, conn_data->metadata_queue.back());
+  }
+  std::queue<frame_metadata>().swap(conn_data->metadata_queue);
+  if (conn_data->closing) {
+    return false;
+  }
+
+  // No queued kernel may still use the old outputs or grid.
+  clFinish(conn_data->cl_manager->command_queue());
+  FreeOutputs(conn_data);
+  AllocateOutputs(conn_data);
+  // The new encoder starts with a keyframe at the new size, which needs its
+  // own init segment ahead of it.
+  FreeMuxer(conn_data);
+  if (!InitializeMuxer(hdl, conn_data)) {
+    return false;
+  }
+  ResolutionLadder::Rung rung = conn_data->resolution_ladder.GetRung();
+  std::cout << "[VideoServer::ResizeOutputs] Session " << conn_data->sessionid
+            << " now at " << rung.width << "x" << rung.height << " (load "
+            << conn_data->resolution_ladder.GetLoad() << ")" << std::endl;
+
+  for (int held_output : conn_data->held_outputs) {
+    conn_data->free_outputs.Push(held_output);
+  }
+  conn_data->held_outputs.clear();
+  conn_data->resize_pending = false;
+  return true;
+}
+
+/**
+ * Muxes the encoder output to an fMP4 fragment and sends it behind a frame
+ * envelope, or after a JSON image message for clients without envelopes.
+ */
+void VideoServer::SendEncodedFrame(websocketpp::connection_hdl hdl,
+                                   connection_data *conn_data, int ret,
+                                   frame_metadata new_metadata) {
   using json = nlohmann::json;
-  conn_data->kill_thread_mutex.lock();
-  int ret = -1;
   char err_buf[256];
-  int attempts = 0;
-  // high_resolution_clock::time_point start, stop;
-  // high_resolution_clock::time_point loop_start_time, loop_stop_time;
-  high_resolution_clock::time_point checkpoint_time =
-      high_resolution_clock::now();
-  bool continue_loop = true;
-  double elapsed_time;
-
-  VideoDecoder *video_decoder = conn_data->video_decoder;
-  OpenCLManager *cl_manager = conn_data->cl_manager;
+  AVPacket &out_packet = conn_data->out_packet;
+  FragmentSink &fragment_sink = conn_data->fragment_sink;
+  server::connection_ptr con;
+  try {
+    con = m_server.get_con_from_hdl(hdl);
+  } catch (websocketpp::exception const &e) {
+    av_packet_unref(&out_packet);
+    return;
+  }
+  bool use_envelope = conn_data->envelope_version > 0;
+  fragment_sink.Begin(con, use_envelope ? FrameEnvelope::SIZE : 0);
+  if (ret < 0 || out_packet.size == 0) {
+    std::cerr << "Final attempt to receive packet failed" << std::endl;
+  } else {
+    new_metadata = conn_data->metadata_queue.front();
+    conn_data->metadata_queue.pop();
+  }
+
+  if (out_packet.size > 0) {
+    out_packet.stream_index = 0;
+    ServerMetrics::clock::time_point mux_start = ServerMetrics::clock::now();
+    ret = av_write_frame(conn_data->out_fmt_ctx, &out_packet);
+    av_write_frame(conn_data->out_fmt_ctx, nullptr);
+    conn_data->histograms->RecordSince(ServerMetrics::MUX, mux_start);
+    if (ret < 0) {
+      av_make_error_string(err_buf, 256, ret);
+      std::cerr << "Muxxing failed " << err_buf << std::endl;
+    }
+  } else {
+    std::cerr << "Out pack size is 0, ret:" << ret << std::endl;
+  }
+
+  uint32_t frame_number = conn_data->sent_frame_number++;
+  std::string to_return_string;
+  if (use_envelope) {
+    FrameEnvelope envelope;
+    envelope.frame_number = frame_number;
+    envelope.center_x = new_metadata.center_x;
+    envelope.center_y = new_metadata.center_y;
+    envelope.packet_number = new_metadata.packet_number;
+    envelope.capture_timestamp_us = new_metadata.capture_timestamp_us;
+    envelope.send_timestamp_us = GetTimestampUs();
+    envelope.Write(fragment_sink.Header());
+  } else {
+    json to_return;
+    to_return["type"] = "image";
+    to_return["centerX"] = new_metadata.center_x;
+    to_return["centerY"] = new_metadata.center_y;
+    to_return["frameNum"] = frame_number % 256;
+    to_return_string = to_return.dump();
+  }
+  server::message_ptr fragment = fragment_sink.Finish();
+  ServerMetrics::clock::time_point send_start = ServerMetrics::clock::now();
+  websocketpp::lib::error_code ec;
+  if (!use_envelope) {
+    ec = con->send(to_return_string, websocketpp::frame::opcode::text);
+  }
+  if (!ec && fragment != NULL) {
+    ec = con->send(fragment);
+  }
+  if (ec) {
+    AbortSession(con, conn_data, ec);
+  }
+  conn_data->histograms->RecordSince(ServerMetrics::SEND, send_start);
+  av_packet_unref(&out_packet);
+  conn_data->histograms->RecordSince(ServerMetrics::FRAME,
+                                     new_metadata.release_time);
+  int64_t pipeline_delay_us =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          FrameScheduler::clock::now() - new_metadata.release_time)
+          .count();
+  int64_t smoothed_delay_us = conn_data->pipeline_delay_us;
+  conn_data->pipeline_delay_us =
+      smoothed_delay_us < 0 ? pipeline_delay_us
+                            : (7 * smoothed_delay_us + pipeline_delay_us) / 8;
+  SendPing(hdl, conn_data);
+
+  double frame_time_ms = std::chrono::duration<double, std::milli>(
+                             FrameScheduler::clock::now() -
+                             new_metadata.release_time)
+                             .count();
+  double budget_ms = 1000.0 / conn_data->source_pipeline->frame_rate;
+  if (conn_data->resolution_ladder.ReportFrameTime(frame_time_ms,
+                                                   budget_ms)) {
+    conn_data->resize_pending = true;
+  }
+}
+
+/**
+ * Sets up muxing to fMP4 and sends the header. Returns false and stops the
+ * session, without setting up the muxer, if the connection is gone.
+ */
+bool VideoServer::InitializeMuxer(websocketpp::connection_hdl hdl,
+                                  connection_data *conn_data) {
+  int ret = -1;
+  server::connection_ptr con;
+  try {
+    con = m_server.get_con_from_hdl(hdl);
+  } catch (websocketpp::exception const &e) {
+    conn_data->closing = true;
+    return false;
+  }
   VideoEncoder *video_encoder = conn_data->video_encoder;
-  SATDecoder *sat_decoder = conn_data->sat_decoder;
-  SATEncoder *sat_encoder = conn_data->sat_encoder;
-  AVFrame *output_frame = conn_data->output_frame;
-  AVFrame *rgb_frame = conn_data->rgb_frame;
-
-  int sv_count = 30;
-
-  int height = video_decoder->source_codec_ctx->height;
-  int width = video_decoder->source_codec_ctx->width;
-  int cl_source_frame_size = 4 * width * height * sizeof(uint8_t);
-  cl::Buffer cl_source_frame(cl_manager->context, CL_MEM_READ_WRITE,
-                             cl_source_frame_size);
-  int cl_sat_buffer_size = 3 * width * height * sizeof(uint32_t);
-  cl::Buffer cl_sat_buffer(cl_manager->context, CL_MEM_READ_WRITE,
-                           cl_sat_buffer_size);
-  int cl_output_buffer_size = output_frame->linesize[0] * output_frame->height;
-  cl::Buffer cl_output_buffer(cl_manager->context, CL_MEM_READ_WRITE,
-                              cl_output_buffer_size);
-
-  // Setup muxing variables to mux to fMP4
   AVOutputFormat *out_fmt = av_guess_format("mp4", NULL, NULL);
   AVFormatContext *out_fmt_ctx = NULL;
   ret = avformat_alloc_output_context2(&out_fmt_ctx, out_fmt, NULL, NULL);
   if (out_fmt_ctx == NULL || ret != 0) {
     std::cerr << "Failed to allocate output ctx2" << std::endl;
   }
-  uint8_t *avio_ctx_buffer = NULL;
+  conn_data->out_fmt_ctx = out_fmt_ctx;
   size_t avio_ctx_buffer_size = 1000000;
-  avio_ctx_buffer = (uint8_t *)av_malloc(avio_ctx_buffer_size);
-  IOOutput buffer;
-  buffer.bytesSet = 0;
-  buffer.maxSize = 1000000;
-  buffer.outBuffer = (uint8_t *)av_malloc(buffer.maxSize);
-
-  AVIOContext *avio_ctx =
-      avio_alloc_context(avio_ctx_buffer, avio_ctx_buffer_size, 1, &buffer,
-                         NULL, &WritePacket, NULL);
+  conn_data->avio_ctx_buffer = (uint8_t *)av_malloc(avio_ctx_buffer_size);
+  FragmentSink &fragment_sink = conn_data->fragment_sink;
+
+  AVIOContext *avio_ctx = avio_alloc_context(
+      conn_data->avio_ctx_buffer, avio_ctx_buffer_size, 1, &fragment_sink, NULL,
+      &FragmentSink::WritePacket, NULL);
   if (avio_ctx == NULL) {
     std::cerr << "Failed to allocate avio ctx" << std::endl;
   }
+  conn_data->avio_ctx = avio_ctx;
   avio_ctx->seekable = false;
   out_fmt_ctx->pb = avio_ctx;
-  AVDictionary *encode_opts = NULL;
   // Flags for fMP4
-  av_dict_set(&encode_opts, "movflags",
+  av_dict_set(&conn_data->encode_opts, "movflags",
               "frag_keyframe+empty_moov+default_base_moof", 0);
 
   AVStream *st = avformat_new_stream(out_fmt_ctx, video_encoder->video_codec);
@@ -270,158 +1090,54 @@ void VideoServer::SendFrameLoop(websocketpp::connection_hdl hdl,
             << st->avg_frame_rate.den << std::endl;
   st->duration = 0;
 
-  ret = avformat_write_header(out_fmt_ctx, &encode_opts);
+  bool use_envelope = conn_data->envelope_version > 0;
+  fragment_sink.Begin(con, use_envelope ? FrameEnvelope::SIZE : 0);
+  ret = avformat_write_header(out_fmt_ctx, &conn_data->encode_opts);
   if (ret < 0) {
     std::cerr << "Failed to write mp4 header" << std::endl;
     exit(EXIT_FAILURE);
   }
-  std::cerr << "Header size: " << buffer.bytesSet << std::endl;
-  m_server.send(hdl, buffer.outBuffer, buffer.bytesSet,
-                websocketpp::frame::opcode::binary);
-  buffer.bytesSet = 0;
-  // Finished setting up muxing parameters to mux to fMP4.
-
-  // Demux, decode, and convert from the video file into an RGB frame
-  int frame_number = 0;
-  int sent_frame_number = 0;
-  while (continue_loop) {
-    conn_data->wait_mutex.lock();
-    attempts = 0;
-    ret = -1;
-    ret = video_decoder->GetFrame(rgb_frame, AV_PIX_FMT_RGB0);
-    bool got_rgb_frame = (ret == 0);
-    if (got_rgb_frame) {
-      frame_number++;
-
-      // Create Summed Area Table
-      ret =
-          cl::copy(cl_manager->command_queue, rgb_frame->data[0],
-                   rgb_frame->data[0] + cl_source_frame_size, cl_source_frame);
-      sat_encoder->EncodeFrameGPU(cl_sat_buffer(), cl_source_frame(), width,
-                                  height, rgb_frame->linesize[0]);
-      clFlush(cl_manager->command_queue());
-      clFinish(cl_manager->command_queue());
-    } else {
-      // std::cout << "Failed to get rgb frame" << std::endl;
-    }
-
-    // Sleep until we're ready
-    conn_data->wait_mutex.unlock();
-    double time_since_checkpoint =
-        duration<double, std::milli>(high_resolution_clock::now() -
-                                     checkpoint_time)
-            .count();
-    double time_to_sleep = (1000.0 / 30.0) - time_since_checkpoint;
-    if (time_to_sleep > 0) {
-      std::this_thread::sleep_for(
-          std::chrono::duration<double, std::milli>(time_to_sleep));
-    }
-    if (conn_data->exit_thread) {
-      break;
-    }
-
-    // Done sleeping. Grab the latest gaze position.
-    conn_data->wait_mutex.lock();
-    conn_data->center_xy_mutex.lock();
-    double center_x = conn_data->center_x;
-    double center_y = conn_data->center_y;
-    conn_data->center_xy_mutex.unlock();
-    checkpoint_time = high_resolution_clock::now();
-
-    // Sample from the summed area table based on the gaze position.
-    std::vector<uint32_t> tt(3 * width * height);
-
-    clFlush(cl_manager->command_queue());
-    clFinish(cl_manager->command_queue());
-    sat_decoder->SampleFrameRectGPU(
-        cl_output_buffer(), output_frame->width, output_frame->height,
-        output_frame->linesize[0], cl_sat_buffer(),
-        video_decoder->source_codec_ctx, center_x, center_y);
-    output_frame->pts = rgb_frame->pts;
-    output_frame->pkt_dts = rgb_frame->pkt_dts;
-    ret = cl::copy(cl_manager->command_queue, cl_output_buffer,
-                   output_frame->data[0],
-                   output_frame->data[0] +
-                       (output_frame->height * output_frame->linesize[0]));
-    if (ret != CL_SUCCESS) {
-      std::cerr << "Failed to copy output frame out. " << ret << " "
-                << OpenCLManager::GetCLErrorString(ret) << std::endl;
-      exit(EXIT_FAILURE);
-    }
-
-    // This will be the new gaze position.
-    frame_metadata new_metadata;
-    new_metadata.center_x = center_x;
-    new_metadata.center_y = center_y;
-    conn_data->metadata_queue.push(new_metadata);
-
-    AVPacket out_packet;
-    av_init_packet(&out_packet);
-    out_packet.size = 0;
-    out_packet.data = NULL;
-
-    attempts = 0;
-    ret = video_encoder->EncodeFrame(&out_packet, output_frame);
-    while ((ret < 0 || out_packet.size == 0) && attempts < 20) {
-      // av_make_error_string(err_buf, 256, ret);
-      // cout << "Failed to receive packet from encoder, trying again. " <<
-      // err_buf
-      //  << std::endl;
-      // Sleep for 1ms
-      std::this_thread::sleep_for(std::chrono::milliseconds(1));
-      ret = video_encoder->GetPacket(&out_packet);
-      attempts++;
-    }
-    if (ret < 0 || out_packet.size == 0) {
-      std::cerr << "Final attempt to receive packet failed" << std::endl;
-    } else {
-      new_metadata = conn_data->metadata_queue.front();
-      conn_data->metadata_queue.pop();
-    }
-
-    // std::cerr << "Out packet size: " << out_packet.size << std::endl;
-
-    if (out_packet.size > 0) {
-      out_packet.stream_index = 0;
-      ret = av_write_frame(out_fmt_ctx, &out_packet);
-      av_write_frame(out_fmt_ctx, nullptr);
-      if (ret < 0) {
-        av_make_error_string(err_buf, 256, ret);
-        std::cerr << "Muxxing failed " << err_buf << std::endl;
-      }
-    } else {
-      std::cerr << "Out pack size is 0, ret:" << ret << std::endl;
-    }
-
-    json to_return;
-    to_return["type"] = "image";
-    to_return["centerX"] = new_metadata.center_x;
-    to_return["centerY"] = new_metadata.center_y;
-    to_return["frameNum"] = sent_frame_number;
-    sent_frame_number = (sent_frame_number + 1) % 256;
-    std::string to_return_string = to_return.dump();
-    try {
-      m_server.send(hdl, to_return_string, websocketpp::frame::opcode::text);
-      m_server.send(hdl, buffer.outBuffer, buffer.bytesSet,
-                    websocketpp::frame::opcode::binary);
-      buffer.bytesSet = 0;
-    } catch (websocketpp::exception const &e) {
-      std::cerr << "Websocket send failed: "
-                << "(" << e.what() << ")" << std::endl;
-    }
-    av_packet_unref(&out_packet);
-    std::memset(output_frame->data[0], 0,
-                output_frame->height * output_frame->linesize[0]);
-    conn_data->wait_mutex.unlock();
+  // The header stays in the avio buffer until flushed.
+  avio_flush(avio_ctx);
+  std::cerr << "Header size: " << fragment_sink.Size() << std::endl;
+  if (use_envelope) {
+    FrameEnvelope envelope;
+    envelope.kind = FrameEnvelope::INIT_SEGMENT;
+    envelope.send_timestamp_us = GetTimestampUs();
+    envelope.Write(fragment_sink.Header());
   }
+  websocketpp::lib::error_code ec = con->send(fragment_sink.Finish());
+  if (ec) {
+    AbortSession(con, conn_data, ec);
+    return false;
+  }
+  return true;
+}
 
-  av_write_frame(out_fmt_ctx, nullptr);
-
-  av_free(avio_ctx);
-  av_dict_free(&encode_opts);
-  av_free(avio_ctx_buffer);
-  av_free(buffer.outBuffer);
+/**
+ * Stops a session whose connection failed to send, e.g. because it closed
+ * or its send buffer is full. Its steps return immediately from now on and
+ * the connection is closed, which frees the session in on_close.
+ */
+void VideoServer::AbortSession(server::connection_ptr con,
+                               connection_data *conn_data,
+                               websocketpp::lib::error_code send_error) {
+  if (conn_data->closing.exchange(true)) {
+    return;
+  }
+  std::cerr << "[VideoServer] Session " << conn_data->sessionid
+            << ": websocket send failed: " << send_error.message()
+            << std::endl;
+  websocketpp::lib::error_code ec;
+  con->close(websocketpp::close::status::going_away, "Send failed", ec);
+}
 
-  std::cerr << "Exiting Send Frame Loop" << std::endl;
-  conn_data->kill_thread_mutex.unlock();
+void VideoServer::FreeMuxer(connection_data *conn_data) {
+  avformat_free_context(conn_data->out_fmt_ctx);
+  conn_data->out_fmt_ctx = NULL;
+  av_free(conn_data->avio_ctx);
+  conn_data->avio_ctx = NULL;
+  av_dict_free(&conn_data->encode_opts);
+  av_free(conn_data->avio_ctx_buffer);
+  conn_data->avio_ctx_buffer = NULL;
 }
@@ -2,8 +2,13 @@
 
 #include <cpp-base64/base64.h>
 #include <zlib.h>
+#include <atomic>
 #include <chrono>
+#include <deque>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <nlohmann/json.hpp>
 #include <thread>
 #include <websocketpp/config/asio_no_tls.hpp>
@@ -16,11 +21,22 @@ extern "C" {
 #include <libswscale/swscale.h>
 }
 
+#include "bounded_queue.h"
+#include "fragment_sink.h"
+#include "frame_envelope.h"
+#include "frame_scheduler.h"
+#include "gaze_predictor.h"
+#include "gaze_slot.h"
 #include "opencl_manager.h"
 #include "parameters.h"
+#include "resolution_ladder.h"
 #include "sat_decoder.h"
 #include "sat_encoder.h"
 #include "save_frame.h"
+#include "server_metrics.h"
+#include "session_executor.h"
+#include "source_pipeline.h"
+#include "video_catalog.h"
 #include "video_decoder.h"
 #include "video_encoder.h"
 
@@ -29,29 +45,114 @@ class VideoServer {
   struct frame_metadata {
     float center_x;
     float center_y;
+    int64_t packet_number;
+    int64_t capture_timestamp_us;
+    FrameScheduler::clock::time_point release_time;
   };
+  // A frame sampled on the GPU whose readback may still be in flight.
+  struct sampled_frame {
+    int output_index;
+    // Frames sampled into the output, one per gaze candidate.
+    int candidate_count = 1;
+    // Only set when sampling SAT factors or a lattice SAT. A lattice SAT
+    // takes several kernels, from reduce_start_event to reduce_event.
+    cl::Event reduce_start_event;
+    cl::Event reduce_event;
+    cl::Event sample_event;
+    // Enqueued once a candidate is selected.
+    cl::Event readback_event;
+    // Keeps the SAT alive until the sampling kernel has run.
+    std::shared_ptr<const SourcePipeline::SATFrame> sat_frame;
+    frame_metadata metadata;
+    FrameScheduler::clock::time_point release_time;
+    FrameScheduler::clock::time_point deadline;
+  };
+  static const int OUTPUT_FRAME_COUNT = 3;
   struct connection_data {
     int sessionid;
     int current_frame;
 
+    // Decoding and SAT creation are shared with all sessions on this video.
+    std::shared_ptr<SourcePipeline> source_pipeline;
+    // Own command queue on the shared OpenCL context, with profiling.
     OpenCLManager *cl_manager;
-    VideoDecoder *video_decoder;
     VideoEncoder *video_encoder;
-    SATEncoder *sat_encoder;
     SATDecoder *sat_decoder;
-    AVFrame *rgb_frame;
-    AVFrame *output_frame;
-    float center_x = 0.0;
-    float center_y = 0.0;
-    bool exit_thread = false;
+    // Builds the session's lattice SAT when the pipeline is in lattice mode.
+    SATEncoder *sat_encoder = NULL;
+    // Output frames and their device buffers, indexed by output_index.
+    // All outputs have the resolution of the current ladder rung.
+    std::vector<AVFrame *> output_frames;
+    std::vector<cl::Buffer> cl_output_buffers;
+    // SAT at the grid points, rebuilt for every frame from SAT factors or
+    // the decoded frame. Only allocated when the pipeline serves an SVDStore
+    // or is in lattice mode.
+    cl::Buffer cl_reduced_sat_buffer;
+    // Speculative sampling. With more than one candidate, each output buffer
+    // holds gaze_candidates frames and the encode step reads back the one
+    // nearest the freshest gaze. Centers are kept per output until the
+    // frames are sampled.
+    int gaze_candidates = 1;
+    std::vector<cl::Buffer> cl_candidate_centers;
+    std::vector<cl_float2> candidate_centers;
+    // The sample step takes free outputs and hands sampled frames to the
+    // encode step, which returns the outputs once they are encoded. Only one
+    // sample step runs at a time per session, as it holds sample_mutex.
+    std::mutex sample_mutex;
+    BoundedQueue<int> free_outputs{OUTPUT_FRAME_COUNT};
+    std::mutex sampled_frames_mutex;
+    std::deque<sampled_frame> sampled_frames;
+    // Latest gaze from frameRequest messages.
+    GazeSlot gaze_slot;
+    // Fed every frameRequest. Frames are sampled at the gaze it predicts for
+    // when they are displayed, release to send time plus a round trip after
+    // the sample step.
+    std::mutex gaze_predictor_mutex;
+    std::unique_ptr<GazePredictor> gaze_predictor;
+    // Smoothed, -1 until measured. The round trip is measured with
+    // websocket pings.
+    std::atomic<int64_t> rtt_us{-1};
+    std::atomic<int64_t> pipeline_delay_us{-1};
+    int64_t last_ping_us = 0;
+    // Acks are only sent if requested in the videoRequest. At most one ack
+    // is sent per frame, carrying the latest packetNumber.
+    bool send_acks = false;
+    int64_t last_acked_packet_number = -1;
+    // Negotiated FrameEnvelope version, 0 for JSON image messages.
+    int envelope_version = 0;
+    std::atomic<bool> closing{false};
+    // Holds on the session: one for the connection until it closes, plus one
+    // per step queued on or running in the session executor. The session is
+    // freed by whichever drops this to zero.
+    std::atomic<int> pending_steps{1};
 
-    std::thread *thread;
-    std::mutex wait_mutex;
-    std::mutex center_xy_mutex;
-    // Do not kill the thread while this mutex is locked
-    std::mutex kill_thread_mutex;
+    // Encode step state. Only one encode step runs at a time per session.
+    std::mutex encode_mutex;
+    std::atomic<bool> encode_requested{false};
     std::queue<VideoServer::frame_metadata> metadata_queue;
+    AVPacket out_packet;
+    bool awaiting_packet = false;
+    int packet_attempts = 0;
+    uint32_t sent_frame_number = 0;
+    // fMP4 muxer writing into fragment_sink.
+    AVFormatContext *out_fmt_ctx = NULL;
+    AVIOContext *avio_ctx = NULL;
+    uint8_t *avio_ctx_buffer = NULL;
+    AVDictionary *encode_opts = NULL;
+    FragmentSink fragment_sink;
+    // Reduced buffer resolution, stepped by frame time for clients that
+    // asked for resizing in the videoRequest. A resize waits until the
+    // encode step holds every output, then starts a new encoder, whose first
+    // frame is a keyframe.
+    ResolutionLadder resolution_ladder{ResolutionLadder::DefaultRungs(),
+                                       ResolutionLadder::DefaultStartRung()};
+    std::atomic<bool> resize_pending{false};
+    std::vector<int> held_outputs;
+    // Per-stage latencies, also recorded into the global histograms.
+    std::shared_ptr<ServerMetrics::StageHistograms> histograms;
   };
+  typedef void (VideoServer::*session_step)(websocketpp::connection_hdl hdl,
+                                            connection_data *conn_data);
 
   VideoServer();
   ~VideoServer();
@@ -59,29 +160,75 @@ class VideoServer {
   void on_open(websocketpp::connection_hdl hdl);
   void on_message(websocketpp::connection_hdl, server::message_ptr msg);
   void on_close(websocketpp::connection_hdl hdl);
+  void on_http(websocketpp::connection_hdl hdl);
+  void on_pong(websocketpp::connection_hdl hdl, std::string payload);
   void Run(uint16_t port);
-  static int WritePacket(void *opaque, uint8_t *buffer, int buf_size);
 
  private:
- struct IOOutput {
-    uint8_t* outBuffer;
-    int bytesSet;
-    int maxSize;
-  };
   typedef std::map<websocketpp::connection_hdl, connection_data *,
                    std::owner_less<websocketpp::connection_hdl>>
       con_list;
+  typedef std::map<std::string, std::weak_ptr<SourcePipeline>>
+      source_pipeline_list;
 
   int m_next_sessionid;
   server m_server;
+  FrameScheduler m_frame_scheduler;
+  SessionExecutor m_session_executor;
+  ServerMetrics m_metrics;
+  // Outlives the pipelines, which return their decoders to it.
+  VideoCatalog m_catalog{VIDEO_DIRECTORY, CATALOG_DECODER_POOL_SIZE,
+                         CATALOG_SPARE_ENCODERS, CATALOG_PRECOMPUTE_GRIDS};
   con_list m_connections;
+  source_pipeline_list m_source_pipelines;
+  // When each video was first opened. Pipelines reopened after their last
+  // session left resume where the video would be had it kept playing.
+  std::map<std::string, std::chrono::steady_clock::time_point>
+      m_playback_starts;
+  std::mutex m_source_pipelines_mutex;
   connection_data *GetConnectionDataFromHdl(websocketpp::connection_hdl hdl);
   void HandleTextMessage(websocketpp::connection_hdl hdl,
                          nlohmann::json received_arr);
   void HandleFrameRequest(websocketpp::connection_hdl hdl,
                           nlohmann::json received_arr);
-  void SendFrameLoop(websocketpp::connection_hdl hdl,
+  static int64_t GetTimestampUs();
+  void SendAck(websocketpp::connection_hdl hdl, connection_data *conn_data,
+               int64_t packet_number);
+  void SendPing(websocketpp::connection_hdl hdl, connection_data *conn_data);
+  void PredictGaze(connection_data *conn_data, GazeSlot::Sample *gaze,
+                   int64_t elapsed_us = 0);
+  int ChooseGazeCandidates(connection_data *conn_data,
+                           const GazeSlot::Sample &gaze,
+                           const GazeSlot::Sample &predicted,
+                           cl_float2 *centers);
+  void ReadBackCandidate(connection_data *conn_data, sampled_frame *sampled,
+                         int candidate);
+  void SelectGazeCandidate(connection_data *conn_data, sampled_frame *sampled);
+  void PostSessionStep(websocketpp::connection_hdl hdl,
+                       connection_data *conn_data, session_step step,
+                       SessionExecutor::clock::time_point deadline,
+                       SessionExecutor::clock::duration delay =
+                           SessionExecutor::clock::duration::zero());
+  void SampleStep(websocketpp::connection_hdl hdl, connection_data *conn_data);
+  void EncodeStep(websocketpp::connection_hdl hdl, connection_data *conn_data);
+  bool EncodeSampledFrames(websocketpp::connection_hdl hdl,
+                           connection_data *conn_data);
+  bool ResizeOutputs(websocketpp::connection_hdl hdl,
                      connection_data *conn_data);
+  void AllocateOutputs(connection_data *conn_data);
+  void FreeOutputs(connection_data *conn_data);
+  static size_t GetOutputFrameSize(AVFrame *output_frame);
+  void SendEncodedFrame(websocketpp::connection_hdl hdl,
+                        connection_data *conn_data, int ret,
+                        frame_metadata new_metadata);
+  bool InitializeMuxer(websocketpp::connection_hdl hdl,
+                       connection_data *conn_data);
+  void FreeMuxer(connection_data *conn_data);
+  void AbortSession(server::connection_ptr con, connection_data *conn_data,
+                    websocketpp::lib::error_code send_error);
+  std::shared_ptr<SourcePipeline> GetSourcePipeline(
+      const VideoCatalog::VideoInfo &video);
   void InitializeConnectionData(websocketpp::connection_hdl hdl, connection_data *data, std::string video_request);
   void DestroyConnectionData(websocketpp::connection_hdl hdl);
+  void ReleaseConnectionData(connection_data *data);
 };